@@ -27,10 +27,13 @@ int BuildTargetGen::AddInputs(const TraceNode& node,
                               pb::BuildTarget* target,
                               const QSet<QString>& valid_extensions,
                               int limit) {
+  const Graph<TraceNode>& graph = make_->graph();
   int ret = 0;
-  for (const TraceNode& input : make_->graph().Incoming(node)) {
-    if ((input.type_ != TraceNode::Type::SourceFile &&
-         input.type_ != TraceNode::Type::GeneratedFile) ||
+  for (Graph<TraceNode>::Handle handle :
+       graph.IncomingHandles(graph.FindHandle(node.Key()))) {
+    const TraceNode& input = graph.node(handle);
+    if ((input.type() != TraceNode::Type::SourceFile &&
+         input.type() != TraceNode::Type::GeneratedFile) ||
         (!valid_extensions.isEmpty() &&
          !valid_extensions.contains(
            utils::path::Extension(input.Filename())))) {
@@ -57,9 +60,12 @@ int BuildTargetGen::AddOutputs(const TraceNode& node,
                                pb::BuildTarget* target,
                                const QSet<QString>& valid_extensions,
                                int limit) {
+  const Graph<TraceNode>& graph = make_->graph();
   int ret = 0;
-  for (const TraceNode& output : make_->graph().Outgoing(node)) {
-    if (output.type_ != TraceNode::Type::GeneratedFile ||
+  for (Graph<TraceNode>::Handle handle :
+       graph.OutgoingHandles(graph.FindHandle(node.Key()))) {
+    const TraceNode& output = graph.node(handle);
+    if (output.type() != TraceNode::Type::GeneratedFile ||
         (!valid_extensions.isEmpty() &&
          !valid_extensions.contains(
            utils::path::Extension(output.Filename())))) {
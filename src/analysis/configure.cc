@@ -38,8 +38,8 @@ bool Configure::Run(const Options& opts) {
 }
 
 bool Configure::OpenTrace() {
-  auto file = make_unique<utils::RecordFile<pb::Record>>(opts_.trace_filename);
-  if (!file->Open(QIODevice::ReadOnly)) {
+  auto file = utils::OpenRecordReader<pb::Record>(opts_.trace_filename);
+  if (!file) {
     LOG(ERROR) << "Failed to open " << opts_.trace_filename << " for reading";
     return false;
   }
@@ -51,24 +51,24 @@ bool Configure::OpenTrace() {
 void Configure::FindCreatedFiles() {
   QSet<QString> filenames;
   for (const FileEvent& event : trace_.events()) {
-    const pb::Process* pb = &trace_.process(event.process_id);
-    const pb::File* file = &pb->files(event.file_index);
+    const TraceReader::File file =
+        trace_.file(event.process_id, event.file_index);
 
-    if (file->filename().startsWith("/")) {
+    if (file.filename().startsWith("/")) {
       continue;
     }
 
-    if (file->has_renamed_from()) {
-      filenames.remove(file->renamed_from());
-      filenames.insert(file->filename());
+    if (file.has_renamed_from()) {
+      filenames.remove(file.renamed_from());
+      filenames.insert(file.filename());
     } else {
-      switch (file->access()) {
+      switch (file.access()) {
         case pb::File_Access_CREATED:
         case pb::File_Access_WRITTEN_BUT_UNCHANGED:
-          filenames.insert(file->filename());
+          filenames.insert(file.filename());
           break;
         case pb::File_Access_DELETED:
-          filenames.remove(file->filename());
+          filenames.remove(file.filename());
           break;
         default:
           break;
@@ -99,8 +99,8 @@ void Configure::FindCreatedFiles() {
 }
 
 bool Configure::WriteOutput() {
-  utils::RecordFile<pb::Record> output(opts_.output_filename);
-  if (!output.Open(QIODevice::WriteOnly)) {
+  utils::BufferedRecordWriter<pb::Record> output(opts_.output_filename);
+  if (!output.Open()) {
     LOG(ERROR) << "Failed to open " << opts_.output_filename << " for writing";
     return false;
   }
@@ -113,6 +113,11 @@ bool Configure::WriteOutput() {
   configure_record.mutable_configure_output()->CopyFrom(output_);
   output.WriteRecord(configure_record);
 
+  if (!output.Close()) {
+    LOG(ERROR) << "Failed to write " << opts_.output_filename;
+    return false;
+  }
+
   LOG(INFO) << "Written " << output_.generated_file_size()
             << " filenames to " << opts_.output_filename;
   return true;
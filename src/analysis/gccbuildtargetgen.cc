@@ -54,12 +54,12 @@ GccBuildTargetGen::GccBuildTargetGen()
 }
 
 bool GccBuildTargetGen::Gen(const TraceNode& node, pb::BuildTarget* target) {
-  if (node.type_ != TraceNode::Type::CompileStep &&
-      node.type_ != TraceNode::Type::DynamicLinkStep) {
+  if (node.type() != TraceNode::Type::CompileStep &&
+      node.type() != TraceNode::Type::DynamicLinkStep) {
     return false;
   }
 
-  const pb::Process& proc = make_->process(node.process_id_);
+  const TraceReader::Process proc = make_->process(node.process_id());
 
   QStringList flags;
   QSet<QString> library_search_path;
@@ -81,10 +81,10 @@ bool GccBuildTargetGen::Gen(const TraceNode& node, pb::BuildTarget* target) {
   const bool is_cc = proc.filename().endsWith("++");
 
   for (int i = 1; i < proc.argv_size(); ++i) {
-    const QString arg = proc.argv()[i];
+    const QString arg = proc.argv(i);
     QString next_arg;
     if (i < proc.argv_size() - 1) {
-      next_arg = proc.argv()[i + 1];
+      next_arg = proc.argv(i + 1);
     }
 
     if (arg.startsWith("-Wl,") ||
@@ -154,10 +154,10 @@ bool GccBuildTargetGen::Gen(const TraceNode& node, pb::BuildTarget* target) {
     }
   }
 
-  CHECK((is_compile && node.type_ == TraceNode::Type::CompileStep) ||
-        (!is_compile && node.type_ == TraceNode::Type::DynamicLinkStep))
+  CHECK((is_compile && node.type() == TraceNode::Type::CompileStep) ||
+        (!is_compile && node.type() == TraceNode::Type::DynamicLinkStep))
       << "is_compile: " << is_compile << ", node: " << node.ID()
-      << " (" << static_cast<int>(node.type_) << ")";
+      << " (" << static_cast<int>(node.type()) << ")";
 
   // Add the flags and header/library search paths.
   if (is_compile) {
@@ -175,11 +175,11 @@ bool GccBuildTargetGen::Gen(const TraceNode& node, pb::BuildTarget* target) {
       }
     }
 
-    const pb::Process& frontend =
-        make_->process(node.compiler_frontend_process_id_);
+    const int frontend_id = node.compiler_frontend_process_id();
 
     QSet<QString> headers;
-    for (const pb::File& file : frontend.files()) {
+    for (int i = 0; i < make_->file_count(frontend_id); ++i) {
+      const TraceReader::File file = make_->file(frontend_id, i);
       if (file.access() == pb::File_Access_READ &&
           file.filename().endsWith(".h")) {
         headers.insert(file.filename());
@@ -218,9 +218,9 @@ bool GccBuildTargetGen::Gen(const TraceNode& node, pb::BuildTarget* target) {
   }
 
   if (is_compile) {
-    target->set_qualified_name(make_->NewTargetName(target->srcs(0).name()));
+    target->set_qualified_name(make_->TargetName(target->srcs(0).name()));
   } else {
-    target->set_qualified_name(make_->NewTargetName(target->outputs(0).name()));
+    target->set_qualified_name(make_->TargetName(target->outputs(0).name()));
   }
   return true;
 }
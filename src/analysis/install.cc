@@ -23,21 +23,27 @@ Install::Install(const Options& opts)
     : opts_(opts) {
 }
 
-bool Install::Run(const Options& opts) {
+bool Install::Run(const Options& opts,
+                  InstalledFilesReader* installed_files) {
   Install i(opts);
   if (!i.OpenTrace()) {
     return false;
   }
   i.FindInstalledFiles();
-  if (!i.WriteOutput()) {
+  if (installed_files) {
+    for (const pb::InstalledFile& file : i.files_) {
+      installed_files->Add(file);
+    }
+  }
+  if (!opts.output_filename.isEmpty() && !i.WriteOutput()) {
     return false;
   }
   return true;
 }
 
 bool Install::OpenTrace() {
-  auto file = make_unique<utils::RecordFile<pb::Record>>(opts_.trace_filename);
-  if (!file->Open(QIODevice::ReadOnly)) {
+  auto file = utils::OpenRecordReader<pb::Record>(opts_.trace_filename);
+  if (!file) {
     LOG(ERROR) << "Failed to open " << opts_.trace_filename << " for reading";
     return false;
   }
@@ -50,24 +56,24 @@ void Install::FindInstalledFiles() {
   QMap<QByteArray, pb::Reference> project_files;
   QMap<pb::Reference, QByteArray> installed_files;
   for (const FileEvent& event : trace_.events()) {
-    const pb::Process* proc = &trace_.process(event.process_id);
-    const pb::File* file = &proc->files(event.file_index);
+    const TraceReader::File file =
+        trace_.file(event.process_id, event.file_index);
 
     pb::Reference ref;
-    CreateReference(trace_.metadata(), file->filename(), &ref);
+    CreateReference(trace_.metadata(), file.filename(), &ref);
 
-    if (file->has_sha1_before() &&
-        file->access() == pb::File_Access_READ &&
+    if (file.has_sha1_before() &&
+        file.access() == pb::File_Access_READ &&
         (ref.type() == pb::Reference_Type_RELATIVE_TO_BUILD_DIR ||
          ref.type() == pb::Reference_Type_RELATIVE_TO_PROJECT_ROOT)) {
-      project_files[file->sha1_before()] = ref;
+      project_files[file.sha1_before()] = ref;
     }
 
     // Don't check for access type - files that exist already with the same
     // contents will count as a read-only access.
-    if (file->has_sha1_after() &&
+    if (file.has_sha1_after() &&
         ref.type() == pb::Reference_Type_ABSOLUTE) {
-      installed_files[ref] = file->sha1_after();
+      installed_files[ref] = file.sha1_after();
     }
   }
 
@@ -105,8 +111,8 @@ void Install::FindInstalledFiles() {
 }
 
 bool Install::WriteOutput() {
-  utils::RecordFile<pb::Record> output(opts_.output_filename);
-  if (!output.Open(QIODevice::WriteOnly)) {
+  utils::BufferedRecordWriter<pb::Record> output(opts_.output_filename);
+  if (!output.Open()) {
     LOG(ERROR) << "Failed to open " << opts_.output_filename << " for writing";
     return false;
   }
@@ -121,6 +127,11 @@ bool Install::WriteOutput() {
     output.WriteRecord(record);
   }
 
+  if (!output.Close()) {
+    LOG(ERROR) << "Failed to write " << opts_.output_filename;
+    return false;
+  }
+
   LOG(INFO) << "Written " << files_.count() << " installed files to "
             << opts_.output_filename;
   return true;
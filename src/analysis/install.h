@@ -15,6 +15,7 @@
 #ifndef ANALYSIS_INSTALL_H_
 #define ANALYSIS_INSTALL_H_
 
+#include "installedfilesreader.h"
 #include "tracer.pb.h"
 #include "tracereader.h"
 #include "utils/recordfile.h"
@@ -27,11 +28,13 @@ class Install {
     // Read trace records from this file.
     QString trace_filename;
 
-    // Write InstalledFile records to this file.
+    // Write InstalledFile records to this file, unless it's empty.
     QString output_filename;
   };
 
-  static bool Run(const Options& opts);
+  // If installed_files is not null the files found are also added to it.
+  static bool Run(const Options& opts,
+                  InstalledFilesReader* installed_files = nullptr);
 
  private:
   Install(const Options& opts);
@@ -15,17 +15,21 @@
 #include "analysis/make.h"
 
 #include <iostream>
+#include <limits>
 
 #include "buildtargetgen.h"
 #include "common.h"
 #include "gccbuildtargetgen.h"
+#include "make_unique.h"
 #include "reference.h"
 #include "staticlinkbuildtargetgen.h"
 #include "targetmatchnode.h"
 #include "utils/path.h"
 #include "utils/str.h"
 
-#include <QRegularExpression>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QtConcurrentMap>
 
 using utils::path::Extension;
 using utils::path::Filename;
@@ -51,6 +55,19 @@ void ReplaceStrings(QStringList* field,
   }
 }
 
+// Gives records from a running trace to a TraceReader.
+class LiveTraceWriter : public utils::RecordWriter<pb::Record> {
+ public:
+  explicit LiveTraceWriter(TraceReader* trace) : trace_(trace) {}
+
+  void WriteRecord(const pb::Record& record) override {
+    trace_->AddRecord(record);
+  }
+
+ private:
+  TraceReader* trace_;
+};
+
 }  // namespace
 
 
@@ -65,81 +82,186 @@ Make::Make(const Options& opts)
 Make::~Make() {
 }
 
-void Make::AddEdgeFromFile(const FileEvent& event) {
-  const pb::Process* pb = &process(event.process_id);
-  const pb::File* file = &pb->files(event.file_index);
+// The nodes an event adds to the graph.  Working these out only reads the
+// trace, so it can be done in parallel before the nodes are added.
+struct Make::ResolvedEvent {
+  struct Node {
+    TraceNode node;
+    TraceNode::KeyType key;
+    QString index_key;
+    QString lookup_key;
+  };
+
+  const FileEvent* event = nullptr;
+  Node process;
+  bool renamed = false;
+
+  // If the event read the file, the node it's read from is generated_read if
+  // that has already been written, otherwise source_read.
+  bool has_read = false;
+  bool has_source_read = false;
+  Node generated_read;
+  Node source_read;
+
+  bool has_write = false;
+  Node written;
+};
+
+void Make::BuildGraph() {
+  // Events are resolved in parallel a batch at a time, then added to the
+  // graph in order.  Whether a read is of a generated file depends on the
+  // events before it, so that's left for the sequential part.
+  const int kBatchSize = 65536;
+  const QVector<FileEvent>& events = trace_.events();
+  for (int begin = 0; begin < events.count(); begin += kBatchSize) {
+    const int end = qMin(begin + kBatchSize, events.count());
+    QVector<ResolvedEvent> batch(end - begin);
+    for (int i = begin; i < end; ++i) {
+      batch[i - begin].event = &events[i];
+    }
+    QtConcurrent::blockingMap(batch, [this](ResolvedEvent& resolved) {
+      ResolveEvent(&resolved);
+    });
+    for (const ResolvedEvent& resolved : batch) {
+      AddResolvedEvent(resolved);
+    }
+  }
+  RemoveUnconnectedProcesses();
+}
+
+void Make::AddEventToGraph(const FileEvent& event) {
+  ResolvedEvent resolved;
+  resolved.event = &event;
+  ResolveEvent(&resolved);
+  AddResolvedEvent(resolved);
+}
+
+void Make::ResolveEvent(ResolvedEvent* resolved) {
+  auto resolve_node = [](const TraceNode& node, ResolvedEvent::Node* ret) {
+    ret->node = node;
+    ret->key = node.Key();
+    ret->index_key = node.IndexKey();
+    ret->lookup_key = node.LookupKey();
+  };
+
+  const FileEvent& event = *resolved->event;
+  const TraceReader::Process pb = process(event.process_id);
+  const TraceReader::File file = pb.file(event.file_index);
+
+  resolve_node(TraceNode::Process(this, pb.id()), &resolved->process);
+  if (file.has_renamed_from()) {
+    resolved->renamed = true;
+    return;
+  }
 
-  const TraceNode proc_node = TraceNode::Process(this, pb->id());
+  switch (file.access()) {
+    case pb::File_Access_READ:
+      resolved->has_read = true;
+      break;
+    case pb::File_Access_MODIFIED:
+    case pb::File_Access_WRITTEN_BUT_UNCHANGED:
+      resolved->has_read = true;
+      // Fallthrough
+    case pb::File_Access_CREATED:
+      resolved->has_write = true;
+      break;
+    case pb::File_Access_DELETED:
+      break;
+  }
 
-  // If it was a file we read from the project root, and that file hadn't
-  // previously been generated, then it's a source file.
-  const TraceNode gen_node = TraceNode::GeneratedFile(this, pb->id(),
-                                                      event.file_index,
-                                                      file->sha1_before());
-  if (graph_.HasNode(gen_node)) {
-    graph_.AddEdge(gen_node, proc_node);
-  } else if (!file->filename().startsWith("/")) {
-    graph_.AddEdge(TraceNode::SourceFile(this, file->filename()), proc_node);
+  if (resolved->has_read) {
+    resolve_node(TraceNode::GeneratedFile(this, file.filename_id(),
+                                          file.sha1_before_id()),
+                 &resolved->generated_read);
+
+    // If it was a file we read from the project root, and that file hadn't
+    // previously been generated, then it's a source file.
+    if (!file.filename().startsWith("/")) {
+      resolved->has_source_read = true;
+      resolve_node(TraceNode::SourceFile(this, file.filename_id()),
+                   &resolved->source_read);
+    }
+  }
+  if (resolved->has_write) {
+    resolve_node(TraceNode::GeneratedFile(this, file.filename_id(),
+                                          file.sha1_after_id()),
+                 &resolved->written);
   }
 }
 
-void Make::BuildGraph() {
-  for (const FileEvent& event : trace_.events()) {
-    const pb::Process* pb = &process(event.process_id);
-    const pb::File* file = &pb->files(event.file_index);
-
-    const TraceNode proc_node = TraceNode::Process(this, pb->id());
-    graph_.AddNode(proc_node);
-
-    if (file->has_renamed_from()) {
-      // Find the original node and replace its path.
-      for (const TraceNode& node : graph_.AllNodes()) {
-        if ((node.type_ == TraceNode::Type::SourceFile ||
-             node.type_ == TraceNode::Type::GeneratedFile) &&
-            node.Filename() == file->renamed_from()) {
-          TraceNode replacement = node;
-          if (replacement.type_ == TraceNode::Type::SourceFile) {
-            replacement.source_filename_ = file->filename();
-          } else {
-            replacement.process_id_ = pb->id();
-            replacement.file_index_ = event.file_index;
-          }
-          LOG(INFO) << "Replacing " << node.Filename() << " with " << replacement.Filename();
-          graph_.ReplaceSubgraph({node}, replacement);
-          break;
-        }
-      }
-    } else {
-      switch (file->access()) {
-        case pb::File_Access_READ:
-          AddEdgeFromFile(event);
-          break;
-        case pb::File_Access_MODIFIED:
-        case pb::File_Access_WRITTEN_BUT_UNCHANGED:
-          AddEdgeFromFile(event);
-          // Fallthrough
-        case pb::File_Access_CREATED:
-          graph_.AddEdge(proc_node,
-                         TraceNode::GeneratedFile(this, pb->id(),
-                                                  event.file_index,
-                                                  file->sha1_after()));
-          break;
-        case pb::File_Access_DELETED:
-          break;
-      }
+void Make::AddResolvedEvent(const ResolvedEvent& resolved) {
+  // Adds the node unless there's already one with the same ID.
+  auto find_or_add = [this](const ResolvedEvent::Node& node) {
+    const Graph<TraceNode>::Handle handle = graph_.FindHandle(node.key);
+    if (handle != -1) {
+      return handle;
     }
+    return graph_.AddNode(node.node, node.key, node.index_key,
+                          node.lookup_key);
+  };
+
+  const Graph<TraceNode>::Handle proc = graph_.AddNode(
+      resolved.process.node, resolved.process.key, resolved.process.index_key,
+      resolved.process.lookup_key);
+
+  if (resolved.renamed) {
+    RenameFile(*resolved.event);
+    return;
   }
 
+  if (resolved.has_read) {
+    const Graph<TraceNode>::Handle generated =
+        graph_.FindHandle(resolved.generated_read.key);
+    if (generated != -1) {
+      graph_.AddEdgeByHandle(generated, proc);
+    } else if (resolved.has_source_read) {
+      graph_.AddEdgeByHandle(find_or_add(resolved.source_read), proc);
+    }
+  }
+  if (resolved.has_write) {
+    graph_.AddEdgeByHandle(proc, find_or_add(resolved.written));
+  }
+}
+
+void Make::RenameFile(const FileEvent& event) {
+  const TraceReader::Process pb = process(event.process_id);
+  const TraceReader::File file = pb.file(event.file_index);
+
+  // Find the original node and replace its path.  If there are several
+  // nodes with the same filename the first one by ID is used.
+  const QVector<Graph<TraceNode>::Handle> nodes =
+      graph_.FindByLookupKey(file.renamed_from());
+  if (nodes.isEmpty()) {
+    return;
+  }
+
+  const TraceNode original = graph_.node(nodes.first());
+  TraceNode replacement = original;
+  replacement.SetFilename(file.filename_id());
+  LOG(INFO) << "Replacing " << original.Filename() << " with " << replacement.Filename();
+  graph_.ReplaceSubgraph({original}, replacement);
+}
+
+void Make::RemoveUnconnectedProcesses() {
   // Remove process nodes that don't have any edges.
-  for (const TraceNode& node : graph_.AllNodes()) {
-    if (graph_.Incoming(node).empty() &&
-        graph_.Outgoing(node).empty()) {
-      graph_.RemoveNode(node);
+  for (Graph<TraceNode>::Handle handle : graph_.AllHandles()) {
+    if (graph_.IncomingCount(handle) == 0 &&
+        graph_.OutgoingCount(handle) == 0) {
+      graph_.RemoveNode(graph_.node(handle));
     }
   }
 }
 
-void Make::FindCompileTargets() {
+void Make::FindTargets() {
+  // Rewrites are in priority order, so ar with ranlib is matched before ar
+  // alone.
+  QList<TargetRewrite> rewrites;
+  AddCompileRewrites(&rewrites);
+  AddLinkRewrites(&rewrites);
+  graph_.FindAndReplaceSubgraphs(rewrites);
+}
+
+void Make::AddCompileRewrites(QList<TargetRewrite>* rewrites) {
   Graph<TargetMatchNode> subgraph;
   subgraph.AddEdges({
       {"input", {{TraceNode::Type::SourceFile, TraceNode::Type::GeneratedFile}}, {}, false, false},
@@ -149,22 +271,22 @@ void Make::FindCompileTargets() {
       {"object", {{TraceNode::Type::GeneratedFile}}, {}, true, false},
   });
 
-  graph_.FindAndReplaceSubgraph(subgraph, [this](
+  rewrites->append({subgraph, [this](
       const QMap<Graph<TargetMatchNode>::IDType, TraceNode>& match) {
     const int parent_process_id =
-        process(match["cc1"].process_id_).parent_id();
+        process(match["cc1"].process_id()).parent_id();
     TraceNode node = TraceNode::CompileStep(this, parent_process_id);
-    node.compiler_frontend_process_id_ = match["cc1"].process_id_;
+    node.set_compiler_frontend_process_id(match["cc1"].process_id());
 
     graph_.ReplaceSubgraph({
         match["cc1"],
         match["asm"],
         match["as"],
     }, node);
-  });
+  }});
 }
 
-void Make::FindLinkTargets() {
+void Make::AddLinkRewrites(QList<TargetRewrite>* rewrites) {
   Graph<TargetMatchNode> static_subgraph_ranlib;
   static_subgraph_ranlib.AddEdges({
       {"input", {{TraceNode::Type::GeneratedFile}}, {}, false, false},
@@ -172,16 +294,16 @@ void Make::FindLinkTargets() {
       {"output", {{TraceNode::Type::GeneratedFile}}, {}, true, false},
       {"ranlib", {{TraceNode::Type::Process}}, {"ranlib"}, true, false},
   });
-  graph_.FindAndReplaceSubgraph(static_subgraph_ranlib, [this](
+  rewrites->append({static_subgraph_ranlib, [this](
       const QMap<typename Graph<TargetMatchNode>::IDType, TraceNode>& match) {
     const TraceNode replacement = TraceNode::StaticLinkStep(
-        this, match["ar"].process_id_);
+        this, match["ar"].process_id());
     graph_.ReplaceSubgraph({
         match["ar"],
         match["ranlib"],
     }, replacement);
     graph_.RemoveEdge(match["output"], replacement);
-  });
+  }});
 
   Graph<TargetMatchNode> static_subgraph;
   static_subgraph.AddEdges({
@@ -189,15 +311,15 @@ void Make::FindLinkTargets() {
       {"ar", {{TraceNode::Type::Process}}, {"ar"}, false, true},
       {"output", {{TraceNode::Type::GeneratedFile}}, {}, true, false},
   });
-  graph_.FindAndReplaceSubgraph(static_subgraph, [this](
+  rewrites->append({static_subgraph, [this](
       const QMap<typename Graph<TargetMatchNode>::IDType, TraceNode>& match) {
     const TraceNode replacement = TraceNode::StaticLinkStep(
-        this, match["ar"].process_id_);
+        this, match["ar"].process_id());
     graph_.ReplaceSubgraph({
         match["ar"],
     }, replacement);
     graph_.RemoveEdge(match["output"], replacement);
-  });
+  }});
 
   Graph<TargetMatchNode> dynamic_subgraph;
   dynamic_subgraph.AddEdges({
@@ -205,11 +327,11 @@ void Make::FindLinkTargets() {
       {"ld", {{TraceNode::Type::Process}}, {"ld"}, false, true},
       {"output", {{TraceNode::Type::GeneratedFile}}, {}, true, false},
   });
-  graph_.FindAndReplaceSubgraph(dynamic_subgraph, [this](
+  rewrites->append({dynamic_subgraph, [this](
       const QMap<typename Graph<TargetMatchNode>::IDType, TraceNode>& match) {
     // Usually dynamic links are gcc -> collect2 -> ld.  Try to find the gcc
     // parent.
-    int process_id = match["ld"].process_id_;
+    int process_id = match["ld"].process_id();
     while (true) {
       int parent_id = process(process_id).parent_id();
       const QString program = Filename(process(parent_id).filename());
@@ -223,12 +345,10 @@ void Make::FindLinkTargets() {
     graph_.ReplaceSubgraph({
         match["ld"],
     }, TraceNode::DynamicLinkStep(this, process_id));
-  });
+  }});
 }
 
-QString Make::NewTargetName(const QString& filename) {
-  static QRegularExpression sInvalidCharsRe("[^a-zA-Z0-9_/]");
-
+QString Make::TargetName(const QString& filename) const {
   pb::Reference ref;
   CreateReference(filename, &ref);
   if (ref.type() != pb::Reference_Type_RELATIVE_TO_BUILD_DIR &&
@@ -237,8 +357,16 @@ QString Make::NewTargetName(const QString& filename) {
                << "root, got: " << ref.ShortDebugString();
   }
 
+  // Anything but [a-zA-Z0-9_/] becomes an underscore.  This is called from
+  // several threads at once, so it doesn't share a QRegularExpression.
   QString ret = PathWithoutExtension(ref.name());
-  ret.replace(sInvalidCharsRe, "_");
+  for (QChar& c : ret) {
+    const ushort u = c.unicode();
+    if (!((u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') ||
+          (u >= '0' && u <= '9') || u == '_' || u == '/')) {
+      c = '_';
+    }
+  }
 
   const int last_slash = ret.lastIndexOf('/');
   if (last_slash != -1) {
@@ -248,22 +376,97 @@ QString Make::NewTargetName(const QString& filename) {
   }
 
   ret.prepend("//");
+  return ret;
+}
 
-  const QString base = ret;
+QString Make::UniqueTargetName(const pb::BuildTarget& target) const {
+  const QString& name = target.qualified_name();
+  QString ret = name;
   int suffix = 1;
   while (targets_by_name_.contains(ret)) {
-    ret = base + "_" + QString::number(suffix);
+    ret = name + "_" + QString::number(suffix);
     suffix ++;
   }
 
-  LOG(INFO) << "Using name " << ret << " for " << filename;
+  if (ret != name) {
+    // Compiles are named after their source and everything else after its
+    // output.
+    QString filename;
+    if (target.has_c_compile() && target.srcs_size() != 0) {
+      filename = target.srcs(0).name();
+    } else if (target.outputs_size() != 0) {
+      filename = target.outputs(0).name();
+    }
+    LOG(INFO) << "Using name " << ret << " for " << filename;
+  }
   return ret;
 }
 
+Make::GeneratedTarget Make::GenerateBuildTarget(
+    const TraceNode& node,
+    const vector<std::unique_ptr<BuildTargetGen>>& generators) const {
+  GeneratedTarget generated;
+  for (const auto& gen : generators) {
+    pb::BuildTarget target;
+    if (!gen->Gen(node, &target)) {
+      continue;
+    }
+    CHECK(target.has_qualified_name());
+
+    // Does this build target install a file?
+    for (const pb::Reference& output : target.outputs()) {
+      pb::InstalledFile installed;
+      if (installed_files_.Find(
+            output.name(),
+            {pb::InstalledFile_Type_BINARY,
+             pb::InstalledFile_Type_LIBRARY},
+            &installed)) {
+        target.set_install(true);
+        break;
+      }
+    }
+
+    generated.has_target = true;
+    generated.target = target;
+    generated.canonical_target = CanonicalTarget(target);
+    break;
+  }
+  return generated;
+}
+
+string Make::CanonicalTarget(const pb::BuildTarget& orig) {
+  // Everything that makes two targets build the same thing, without the flags
+  // that differ between eg. PIC and non-PIC builds.
+  pb::BuildTarget canon;
+  canon.mutable_srcs()->CopyFrom(orig.srcs());
+  if (orig.has_c_compile()) {
+    canon.mutable_c_compile()->set_flag(orig.c_compile().flag());
+    canon.mutable_c_compile()->mutable_headers()->CopyFrom(
+        orig.c_compile().headers());
+    for (const pb::Definition& def : orig.c_compile().definition()) {
+      if (def.name().contains("PIC") ||
+          def.name().contains("SHARED") ||
+          def.name().contains("STATIC")) {
+        continue;
+      }
+      canon.mutable_c_compile()->add_definition()->MergeFrom(def);
+    }
+  }
+  if (orig.has_c_link()) {
+    canon.mutable_c_link()->set_flag(orig.c_link().flag());
+    canon.mutable_c_link()->mutable_library_search_path()->CopyFrom(
+        orig.c_link().library_search_path());
+    canon.mutable_c_link()->set_is_library(orig.c_link().is_library());
+  }
+  return canon.SerializeAsString();
+}
+
 void Make::GenerateBuildTargets() {
   build_targets_.clear();
   targets_by_name_.clear();
-  targets_by_node_id_.clear();
+  if (!opts_.incremental_targets) {
+    generated_targets_.clear();
+  }
 
   vector<std::unique_ptr<BuildTargetGen>> generators;
   generators.emplace_back(new GccBuildTargetGen);
@@ -273,34 +476,41 @@ void Make::GenerateBuildTargets() {
     gen->Init(this);
   }
 
-  for (const TraceNode& node : graph_.AllNodes()) {
-    for (const auto& gen : generators) {
-      pb::BuildTarget target;
-      if (gen->Gen(node, &target)) {
-        CHECK(target.has_qualified_name());
-
-        // Does this build target install a file?
-        for (const pb::Reference& output : target.outputs()) {
-          pb::InstalledFile installed;
-          if (installed_files_.Find(
-                output.name(),
-                {pb::InstalledFile_Type_BINARY,
-                 pb::InstalledFile_Type_LIBRARY},
-                &installed)) {
-            target.set_install(true);
-            break;
-          }
-        }
-
-        build_targets_.push_back(target);
-        const int index = build_targets_.size() - 1;
-
-        targets_by_name_[target.qualified_name()] = index;
-        targets_by_node_id_[node.ID()] = index;
+  // Targets are only generated for nodes that are new or whose neighbours
+  // changed since the last time.  That only reads the graph and the trace, so
+  // it's done in parallel.
+  const QList<TraceNode> nodes = graph_.AllNodes();
+  struct Generation {
+    const TraceNode* node;
+    GeneratedTarget generated;
+  };
+  QVector<Generation> generations;
+  for (const TraceNode& node : nodes) {
+    if (!generated_targets_.contains(node.Key())) {
+      generations.append({&node, GeneratedTarget()});
+    }
+  }
+  QtConcurrent::blockingMap(generations,
+                            [this, &generators](Generation& generation) {
+    generation.generated = GenerateBuildTarget(*generation.node, generators);
+  });
+  for (const Generation& generation : generations) {
+    generated_targets_.insert(generation.node->Key(), generation.generated);
+  }
 
-        break;
-      }
+  // Names depend on the targets before them, so they're given out in node
+  // order.  They're given out again every time so they don't depend on which
+  // targets were removed as duplicates.
+  for (const TraceNode& node : nodes) {
+    const GeneratedTarget& generated = generated_targets_[node.Key()];
+    if (!generated.has_target) {
+      continue;
     }
+
+    pb::BuildTarget target = generated.target;
+    target.set_qualified_name(UniqueTargetName(target));
+    build_targets_.push_back(target);
+    targets_by_name_[target.qualified_name()] = build_targets_.size() - 1;
   }
 }
 
@@ -309,39 +519,32 @@ bool Make::RemoveDuplicates() {
 
   QMap<string, QList<TraceNode>> nodes_by_canonical_target;
   for (const TraceNode& node : graph_.AllNodes()) {
-    if (node.type_ != TraceNode::Type::CompileStep &&
-        node.type_ != TraceNode::Type::DynamicLinkStep &&
-        node.type_ != TraceNode::Type::StaticLinkStep) {
+    if (node.type() != TraceNode::Type::CompileStep &&
+        node.type() != TraceNode::Type::DynamicLinkStep &&
+        node.type() != TraceNode::Type::StaticLinkStep) {
         continue;
     }
 
-    const pb::BuildTarget& orig = TargetForNode(node.ID());
-
-    pb::BuildTarget canon;
-    canon.mutable_srcs()->CopyFrom(orig.srcs());
-    if (orig.has_c_compile()) {
-      canon.mutable_c_compile()->set_flag(orig.c_compile().flag());
-      canon.mutable_c_compile()->mutable_headers()->CopyFrom(
-          orig.c_compile().headers());
-      for (const pb::Definition& def : orig.c_compile().definition()) {
-        if (def.name().contains("PIC") ||
-            def.name().contains("SHARED") ||
-            def.name().contains("STATIC")) {
-          continue;
-        }
-        canon.mutable_c_compile()->add_definition()->MergeFrom(def);
-      }
-    }
-    if (orig.has_c_link()) {
-      canon.mutable_c_link()->set_flag(orig.c_link().flag());
-      canon.mutable_c_link()->mutable_library_search_path()->CopyFrom(
-          orig.c_link().library_search_path());
-      canon.mutable_c_link()->set_is_library(orig.c_link().is_library());
+    // Steps without a target aren't duplicates of anything.
+    const auto it = generated_targets_.constFind(node.Key());
+    if (it == generated_targets_.constEnd() || !it->has_target) {
+      continue;
     }
-
-    nodes_by_canonical_target[canon.SerializeAsString()].append(node);
+    nodes_by_canonical_target[it->canonical_target].append(node);
   }
 
+  // Forgets the targets of the node and its neighbours, whose inputs or
+  // outputs are about to change.
+  auto invalidate = [this](const TraceNode& node) {
+    generated_targets_.remove(node.Key());
+    for (const TraceNode& neighbour : graph_.Incoming(node)) {
+      generated_targets_.remove(neighbour.Key());
+    }
+    for (const TraceNode& neighbour : graph_.Outgoing(node)) {
+      generated_targets_.remove(neighbour.Key());
+    }
+  };
+
   for (const QList<TraceNode>& nodes : nodes_by_canonical_target.values()) {
     if (nodes.count() <= 1) {
       continue;
@@ -356,7 +559,7 @@ bool Make::RemoveDuplicates() {
     TraceNode replacement_output;
 
     QList<TraceNode> all_outputs;
-    QStringList output_connections;
+    QList<TraceNode::KeyType> output_connections;
     for (const TraceNode& node : nodes) {
       const QList<TraceNode> outputs = graph_.Outgoing(node);
       if (outputs.length() > 1) {
@@ -367,10 +570,10 @@ bool Make::RemoveDuplicates() {
       all_outputs.append(outputs[0]);
 
       for (const TraceNode& connection : graph_.Outgoing(outputs[0])) {
-        output_connections.append(connection.ID());
+        output_connections.append(connection.Key());
       }
 
-      if (replacement.type_ == TraceNode::Type::Unknown ||
+      if (replacement.type() == TraceNode::Type::Unknown ||
           outputs[0].Filename().length() <
           replacement_output.Filename().length()) {
         replacement = node;
@@ -388,6 +591,8 @@ bool Make::RemoveDuplicates() {
               << "outputs " << replacement_output.Filename();
 
     // Remove all the process nodes and outputs.
+    for (const TraceNode& node : nodes) { invalidate(node); }
+    for (const TraceNode& node : all_outputs) { invalidate(node); }
     for (const TraceNode& node : nodes) { graph_.RemoveNode(node); }
     for (const TraceNode& node : all_outputs) { graph_.RemoveNode(node); }
 
@@ -396,8 +601,8 @@ bool Make::RemoveDuplicates() {
     for (const TraceNode& input : replacement_inputs) {
       graph_.AddEdge(input, replacement);
     }
-    for (const QString& connection : output_connections) {
-      graph_.AddEdgeByID(replacement_output.ID(), connection);
+    for (TraceNode::KeyType connection : output_connections) {
+      graph_.AddEdgeByKey(replacement_output.Key(), connection);
     }
   }
 
@@ -406,7 +611,7 @@ bool Make::RemoveDuplicates() {
 
 void Make::ReplaceDependencyTargetNames() {
   // Replace generated src file names with the names of their build targets.
-  QMap<pb::Reference, int> targets_by_output;
+  QHash<pb::Reference, int> targets_by_output;
   for (int target_i = 0; target_i < build_targets_.size(); ++target_i) {
     const pb::BuildTarget& target = build_targets_[target_i];
     for (const pb::Reference& ref : target.outputs()) {
@@ -415,7 +620,7 @@ void Make::ReplaceDependencyTargetNames() {
                      << " was generated by multiple targets: "
                      << target.qualified_name() << " and "
                      << build_targets_[
-                            targets_by_output[ref]].qualified_name();
+                            targets_by_output.value(ref)].qualified_name();
         continue;
       }
       targets_by_output[ref] = target_i;
@@ -432,7 +637,8 @@ void Make::ReplaceDependencyTargetNames() {
         continue;
       }
 
-      pb::BuildTarget* dependency = &build_targets_[targets_by_output[ref]];
+      pb::BuildTarget* dependency =
+          &build_targets_[targets_by_output.value(ref)];
 
       if (dependency == target) {
         LOG(WARNING) << "Target " << target->qualified_name() << " generates "
@@ -445,65 +651,441 @@ void Make::ReplaceDependencyTargetNames() {
   }
 }
 
-bool Make::Run(const Options& opts) {
+bool Make::Run(const Options& opts, Output* output) {
   Make make(opts);
 
   if (!make.ReadInputs()) {
     return false;
   }
+  make.PrefetchToolSearchPaths();
+
+  // Skip as much as possible if the graph was cached by an earlier run on the
+  // same trace.
+  // The intermediate graph is the BUILT snapshot, so it's written from there
+  // when the analysis itself is skipped.
+  const bool want_built = !opts.intermediate_graph_output_filename.isEmpty();
+  Graph<TraceNode> built;
+  pb::GraphSnapshot_Stage stage;
+  bool ok;
+  if (!make.ReadGraphCache(&stage, want_built ? &built : nullptr) ||
+      (stage == pb::GraphSnapshot_Stage_TARGETS && want_built &&
+       built.count() == 0)) {
+    make.graph_ = Graph<TraceNode>();
+    make.BuildGraph();
+    ok = make.Analyze();
+  } else if (stage == pb::GraphSnapshot_Stage_TARGETS) {
+    if (want_built) {
+      built.WriteDotToFile(opts.intermediate_graph_output_filename);
+    }
+    ok = make.GenerateOutput();
+  } else {
+    ok = make.Analyze();
+  }
 
-  make.BuildGraph();
-  Graph<TraceNode> intermediate_graph = make.graph();
-  if (!opts.intermediate_graph_output_filename.isEmpty()) {
-    intermediate_graph.WriteDotToFile(opts.intermediate_graph_output_filename);
+  if (ok && output) {
+    output->metadata = make.metadata();
+    output->build_targets = make.build_targets();
   }
+  return ok;
+}
+
+std::unique_ptr<Make> Make::StartLive(const Options& opts) {
+  std::unique_ptr<Make> make(new Make(opts));
+  make->live_writer_ = make_unique<LiveTraceWriter>(&make->trace_);
+  return make;
+}
+
+void Make::ProcessExited(int ordering) {
+  const QVector<FileEvent>& events = trace_.events();
+  for (int i = trace_.TakeEvents(ordering); i < events.count(); ++i) {
+    AddEventToGraph(events[i]);
+  }
+}
+
+bool Make::FinishLive() {
+  ProcessExited(std::numeric_limits<int>::max());
+  PrefetchToolSearchPaths();
+  RemoveUnconnectedProcesses();
+
+  // On a first conversion the install step runs after the build, so it may
+  // not have been analyzed yet.
+  if (opts_.installed_files || QFile::exists(opts_.install_filename)) {
+    if (!ReadInstalledFiles()) {
+      return false;
+    }
+  } else {
+    LOG(WARNING) << opts_.install_filename << " doesn't exist - no targets "
+                 << "will be marked as installed";
+  }
+  return Analyze();
+}
+
+bool Make::Analyze() {
+  if (!opts_.intermediate_graph_output_filename.isEmpty()) {
+    graph_.WriteDotToFile(opts_.intermediate_graph_output_filename);
+  }
+  SnapshotGraph(pb::GraphSnapshot_Stage_BUILT);
+
+  FindTargets();
+  SnapshotGraph(pb::GraphSnapshot_Stage_TARGETS);
+  WriteGraphCache();
 
-  make.FindCompileTargets();
-  make.FindLinkTargets();
+  return GenerateOutput();
+}
+
+bool Make::GenerateOutput() {
+  tool_search_path_.Wait();
 
   forever {
-    make.GenerateBuildTargets();
-    if (!make.RemoveDuplicates()) {
+    GenerateBuildTargets();
+    if (!RemoveDuplicates()) {
       break;
     }
   }
 
-  make.ReplaceDependencyTargetNames();
+  if (!opts_.base_targets_filename.isEmpty() && !MergeBaseTargets()) {
+    return false;
+  }
 
-  if (!make.WriteOutput()) {
+  ReplaceDependencyTargetNames();
+
+  if (!WriteOutput()) {
     return false;
   }
 
-  if (!opts.graph_output_filename.isEmpty()) {
-    make.graph().WriteDotToFile(opts.graph_output_filename);
+  if (!opts_.graph_output_filename.isEmpty()) {
+    graph().WriteDotToFile(opts_.graph_output_filename);
   }
   return true;
 }
 
+bool Make::MergeBaseTargets() {
+  auto file = utils::OpenRecordReader<pb::Record>(opts_.base_targets_filename);
+  if (!file) {
+    LOG(ERROR) << "Failed to open " << opts_.base_targets_filename
+               << " for reading";
+    return false;
+  }
+
+  QList<pb::BuildTarget> merged;
+  QHash<pb::Reference, int> base_targets_by_output;
+  auto records = file->Records();
+  for (const pb::Record& record : records) {
+    if (!record.has_build_target()) {
+      continue;
+    }
+    for (const pb::Reference& ref : record.build_target().outputs()) {
+      base_targets_by_output.insert(ref, merged.count());
+    }
+    merged.append(record.build_target());
+  }
+  if (!records.ok()) {
+    LOG(ERROR) << "Failed to read " << opts_.base_targets_filename;
+    return false;
+  }
+
+  // Targets that were rebuilt replace the base target with the same output,
+  // and take its name so targets that depend on it don't change.
+  QList<pb::BuildTarget> added;
+  QSet<int> replaced;
+  for (pb::BuildTarget& target : build_targets_) {
+    QList<int> bases;
+    for (const pb::Reference& ref : target.outputs()) {
+      const int base = base_targets_by_output.value(ref, -1);
+      if (base != -1 && !bases.contains(base)) {
+        bases.append(base);
+      }
+    }
+    if (bases.isEmpty()) {
+      added.append(target);
+      continue;
+    }
+
+    // A target can only keep one name.  The other base targets stay as they
+    // were, so their outputs are built twice.
+    const int base = bases.first();
+    for (int other : bases.mid(1)) {
+      LOG(WARNING) << target.qualified_name() << " builds outputs of both "
+                   << merged[base].qualified_name() << " and "
+                   << merged[other].qualified_name() << " in "
+                   << opts_.base_targets_filename << " - only replacing "
+                   << merged[base].qualified_name();
+    }
+    if (replaced.contains(base)) {
+      LOG(WARNING) << merged[base].qualified_name() << " in "
+                   << opts_.base_targets_filename << " was already replaced "
+                   << "- adding " << target.qualified_name() << " as a new "
+                   << "target";
+      added.append(target);
+      continue;
+    }
+    target.set_qualified_name(merged[base].qualified_name());
+    merged[base] = target;
+    replaced.insert(base);
+  }
+
+  build_targets_ = merged;
+  targets_by_name_.clear();
+  for (int i = 0; i < build_targets_.count(); ++i) {
+    targets_by_name_[build_targets_[i].qualified_name()] = i;
+  }
+  for (pb::BuildTarget& target : added) {
+    target.set_qualified_name(UniqueTargetName(target));
+    build_targets_.append(target);
+    targets_by_name_[target.qualified_name()] = build_targets_.count() - 1;
+  }
+
+  LOG(INFO) << "Updated " << replaced.count() << " and added " << added.count()
+            << " of " << build_targets_.count() << " targets from "
+            << opts_.base_targets_filename;
+  return true;
+}
+
 bool Make::ReadInputs() {
   // Read the trace.
-  auto trace = make_unique<utils::RecordFile<pb::Record>>(opts_.trace_filename);
-  if (!trace->Open(QIODevice::ReadOnly)) {
+  auto trace = utils::OpenRecordReader<pb::Record>(opts_.trace_filename);
+  if (!trace) {
     LOG(ERROR) << "Failed to open " << opts_.trace_filename << " for reading";
     return false;
   }
+  if (!ReadInstalledFiles()) {
+    return false;
+  }
+
+  // The cache is keyed on the trace's records rather than its file, so the
+  // trace is only read once even when it's a pipe.
+  trace_.Read(std::move(trace), opts_.graph_cache_filename.isEmpty()
+                                    ? nullptr : &trace_sha1_);
+  if (!trace_sha1_.isEmpty()) {
+    analysis_sha1_ = AnalysisFingerprint();
+  }
+  return true;
+}
+
+QByteArray Make::AnalysisFingerprint() {
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(QByteArray::number(kGraphCacheVersion));
+
+  // The subgraphs FindTargets looks for.
+  QList<TargetRewrite> rewrites;
+  AddCompileRewrites(&rewrites);
+  AddLinkRewrites(&rewrites);
+  for (const TargetRewrite& rewrite : rewrites) {
+    const Graph<TargetMatchNode>& subgraph = rewrite.subgraph;
+    for (Graph<TargetMatchNode>::Handle handle : subgraph.AllHandles()) {
+      const TargetMatchNode& node = subgraph.node(handle);
+      hash.addData(node.ID().toUtf8());
+      for (TraceNode::Type type : node.types_) {
+        hash.addData(QByteArray::number(static_cast<int>(type)));
+      }
+      hash.addData(node.process_filename_.join(',').toUtf8());
+      hash.addData(QByteArray::number(node.exact_incoming_neighbour_count_));
+      hash.addData(QByteArray::number(node.exact_outgoing_neighbour_count_));
+      for (Graph<TargetMatchNode>::Handle to :
+           subgraph.OutgoingHandles(handle)) {
+        hash.addData("->" + subgraph.node(to).ID().toUtf8());
+      }
+      hash.addData(";");
+    }
+  }
+
+  // Everything else, like the format of node IDs, is compiled into the binary.
+  QFile binary("/proc/self/exe");
+  if (binary.open(QIODevice::ReadOnly)) {
+    hash.addData(&binary);
+  }
+  return hash.result();
+}
+
+bool Make::ReadGraphCache(pb::GraphSnapshot_Stage* stage,
+                          Graph<TraceNode>* built) {
+  if (trace_sha1_.isEmpty() || !QFile::exists(opts_.graph_cache_filename)) {
+    return false;
+  }
+  auto file = utils::OpenRecordReader<pb::GraphSnapshot>(
+      opts_.graph_cache_filename);
+  if (!file) {
+    return false;
+  }
+
+  // Snapshots are in stage order, so the last complete one is used.
+  bool found = false;
+  bool valid = false;
+  pb::GraphSnapshot_Header header;
+  Graph<TraceNode> graph;
+  QVector<Graph<TraceNode>::Handle> handles;
+  int edge_count = 0;
+  auto finish_snapshot = [&]() {
+    if (valid && handles.count() == header.node_count() &&
+        edge_count == header.edge_count()) {
+      graph_ = graph;
+      *stage = header.stage();
+      found = true;
+      if (built && header.stage() == pb::GraphSnapshot_Stage_BUILT) {
+        *built = graph;
+      }
+    }
+  };
+
+  auto records = file->Records();
+  for (const pb::GraphSnapshot& record : records) {
+    if (record.has_header()) {
+      finish_snapshot();
+      header = record.header();
+      valid = header.version() == kGraphCacheVersion &&
+              header.trace_sha1() == trace_sha1_ &&
+              header.analysis_sha1() == analysis_sha1_;
+      graph = Graph<TraceNode>();
+      handles.clear();
+      edge_count = 0;
+      continue;
+    }
+    if (!valid) {
+      continue;
+    }
+
+    for (const pb::GraphSnapshot_Node& pb : record.node()) {
+      const TraceNode node = TraceNode::FromSnapshot(this, pb);
+      graph.AddNode(node);
+      handles.append(graph.FindHandle(node.Key()));
+    }
+    for (int i = 0; i + 1 < record.edge_size(); i += 2) {
+      const int from = record.edge(i);
+      const int to = record.edge(i + 1);
+      if (from < 0 || from >= handles.count() ||
+          to < 0 || to >= handles.count()) {
+        valid = false;
+        break;
+      }
+      graph.AddEdgeByHandle(handles[from], handles[to]);
+      ++edge_count;
+    }
+  }
+  if (records.ok()) {
+    finish_snapshot();
+  }
+
+  if (found) {
+    LOG(INFO) << "Read graph (" << graph_.count() << " nodes) from "
+              << opts_.graph_cache_filename;
+  }
+  return found;
+}
+
+void Make::SnapshotGraph(pb::GraphSnapshot_Stage stage) {
+  if (trace_sha1_.isEmpty()) {
+    return;
+  }
+
+  const int kNodesPerRecord = 4096;
+  const int kEdgesPerRecord = 65536;
+
+  graph_snapshot_.append(pb::GraphSnapshot());
+  pb::GraphSnapshot_Header* header =
+      graph_snapshot_.last().mutable_header();
+  header->set_version(kGraphCacheVersion);
+  header->set_trace_sha1(trace_sha1_);
+  header->set_analysis_sha1(analysis_sha1_);
+  header->set_stage(stage);
+
+  // Nodes are numbered in the order they're written.
+  QVector<int> index(graph_.handle_limit(), -1);
+  const QVector<Graph<TraceNode>::Handle> handles = graph_.AllHandles();
+  pb::GraphSnapshot* record = nullptr;
+  for (int i = 0; i < handles.count(); ++i) {
+    if (i % kNodesPerRecord == 0) {
+      graph_snapshot_.append(pb::GraphSnapshot());
+      record = &graph_snapshot_.last();
+    }
+    index[handles[i]] = i;
+    graph_.node(handles[i]).ToSnapshot(record->add_node());
+  }
+
+  int edge_count = 0;
+  for (Graph<TraceNode>::Handle from : handles) {
+    for (Graph<TraceNode>::Handle to : graph_.OutgoingHandles(from)) {
+      if (edge_count % kEdgesPerRecord == 0) {
+        graph_snapshot_.append(pb::GraphSnapshot());
+        record = &graph_snapshot_.last();
+      }
+      record->add_edge(index[from]);
+      record->add_edge(index[to]);
+      ++edge_count;
+    }
+  }
+
+  header->set_node_count(handles.count());
+  header->set_edge_count(edge_count);
+}
+
+void Make::WriteGraphCache() {
+  if (graph_snapshot_.isEmpty()) {
+    return;
+  }
+
+  utils::BufferedRecordWriter<pb::GraphSnapshot> writer(
+      opts_.graph_cache_filename);
+  if (!writer.Open()) {
+    LOG(WARNING) << "Failed to open " << opts_.graph_cache_filename
+                 << " for writing";
+    return;
+  }
+  for (const pb::GraphSnapshot& record : graph_snapshot_) {
+    writer.WriteRecord(record);
+  }
+  graph_snapshot_.clear();
+
+  // A partial cache would only be rejected by the next run anyway.
+  if (!writer.Close()) {
+    LOG(WARNING) << "Failed to write " << opts_.graph_cache_filename;
+    QFile::remove(opts_.graph_cache_filename);
+  }
+}
+
+void Make::PrefetchToolSearchPaths() {
+  // Compile and link steps are usually the parents of the processes that
+  // opened files, so look at every ancestor too.
+  QSet<int> seen;
+  QSet<QString> programs;
+  for (const FileEvent& event : trace_.events()) {
+    int id = event.process_id;
+    while (!seen.contains(id)) {
+      seen.insert(id);
+      const TraceReader::Process proc = process(id);
+      programs.insert(proc.filename());
+      if (!proc.has_parent_id()) {
+        break;
+      }
+      id = proc.parent_id();
+    }
+  }
+  tool_search_path_.Prefetch(programs);
+}
+
+bool Make::ReadInstalledFiles() {
+  if (opts_.installed_files) {
+    installed_files_ = *opts_.installed_files;
+    return true;
+  }
 
-  // Read the installed files.
   auto installed_files =
-      make_unique<utils::RecordFile<pb::Record>>(opts_.install_filename);
-  if (!installed_files->Open(QIODevice::ReadOnly)) {
+      utils::OpenRecordReader<pb::Record>(opts_.install_filename);
+  if (!installed_files) {
     LOG(ERROR) << "Failed to open " << opts_.install_filename << " for reading";
     return false;
   }
 
-  trace_.Read(std::move(trace));
   installed_files_.Read(std::move(installed_files));
   return true;
 }
 
 bool Make::WriteOutput() {
-  utils::RecordFile<pb::Record> output(opts_.output_filename);
-  if (!output.Open(QIODevice::WriteOnly)) {
+  if (opts_.output_filename.isEmpty()) {
+    return true;
+  }
+
+  utils::BufferedRecordWriter<pb::Record> output(opts_.output_filename);
+  if (!output.Open()) {
     LOG(ERROR) << "Failed to open " << opts_.output_filename << " for writing";
     return false;
   }
@@ -518,6 +1100,11 @@ bool Make::WriteOutput() {
     output.WriteRecord(record);
   }
 
+  if (!output.Close()) {
+    LOG(ERROR) << "Failed to write " << opts_.output_filename;
+    return false;
+  }
+
   LOG(INFO) << "Written " << build_targets().count() << " targets to "
             << opts_.output_filename;
   return true;
@@ -20,6 +20,7 @@
 #include "common.h"
 #include "graph.h"
 #include "installedfilesreader.h"
+#include "targetmatchnode.h"
 #include "toolsearchpath.h"
 #include "tracenode.h"
 #include "tracer.pb.h"
@@ -30,6 +31,8 @@ class GeneratedFileProcessor;
 
 namespace analysis {
 
+class BuildTargetGen;
+
 class Make {
  public:
   struct Options {
@@ -37,21 +40,63 @@ class Make {
     QString install_filename;  // Read installed file records from this file.
     QString output_filename;   // Write BuildTarget records to this file.
 
+    // If this is set it's used instead of reading install_filename.
+    const InstalledFilesReader* installed_files = nullptr;
+
     // If these are not empty, graphs will be written to these files in dot
     // format.
     QString graph_output_filename;
     QString intermediate_graph_output_filename;
+
+    // If this is not empty, snapshots of the graph are cached in this file and
+    // reused by later runs on the same trace.
+    QString graph_cache_filename;
+
+    // If this is not empty, the trace is of a partial rebuild and the targets
+    // it finds update the ones in this file.  Targets that build the same
+    // outputs keep their names, and the rest are kept as they were.
+    QString base_targets_filename;
+
+    // If false, every target is generated again in each round of duplicate
+    // removal, rather than only the ones whose nodes changed.  For testing.
+    bool incremental_targets = true;
   };
 
-  static bool Run(const Options& opts);
+  // The targets found by Run, for passing straight to a generator.
+  struct Output {
+    pb::MetaData metadata;
+    QList<pb::BuildTarget> build_targets;
+  };
+
+  // If output is not null the targets are also copied into it.  The output
+  // file isn't written if output_filename is empty.
+  static bool Run(const Options& opts, Output* output = nullptr);
+
+  // Analyzes a build while it's being traced.  Pass live_writer() to the
+  // tracer as an observer and call ProcessExited whenever a process exits.
+  // FinishLive runs the rest of the analysis after the build has finished.
+  // Installed files aren't needed until then, and if install_filename doesn't
+  // exist yet no targets are marked as installed.
+  static std::unique_ptr<Make> StartLive(const Options& opts);
+  utils::RecordWriter<pb::Record>* live_writer() { return live_writer_.get(); }
+  void ProcessExited(int ordering);
+  bool FinishLive();
 
   ~Make();
 
   const pb::MetaData& metadata() const { return trace_.metadata(); }
-  const pb::Process& process(int id) const { return trace_.process(id); }
-  ToolSearchPath* tool_search_path() { return &tool_search_path_; }
+  TraceReader::Process process(int id) const { return trace_.process(id); }
+  int file_count(int process_id) const { return trace_.file_count(process_id); }
+  TraceReader::File file(int process_id, int index) const {
+    return trace_.file(process_id, index);
+  }
+  const StringTable& strings() const { return trace_.strings(); }
+  QByteArray digest(int id) const { return trace_.digest(id); }
+  const ToolSearchPath* tool_search_path() const { return &tool_search_path_; }
 
-  QString NewTargetName(const QString& filename);
+  // The name of the target that builds or is built from the file.
+  // GenerateBuildTargets adds a suffix if the name is already taken.
+  QString TargetName(const QString& filename) const;
   void CreateReference(const QString& name, pb::Reference* ref) const;
   void CreateReference(const pb::BuildTarget& target, pb::Reference* ref) const;
 
@@ -63,22 +108,50 @@ class Make {
  private:
   Make(const Options& opts);
 
-  const pb::BuildTarget& TargetForNode(const QString& node_id) {
-    return build_targets_[targets_by_node_id_[node_id]];
-  }
-
   bool ReadInputs();
+  bool ReadInstalledFiles();
+  void PrefetchToolSearchPaths();
+  bool Analyze();
+  bool GenerateOutput();
+  bool MergeBaseTargets();
   bool WriteOutput();
 
-  void ReadInstalledFileRecords(
-      std::unique_ptr<utils::RecordFile<pb::Record>> file);
-  void BuildGraph();
-  void FindCompileTargets();
-  void FindLinkTargets();
+  // Reads the last complete snapshot into graph_.  If built isn't null, it's
+  // also filled with the BUILT snapshot, if there's a complete one.
+  bool ReadGraphCache(pb::GraphSnapshot_Stage* stage,
+                      Graph<TraceNode>* built = nullptr);
+  QByteArray AnalysisFingerprint();
+  void SnapshotGraph(pb::GraphSnapshot_Stage stage);
+  void WriteGraphCache();
+
+  struct ResolvedEvent;
 
-  void AddEdgeFromFile(const FileEvent& event);
+  void BuildGraph();
+  void AddEventToGraph(const FileEvent& event);
+  void ResolveEvent(ResolvedEvent* resolved);
+  void AddResolvedEvent(const ResolvedEvent& resolved);
+  void RenameFile(const FileEvent& event);
+  void RemoveUnconnectedProcesses();
+  using TargetRewrite = Graph<TraceNode>::Rewrite<Graph<TargetMatchNode>>;
+  void FindTargets();
+  void AddCompileRewrites(QList<TargetRewrite>* rewrites);
+  void AddLinkRewrites(QList<TargetRewrite>* rewrites);
+
+  // The target generated for a node, kept until RemoveDuplicates changes the
+  // node or its neighbours.
+  struct GeneratedTarget {
+    bool has_target = false;
+    pb::BuildTarget target;
+    string canonical_target;
+  };
 
   void GenerateBuildTargets();
+  GeneratedTarget GenerateBuildTarget(
+      const TraceNode& node,
+      const vector<std::unique_ptr<BuildTargetGen>>& generators) const;
+  static string CanonicalTarget(const pb::BuildTarget& target);
+  // The target's name, with a suffix if another target already has it.
+  QString UniqueTargetName(const pb::BuildTarget& target) const;
   bool RemoveDuplicates();
 
   void ReplaceDependencyTargetNames();
@@ -90,14 +163,24 @@ class Make {
 
   TraceReader trace_;
   InstalledFilesReader installed_files_;
+  std::unique_ptr<utils::RecordWriter<pb::Record>> live_writer_;
 
   // Filled by BuildGraph.
   Graph<TraceNode> graph_;
 
+  // Bump this when the snapshot format changes.  Changes to the analysis
+  // itself are caught by analysis_sha1_.
+  static const int kGraphCacheVersion = 4;
+
+  // Set if the graph is cached.
+  QByteArray trace_sha1_;
+  QByteArray analysis_sha1_;
+  QList<pb::GraphSnapshot> graph_snapshot_;
+
   // Filled by GenerateBuildTargets.
   QList<pb::BuildTarget> build_targets_;
   QMap<QString, int> targets_by_name_;
-  QMap<QString, int> targets_by_node_id_;
+  QHash<TraceNode::KeyType, GeneratedTarget> generated_targets_;
 };
 
 }  // namespace analysis
@@ -21,7 +21,7 @@ namespace analysis {
 
 bool StaticLinkBuildTargetGen::Gen(const TraceNode& node,
                                    pb::BuildTarget* target) {
-  if (node.type_ != TraceNode::Type::StaticLinkStep) {
+  if (node.type() != TraceNode::Type::StaticLinkStep) {
     return false;
   }
 
@@ -35,7 +35,7 @@ bool StaticLinkBuildTargetGen::Gen(const TraceNode& node,
   }
 
   target->mutable_c_link()->set_is_library(true);
-  target->set_qualified_name(make_->NewTargetName(target->outputs(0).name()));
+  target->set_qualified_name(make_->TargetName(target->outputs(0).name()));
   return true;
 }
 
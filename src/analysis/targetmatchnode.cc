@@ -22,7 +22,7 @@ namespace analysis {
 bool TargetMatchNode::Match(const TraceNode& node) const {
   bool type_match = false;
   for (TraceNode::Type expected_type : types_) {
-    if (node.type_ == expected_type) {
+    if (node.type() == expected_type) {
       type_match = true;
       break;
     }
@@ -31,10 +31,10 @@ bool TargetMatchNode::Match(const TraceNode& node) const {
     return false;
   }
 
-  if (node.type_ == TraceNode::Type::Process && !process_filename_.isEmpty()) {
+  if (node.type() == TraceNode::Type::Process && !process_filename_.isEmpty()) {
     bool filename_match = false;
     const QString node_proc_filename = utils::path::Filename(
-        node.make_->process(node.process_id_).filename());
+        node.make()->process(node.process_id()).filename());
     for (const QString& expected_filename : process_filename_) {
       if (expected_filename == node_proc_filename) {
         filename_match = true;
@@ -48,4 +48,21 @@ bool TargetMatchNode::Match(const TraceNode& node) const {
   return true;
 }
 
+QStringList TargetMatchNode::CandidateIndexKeys() const {
+  QStringList ret;
+  for (TraceNode::Type type : types_) {
+    if (type != TraceNode::Type::Process) {
+      ret.append(TraceNode::IndexKey(type, QString()));
+    } else if (process_filename_.isEmpty()) {
+      // Any process could match.
+      return QStringList();
+    } else {
+      for (const QString& filename : process_filename_) {
+        ret.append(TraceNode::IndexKey(type, filename));
+      }
+    }
+  }
+  return ret;
+}
+
 }  // namespace analysis
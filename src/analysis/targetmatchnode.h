@@ -22,7 +22,12 @@ namespace analysis {
 
 class TargetMatchNode {
  public:
+  using KeyType = QString;
+
   QString ID() const { return id_; }
+  KeyType Key() const { return id_; }
+  QString IndexKey() const { return QString(); }
+  QString LookupKey() const { return QString(); }
 
   QString id_;
   QList<TraceNode::Type> types_;
@@ -31,6 +36,7 @@ class TargetMatchNode {
   bool exact_outgoing_neighbour_count_;
 
   bool Match(const TraceNode& node) const;
+  QStringList CandidateIndexKeys() const;
   bool ExactIncomingNeighbourCount() const {
     return exact_incoming_neighbour_count_;
   }
@@ -17,112 +17,187 @@
 #include "tracer.pb.h"
 #include "analysis/make.h"
 #include "utils/logging.h"
+#include "utils/path.h"
 #include "utils/str.h"
 
 namespace analysis {
 
+static_assert(sizeof(TraceNode) <= 16, "TraceNode should be 16 bytes");
+
 TraceNode::TraceNode()
-    : TraceNode(nullptr, Type::Unknown, "", 0, "", 0) {}
+    : TraceNode(nullptr, Type::Unknown, 0, 0) {}
 
-TraceNode TraceNode::SourceFile(Make* m,
-                                const QString& source_filename) {
-  return TraceNode(m, Type::SourceFile, source_filename, 0, "", 0);
+TraceNode TraceNode::SourceFile(Make* m, int filename_id) {
+  return TraceNode(m, Type::SourceFile, filename_id, -1);
 }
 
-TraceNode TraceNode::GeneratedFile(Make* m,
-                                   int process_id,
-                                   int file_index,
-                                   const QByteArray& sha1) {
-  return TraceNode(m, Type::GeneratedFile, "", file_index, sha1, process_id);
+TraceNode TraceNode::GeneratedFile(Make* m, int filename_id, int sha1_id) {
+  return TraceNode(m, Type::GeneratedFile, filename_id, sha1_id);
 }
 
 TraceNode TraceNode::Process(Make* m, int process_id) {
-  return TraceNode(m, Type::Process, "", 0, "", process_id);
+  return TraceNode(m, Type::Process, process_id, 0);
 }
 
 TraceNode TraceNode::CompileStep(Make* m, int process_id) {
-  return TraceNode(m, Type::CompileStep, "", 0, "", process_id);
+  return TraceNode(m, Type::CompileStep, process_id, 0);
 }
 
 TraceNode TraceNode::DynamicLinkStep(Make* m, int process_id) {
-  return TraceNode(m, Type::DynamicLinkStep, "", 0, "", process_id);
+  return TraceNode(m, Type::DynamicLinkStep, process_id, 0);
 }
 
 TraceNode TraceNode::StaticLinkStep(Make* m, int process_id) {
-  return TraceNode(m, Type::StaticLinkStep, "", 0, "", process_id);
+  return TraceNode(m, Type::StaticLinkStep, process_id, 0);
 }
 
-TraceNode::TraceNode(Make* m, Type type, const QString& source_filename,
-                     int file_index, const QByteArray& sha1, int process_id)
+TraceNode::TraceNode(Make* m, Type type, int filename_or_process_id,
+                     int extra)
     : make_(m),
-      type_(type),
-      source_filename_(source_filename),
-      file_index_(file_index),
-      sha1_(sha1),
-      process_id_(process_id) {
+      type_(quint32(type)),
+      filename_or_process_id_(filename_or_process_id),
+      extra_(extra) {
+  CHECK(filename_or_process_id >= 0 &&
+        filename_or_process_id < (1 << kIDBits))
+      << "ID out of range: " << filename_or_process_id;
 }
 
+TraceNode TraceNode::FromSnapshot(Make* m, const pb::GraphSnapshot_Node& pb) {
+  const Type type(static_cast<Type>(pb.type()));
+  switch (type) {
+    case Type::SourceFile:
+      return SourceFile(m, pb.filename_id());
+    case Type::GeneratedFile:
+      return GeneratedFile(m, pb.filename_id(),
+                           pb.has_sha1_id() ? pb.sha1_id() : -1);
+    case Type::CompileStep: {
+      TraceNode ret = CompileStep(m, pb.process_id());
+      ret.set_compiler_frontend_process_id(pb.compiler_frontend_process_id());
+      return ret;
+    }
+    default:
+      return TraceNode(m, type, pb.process_id(), 0);
+  }
+}
+
+void TraceNode::ToSnapshot(pb::GraphSnapshot_Node* pb) const {
+  pb->set_type(int(type_));
+  switch (type()) {
+    case Type::SourceFile:
+      pb->set_filename_id(filename_or_process_id_);
+      break;
+    case Type::GeneratedFile:
+      pb->set_filename_id(filename_or_process_id_);
+      if (extra_ != -1) {
+        pb->set_sha1_id(extra_);
+      }
+      break;
+    case Type::CompileStep:
+      pb->set_process_id(process_id());
+      pb->set_compiler_frontend_process_id(extra_);
+      break;
+    default:
+      pb->set_process_id(process_id());
+      break;
+  }
+}
+
+void TraceNode::SetFilename(int filename_id) {
+  CHECK(type() == Type::SourceFile || type() == Type::GeneratedFile);
+  CHECK(filename_id >= 0 && filename_id < (1 << kIDBits))
+      << "ID out of range: " << filename_id;
+  filename_or_process_id_ = filename_id;
+}
 
 QString TraceNode::ID() const {
-  switch (type_) {
+  switch (type()) {
+    case Type::Unknown:
+      return QString();
     case Type::SourceFile:
       return "source/" + Filename();
     case Type::GeneratedFile:
-      return "gen/" + sha1_.toHex() + ":" + Filename();
+      return "gen/" + make_->digest(extra_).toHex() + ":" + Filename();
     case Type::Process:
-      return "proc/" + QString::number(process_id_);
+      return "proc/" + QString::number(process_id());
     case Type::CompileStep:
-      return "compile/" + QString::number(process_id_);
+      return "compile/" + QString::number(process_id());
     case Type::DynamicLinkStep:
-      return "dlink/" + QString::number(process_id_);
+      return "dlink/" + QString::number(process_id());
     case Type::StaticLinkStep:
-      return "slink/" + QString::number(process_id_);
+      return "slink/" + QString::number(process_id());
     default:
       LOG(FATAL) << "Unknown type: " << int(type_);
-      return "";
+      return QString();
+  }
+}
+
+TraceNode::KeyType TraceNode::Key() const {
+  // The compile step's frontend isn't part of its ID, so it isn't part of
+  // the key either.
+  const quint32 sha1 = type() == Type::GeneratedFile ? quint32(extra_) : 0;
+  return (KeyType(type_) << kIDBits | filename_or_process_id_) << 32 | sha1;
+}
+
+QString TraceNode::IndexKey() const {
+  if (type() == Type::Process) {
+    return IndexKey(type(), utils::path::Filename(
+        make_->process(process_id()).filename()));
   }
+  return IndexKey(type(), QString());
 }
 
-QString TraceNode::Filename() const {
-  switch (type_) {
+QString TraceNode::IndexKey(Type type, const QString& process_filename) {
+  QString ret = QString::number(int(type));
+  if (!process_filename.isEmpty()) {
+    ret += ":" + process_filename;
+  }
+  return ret;
+}
+
+QString TraceNode::LookupKey() const {
+  if (type() == Type::SourceFile || type() == Type::GeneratedFile) {
+    return Filename();
+  }
+  return QString();
+}
+
+const QString& TraceNode::Filename() const {
+  static const QString kEmpty;
+  switch (type()) {
     case Type::SourceFile:
-      return source_filename_;
-    case Type::GeneratedFile: {
-      const pb::Process* proc = &make_->process(process_id_);
-      const pb::File* file = &proc->files(file_index_);
-      return file->filename();
-    }
+    case Type::GeneratedFile:
+      return make_->strings().Get(filename_or_process_id_);
     default:
       LOG(FATAL) << "Filename() called on node " << ID();
-      return "";
+      return kEmpty;
   }
 }
 
 void TraceNode::WriteDot(QTextStream& os) const {
-  switch (type_) {
+  switch (type()) {
     case TraceNode::Type::GeneratedFile:
       os << "shape=box,label=\"" << Filename() << "\"";
       break;
     case TraceNode::Type::Process: {
-      const pb::Process* proc = &make_->process(process_id_);
+      const TraceReader::Process proc = make_->process(process_id());
       os << "shape=ellipse,label=\""
-         << proc->argv()[0] << " (" << proc->id() << ")\"";
+         << proc.argv(0) << " (" << proc.id() << ")\"";
       break;
     }
     case TraceNode::Type::SourceFile:
       os << "shape=box,style=dashed,label=\"" << Filename() << "\"";
       break;
     case TraceNode::Type::CompileStep: {
-      const pb::Process* proc = &make_->process(process_id_);
+      const TraceReader::Process proc = make_->process(process_id());
       os << "shape=ellipse,style=filled,fillcolor=yellow,label=\"Compile "
-         << proc->argv()[0] << " (" << proc->id() << ")\"";
+         << proc.argv(0) << " (" << proc.id() << ")\"";
       break;
     }
     case TraceNode::Type::StaticLinkStep:
     case TraceNode::Type::DynamicLinkStep: {
-      const pb::Process* proc = &make_->process(process_id_);
+      const TraceReader::Process proc = make_->process(process_id());
       os << "shape=ellipse,style=filled,fillcolor=red,label=\"Link "
-         << proc->argv()[0] << " (" << proc->id() << ")\"";
+         << proc.argv(0) << " (" << proc.id() << ")\"";
       break;
     }
     default:
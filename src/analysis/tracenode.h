@@ -18,14 +18,19 @@
 #include <QTextStream>
 
 #include "common.h"
+#include "tracer.pb.h"
 
 namespace analysis {
 
 class Make;
 
+// A node in the graph built from a trace.  Nodes are 16 bytes and cheap to
+// copy: filenames and sha1s are kept as IDs in the trace's tables, and the
+// graph finds nodes by an integer Key() packed from those IDs.  The string ID
+// is only built when the graph sorts nodes or writes them out.
 class TraceNode {
  public:
-  enum class Type {
+  enum class Type : quint8 {
     Unknown,
 
     SourceFile,
@@ -37,41 +42,67 @@ class TraceNode {
     StaticLinkStep,
   };
 
+  // The type, the filename or process ID and the sha1 ID.
+  using KeyType = quint64;
+
   TraceNode();
 
-  static TraceNode SourceFile(Make* m, const QString& source_filename);
-  static TraceNode GeneratedFile(Make* m, int process_id,
-                                 int file_index, const QByteArray& sha1);
+  // filename_id is the ID of the filename in the trace's string table, and
+  // sha1_id the ID of the digest, or -1.
+  static TraceNode SourceFile(Make* m, int filename_id);
+  static TraceNode GeneratedFile(Make* m, int filename_id, int sha1_id);
   static TraceNode Process(Make* m, int process_id);
   static TraceNode CompileStep(Make* m, int process_id);
   static TraceNode DynamicLinkStep(Make* m, int process_id);
   static TraceNode StaticLinkStep(Make* m, int process_id);
 
+  static TraceNode FromSnapshot(Make* m, const pb::GraphSnapshot_Node& pb);
+  void ToSnapshot(pb::GraphSnapshot_Node* pb) const;
+
   QString ID() const;
+  KeyType Key() const;
   void WriteDot(QTextStream& os) const;
 
-  Make* make_;
-  Type type_;
+  // Groups nodes by type, and processes by the basename of their executable.
+  QString IndexKey() const;
+  static QString IndexKey(Type type, const QString& process_filename);
 
-  // For source files only.
-  QString source_filename_;
+  // The filename of source and generated files.
+  QString LookupKey() const;
 
-  // For generated files only.
-  int file_index_;
-  QByteArray sha1_;
+  Make* make() const { return make_; }
+  Type type() const { return Type(type_); }
 
   // For source files and generated files only.
-  QString Filename() const;
+  const QString& Filename() const;
 
-  // For generated files and processes.
-  int process_id_;
+  // Points a source or generated file at another filename, keeping a
+  // generated file's sha1.  Used when files are renamed.
+  void SetFilename(int filename_id);
+
+  // For processes and steps.
+  int process_id() const { return filename_or_process_id_; }
 
   // For compile steps.
-  int compiler_frontend_process_id_;
+  int compiler_frontend_process_id() const { return extra_; }
+  void set_compiler_frontend_process_id(int id) { extra_ = id; }
 
  private:
-  TraceNode(Make* m, Type type, const QString& source_filename,
-            int file_index, const QByteArray& sha1, int process_id);
+  static const int kTypeBits = 3;
+  static const int kIDBits = 32 - kTypeBits;
+
+  TraceNode(Make* m, Type type, int filename_or_process_id, int extra);
+
+  Make* make_;
+
+  // The filename ID of source and generated files, or the process ID of
+  // processes and steps.
+  quint32 type_ : kTypeBits;
+  quint32 filename_or_process_id_ : kIDBits;
+
+  // The sha1 ID of generated files, or the compiler frontend's process ID of
+  // compile steps.
+  int extra_;
 };
 
 }  // namespace analysis
@@ -0,0 +1,48 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "analyzeall.h"
+
+#include "installedfilesreader.h"
+#include "utils/logging.h"
+
+#include <QFuture>
+#include <QtConcurrentRun>
+
+bool AnalyzeAll::Run(const Options& opts) {
+  // Nothing else uses the configure output, so it runs alongside everything.
+  QFuture<bool> configure = QtConcurrent::run([&opts]() {
+    return analysis::Configure::Run(opts.configure);
+  });
+
+  InstalledFilesReader installed_files;
+  analysis::Make::Output make_output;
+  bool ok = analysis::Install::Run(opts.install, &installed_files);
+  if (ok) {
+    analysis::Make::Options make_opts = opts.make;
+    make_opts.installed_files = &installed_files;
+    ok = analysis::Make::Run(make_opts, &make_output);
+  }
+  if (ok) {
+    ok = gen::bazel::Generator::Run(opts.bazel, make_output.metadata,
+                                    make_output.build_targets,
+                                    installed_files);
+  }
+
+  if (!configure.result()) {
+    LOG(ERROR) << "Failed to analyze " << opts.configure.trace_filename;
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,46 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ANALYZEALL_H
+#define ANALYZEALL_H
+
+#include "analysis/configure.h"
+#include "analysis/install.h"
+#include "analysis/make.h"
+#include "gen/bazel/generator.h"
+
+// Runs analyze-conf, analyze-install, analyze-make and gen-bazel in one
+// process.  Configure and install analysis run at the same time, and the
+// installed files and build targets are passed between the steps in memory
+// instead of through record files.
+class AnalyzeAll {
+ public:
+  struct Options {
+    analysis::Configure::Options configure;
+
+    // output_filename may be empty to skip writing the .files file.
+    analysis::Install::Options install;
+
+    // install_filename and installed_files are ignored.  output_filename may
+    // be empty to skip writing the .targets file.
+    analysis::Make::Options make;
+
+    // target_filename and installed_files_filename are ignored.
+    gen::bazel::Generator::Options bazel;
+  };
+
+  static bool Run(const Options& opts);
+};
+
+#endif  // ANALYZEALL_H
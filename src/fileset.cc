@@ -0,0 +1,159 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fileset.h"
+
+#include <algorithm>
+
+#include <QCryptographicHash>
+#include <QMap>
+
+#include "utils/logging.h"
+
+namespace {
+
+// Directories with fewer files read than this are left in the Process record,
+// since a reference to a tiny set doesn't save anything.
+const int kMinFileSetSize = 4;
+
+bool CanShare(const pb::File& file) {
+  return file.access() == pb::File_Access_READ &&
+         !file.has_renamed_from() &&
+         file.has_sha1_before();
+}
+
+QString Directory(const QString& filename) {
+  const int last_slash = filename.lastIndexOf('/');
+  if (last_slash == -1) {
+    return QString();
+  }
+  return filename.left(last_slash);
+}
+
+}  // namespace
+
+
+FileSetWriter::FileSetWriter(
+    std::unique_ptr<utils::RecordWriter<pb::Record>> writer)
+    : writer_(std::move(writer)) {
+}
+
+void FileSetWriter::WriteRecord(const pb::Record& record) {
+  if (record.has_trace_index()) {
+    pb::Record index(record);
+    for (const pb::TraceIndex_FileSetOffset& offset : file_set_offsets_) {
+      index.mutable_trace_index()->add_file_set()->CopyFrom(offset);
+    }
+    writer_->WriteRecord(index);
+    return;
+  }
+
+  if (!record.has_process()) {
+    writer_->WriteRecord(record);
+    return;
+  }
+
+  const pb::Process& original = record.process();
+
+  QMap<QString, QList<const pb::File*>> shared_by_directory;
+  QList<const pb::File*> unshared;
+  for (const pb::File& file : original.files()) {
+    if (CanShare(file)) {
+      shared_by_directory[Directory(file.filename())].append(&file);
+    } else {
+      unshared.append(&file);
+    }
+  }
+
+  pb::Record factored(record);
+  pb::Process* process = factored.mutable_process();
+  process->clear_files();
+
+  for (QList<const pb::File*> files : shared_by_directory) {
+    if (files.count() < kMinFileSetSize) {
+      unshared.append(files);
+      continue;
+    }
+
+    std::sort(files.begin(), files.end(),
+              [](const pb::File* a, const pb::File* b) {
+      return a->filename() < b->filename();
+    });
+
+    pb::FileSetReference* reference = process->add_file_set();
+    reference->set_file_set_id(FileSetID(files));
+    for (const pb::File* file : files) {
+      reference->add_open_ordering(file->open_ordering());
+      reference->add_close_ordering(file->close_ordering());
+    }
+  }
+
+  for (const pb::File* file : unshared) {
+    process->add_files()->CopyFrom(*file);
+  }
+
+  writer_->WriteRecord(factored);
+}
+
+int FileSetWriter::FileSetID(const QList<const pb::File*>& files) {
+  pb::Record record;
+  pb::FileSet* file_set = record.mutable_file_set();
+  for (const pb::File* file : files) {
+    pb::File* copy = file_set->add_files();
+    copy->set_filename(file->filename());
+    copy->set_access(file->access());
+    copy->set_sha1_before(file->sha1_before());
+    if (file->has_sha1_after()) {
+      copy->set_sha1_after(file->sha1_after());
+    }
+  }
+
+  const std::string bytes = file_set->SerializeAsString();
+  const QByteArray digest = QCryptographicHash::hash(
+      QByteArray(bytes.data(), bytes.size()), QCryptographicHash::Sha1);
+
+  auto it = file_set_ids_.find(digest);
+  if (it != file_set_ids_.end()) {
+    return it.value();
+  }
+
+  const int id = file_set_ids_.count();
+  file_set_ids_.insert(digest, id);
+  file_set->set_id(id);
+
+  const qint64 offset = writer_->Offset();
+  if (offset >= 0) {
+    pb::TraceIndex_FileSetOffset entry;
+    entry.set_id(id);
+    entry.set_offset(offset);
+    file_set_offsets_.append(entry);
+  }
+
+  writer_->WriteRecord(record);
+  return id;
+}
+
+void ExpandFileSet(const pb::FileSet& file_set,
+                   const pb::FileSetReference& reference,
+                   pb::Process* process) {
+  CHECK_EQ(file_set.files_size(), reference.open_ordering_size());
+  CHECK_EQ(file_set.files_size(), reference.close_ordering_size());
+
+  for (int i = 0; i < file_set.files_size(); ++i) {
+    pb::File* file = process->add_files();
+    file->CopyFrom(file_set.files(i));
+    file->set_open_ordering(reference.open_ordering()[i]);
+    file->set_close_ordering(reference.close_ordering()[i]);
+  }
+}
@@ -0,0 +1,56 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FILESET_H
+#define FILESET_H
+
+#include <memory>
+
+#include <QHash>
+
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
+// Moves groups of files that a process read without changing out of its
+// Process record and into shared FileSet records.  Files are grouped by
+// directory, and each distinct group (by filename and sha1) is written once,
+// just before the first process that refers to it.  The offsets of the FileSet
+// records are added to any TraceIndex written through this writer.
+class FileSetWriter : public utils::RecordWriter<pb::Record> {
+ public:
+  explicit FileSetWriter(
+      std::unique_ptr<utils::RecordWriter<pb::Record>> writer);
+
+  void WriteRecord(const pb::Record& record) override;
+  qint64 Offset() const override { return writer_->Offset(); }
+
+ private:
+  // Returns the ID of the set containing exactly these files, writing a new
+  // FileSet record if this is the first time the set has been seen.
+  int FileSetID(const QList<const pb::File*>& files);
+
+  std::unique_ptr<utils::RecordWriter<pb::Record>> writer_;
+
+  // Keyed by the sha1 of the serialized FileSet.
+  QHash<QByteArray, int> file_set_ids_;
+  QList<pb::TraceIndex_FileSetOffset> file_set_offsets_;
+};
+
+// Appends the files in the set to the process' files, with the orderings from
+// the reference.
+void ExpandFileSet(const pb::FileSet& file_set,
+                   const pb::FileSetReference& reference,
+                   pb::Process* process);
+
+#endif // FILESET_H
@@ -14,11 +14,8 @@
 
 #include "fromapt.h"
 
+#include "analyzeall.h"
 #include "tracer.h"
-#include "analysis/configure.h"
-#include "analysis/install.h"
-#include "analysis/make.h"
-#include "gen/bazel/generator.h"
 #include "utils/logging.h"
 
 #include <QCoreApplication>
@@ -119,41 +116,19 @@ bool FromApt::Run() {
     return false;
   }
 
-  analysis::Configure::Options conf_opts;
-  conf_opts.trace_filename = output_dir_ + "/configure.trace";
-  conf_opts.output_filename = output_dir_ + "/configure.files";
-  if (!analysis::Configure::Run(conf_opts)) {
-    return false;
-  }
-
-  analysis::Install::Options install_opts;
-  install_opts.trace_filename = output_dir_ + "/install.trace";
-  install_opts.output_filename = output_dir_ + "/install.files";
-  if (!analysis::Install::Run(install_opts)) {
-    return false;
-  }
-
-  analysis::Make::Options make_opts;
-  make_opts.trace_filename = output_dir_ + "/make.trace";
-  make_opts.install_filename = install_opts.output_filename;
-  make_opts.output_filename = output_dir_ + "/make.targets";
-  make_opts.graph_output_filename = output_dir_ + "/make.dot";
-  make_opts.intermediate_graph_output_filename =
+  AnalyzeAll::Options opts;
+  opts.configure.trace_filename = output_dir_ + "/configure.trace";
+  opts.configure.output_filename = output_dir_ + "/configure.files";
+  opts.install.trace_filename = output_dir_ + "/install.trace";
+  opts.install.output_filename = output_dir_ + "/install.files";
+  opts.make.trace_filename = output_dir_ + "/make.trace";
+  opts.make.output_filename = output_dir_ + "/make.targets";
+  opts.make.graph_output_filename = output_dir_ + "/make.dot";
+  opts.make.intermediate_graph_output_filename =
       output_dir_ + "/make.intermediate.dot";
-  if (!analysis::Make::Run(make_opts)) {
-    return false;
-  }
-
-  gen::bazel::Generator::Options bazel_opts;
-  bazel_opts.target_filename = make_opts.output_filename;
-  bazel_opts.installed_files_filename = install_opts.output_filename;
-  bazel_opts.workspace_path = bazel_workspace_;
-  bazel_opts.project_root = source_dir_;
-  if (!gen::bazel::Generator::Run(bazel_opts)) {
-    return false;
-  }
-
-  return true;
+  opts.bazel.workspace_path = bazel_workspace_;
+  opts.bazel.project_root = source_dir_;
+  return AnalyzeAll::Run(opts);
 }
 
 bool FromApt::RunCommand(const QString& working_directory,
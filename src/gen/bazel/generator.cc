@@ -30,24 +30,38 @@ static const char* kPublicHeaderPrefix = "public_headers/";
 
 bool Generator::Run(const Options& opts) {
   // Read the targets.
-  auto make_fh =
-      make_unique<utils::RecordFile<pb::Record>>(opts.target_filename);
-  if (!make_fh->Open(QIODevice::ReadOnly)) {
-    LOG(ERROR) << "Failed to open " << make_fh->filename() << " for reading";
+  auto make_fh = utils::OpenRecordReader<pb::Record>(opts.target_filename);
+  if (!make_fh) {
+    LOG(ERROR) << "Failed to open " << opts.target_filename << " for reading";
     return false;
   }
 
   // Read the installed files.
   auto installed_files_fh =
-      make_unique<utils::RecordFile<pb::Record>>(opts.installed_files_filename);
-  if (!installed_files_fh->Open(QIODevice::ReadOnly)) {
-    LOG(ERROR) << "Failed to open " << installed_files_fh->filename()
+      utils::OpenRecordReader<pb::Record>(opts.installed_files_filename);
+  if (!installed_files_fh) {
+    LOG(ERROR) << "Failed to open " << opts.installed_files_filename
                << " for reading";
     return false;
   }
 
   Generator gen(opts);
-  gen.Generate(std::move(make_fh), std::move(installed_files_fh));
+  gen.Read(std::move(make_fh), std::move(installed_files_fh));
+  gen.Generate();
+  return true;
+}
+
+bool Generator::Run(const Options& opts,
+                    const pb::MetaData& metadata,
+                    const QList<pb::BuildTarget>& targets,
+                    const InstalledFilesReader& installed_files) {
+  Generator gen(opts);
+  gen.metadata_ = metadata;
+  for (const pb::BuildTarget& target : targets) {
+    gen.targets_[target.qualified_name()] = target;
+  }
+  gen.installed_files_ = installed_files;
+  gen.Generate();
   return true;
 }
 
@@ -174,25 +188,28 @@ void Generator::AddTargetRecursive(const pb::BuildTarget& target, Rule* rule,
   }
 }
 
-void Generator::Generate(
-    std::unique_ptr<utils::RecordFile<pb::Record>> target_records,
-    std::unique_ptr<utils::RecordFile<pb::Record>> installed_file_records) {
+void Generator::Read(
+    std::unique_ptr<utils::RecordReader<pb::Record>> target_records,
+    std::unique_ptr<utils::RecordReader<pb::Record>> installed_file_records) {
   installed_files_.Read(std::move(installed_file_records));
 
   // Read all the build targets.
-  while (!target_records->AtEnd()) {
-    pb::Record record;
-    CHECK(target_records->ReadRecord(&record));
-
+  auto records = target_records->Records();
+  for (pb::Record& record : records) {
     if (record.has_metadata()) {
-      metadata_ = record.metadata();
-      if (!opts_.project_root.isEmpty()) {
-        metadata_.set_project_root(opts_.project_root);
-      }
+      metadata_.Swap(record.mutable_metadata());
     } else if (record.has_build_target()) {
-      targets_[record.build_target().qualified_name()] = record.build_target();
+      const QString name = record.build_target().qualified_name();
+      targets_[name].Swap(record.mutable_build_target());
     }
   }
+  CHECK(records.ok());
+}
+
+void Generator::Generate() {
+  if (!opts_.project_root.isEmpty()) {
+    metadata_.set_project_root(opts_.project_root);
+  }
 
   package_ = metadata_.project_name();
   package_.replace(QRegularExpression("[^a-zA-Z0-9_]"), "_");
@@ -44,12 +44,20 @@ class Generator {
 
   static bool Run(const Options& opts);
 
+  // Generates from targets and installed files that are already in memory.
+  // target_filename and installed_files_filename are ignored.
+  static bool Run(const Options& opts,
+                  const pb::MetaData& metadata,
+                  const QList<pb::BuildTarget>& targets,
+                  const InstalledFilesReader& installed_files);
+
  private:
   Generator(const Options& opts);
 
-  void Generate(
-      std::unique_ptr<utils::RecordFile<pb::Record>> target_records,
-      std::unique_ptr<utils::RecordFile<pb::Record>> installed_file_records);
+  void Read(
+      std::unique_ptr<utils::RecordReader<pb::Record>> target_records,
+      std::unique_ptr<utils::RecordReader<pb::Record>> installed_file_records);
+  void Generate();
 
   Label ConvertLabel(const Label& label);
   void AddTargetRecursive(const pb::BuildTarget& target, Rule* rule,
@@ -15,30 +15,62 @@
 #ifndef GRAPH_H
 #define GRAPH_H
 
+#include <algorithm>
+#include <functional>
 #include <utility>
 
 #include <glog/logging.h>
 
 #include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QSet>
 #include <QTextStream>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrentMap>
 
 #include "common.h"
 #include "utils/logging.h"
 
+// NodeType must have:
+//   QString ID()        - uniquely identifies the node in the graph.  Nodes
+//                         are visited in ID order.
+//   KeyType Key()       - also uniquely identifies the node, but is cheaper to
+//                         make and hash than the ID.  The graph finds nodes by
+//                         their key and only builds IDs to sort or write them.
+//                         NodeType::KeyType must work as a QHash key.
+//   QString IndexKey()  - groups similar nodes so FindSubgraphMatches can find
+//                         candidates for a subgraph node without looking at
+//                         every node in the graph.
+//   QString LookupKey() - another key nodes can be found by with
+//                         FindByLookupKey, or an empty string.
 template <typename N>
 class Graph {
  public:
   Graph() {}
 
   using IDType = QString;
+  using KeyType = typename N::KeyType;
   using EdgeType = QPair<IDType, IDType>;
   using NodeType = N;
 
+  // Every node in the graph has a dense integer handle.  Handles stay valid
+  // until their node is removed and are never reused.
+  using Handle = int;
+
+  class NeighbourRange;
+
   void AddNode(const NodeType& node);
+
+  // Like AddNode, but takes the node's Key(), IndexKey() and LookupKey()
+  // instead of computing them, and returns the node's handle.
+  Handle AddNode(const NodeType& node, const KeyType& key,
+                 const QString& index_key, const QString& lookup_key);
   void AddEdge(const NodeType& from, const NodeType& to);
-  void AddEdgeByID(const IDType& from, const IDType& to);
+  void AddEdgeByKey(const KeyType& from, const KeyType& to);
   void RemoveEdge(const NodeType& from, const NodeType& to);
-  void RemoveEdgeByID(const IDType& from, const IDType& to);
+  void RemoveEdgeByKey(const KeyType& from, const KeyType& to);
   void RemoveNode(const NodeType& node);
 
   // Adds all the nodes, and adds edges from one node to the next.
@@ -51,15 +83,52 @@ class Graph {
   QList<NodeType> Incoming(const NodeType& node) const;
   QList<NodeType> Outgoing(const NodeType& node) const;
 
-  bool empty() const { return nodes_.empty(); }
-  int count() const { return nodes_.count(); }
+  // Returns the handle of the node with this key, or -1 if there isn't one.
+  Handle FindHandle(const KeyType& key) const;
+
+  // Handles of every node in the graph, ordered by node ID.
+  QVector<Handle> AllHandles() const;
+
+  // Handles of the nodes with this LookupKey(), ordered by node ID.
+  QVector<Handle> FindByLookupKey(const QString& key) const;
+
+  // All handles are less than this.
+  int handle_limit() const { return nodes_.count(); }
+
+  const NodeType& node(Handle handle) const { return nodes_[handle]; }
+  void AddEdgeByHandle(Handle from, Handle to);
+  IDType id(Handle handle) const { return nodes_[handle].ID(); }
+
+  // Ranges over the handles of a node's neighbours without copying anything.
+  // They are invalidated by any change to the graph.
+  NeighbourRange IncomingHandles(Handle handle) const;
+  NeighbourRange OutgoingHandles(Handle handle) const;
+  int IncomingCount(Handle handle) const {
+    return adjacency_[handle].incoming_count;
+  }
+  int OutgoingCount(Handle handle) const {
+    return adjacency_[handle].outgoing_count;
+  }
+
+  // Returns the nodes that can be reached from the given nodes by following at
+  // most distance edges in either direction, including the given nodes
+  // themselves.  Removed nodes are skipped.
+  QVector<Handle> NodesWithinDistance(const QVector<Handle>& from,
+                                      int distance) const;
+
+  bool empty() const { return handles_.empty(); }
+  int count() const { return handles_.count(); }
 
-  // Subgraph must be a connected graph, and Subgraph::NodeType must have:
+  // Subgraph must be a connected Graph, and Subgraph::NodeType must have:
   //   bool Match(NodeType)  - where NodeType is from *this* graph.
   //   bool ExactIncomingNeighbourCount()
   //   bool ExactOutgoingNeighbourCount()
+  //   QStringList CandidateIndexKeys()  - the IndexKey()s of nodes in this
+  //       graph that Match could accept, or an empty list if it could accept
+  //       any node.
   // Tries to place the subgraph over every position in this graph and returns
-  // any configurations where Match returns true for every node.
+  // any configurations where Match returns true for every node.  Matching
+  // starts from the subgraph node with the fewest candidates.
   // The return type is a QList of matches.  Each match maps the ID of the
   // subgraph node to the corresponding node in this graph.
   template <typename Subgraph>
@@ -76,41 +145,287 @@ class Graph {
   void ReplaceSubgraph(Iterator begin, Iterator end,
                        const NodeType& replacement);
 
-  // Repeatedly calls FindSubgraphMatches and uses replace_fn to remove them.
-  // Continues until there are no more matches.  ReplaceFn should be a function
-  // (or lambda) that takes a map<typename Subgraph::IDType, NodeType>.  It must
-  // remove or replace all the matches from the graph.
+  // Calls FindSubgraphMatches and uses replace_fn to remove them.  Then
+  // searches again around the nodes replace_fn changed, and continues until
+  // there are no more matches.  ReplaceFn should be a function (or lambda)
+  // that takes a map<typename Subgraph::IDType, NodeType>.  It must remove or
+  // replace all the matches from the graph.
   template <typename Subgraph, typename ReplaceFn>
   void FindAndReplaceSubgraph(const Subgraph& subgraph, ReplaceFn replace_fn);
 
+  // A subgraph and the function that replaces its matches.
+  template <typename Subgraph>
+  struct Rewrite {
+    Subgraph subgraph;
+    std::function<void(const QMap<typename Subgraph::IDType, NodeType>&)>
+        replace_fn;
+  };
+
+  // Like FindAndReplaceSubgraph, but searches for all the subgraphs in one
+  // walk over the graph.  Rewrites are in priority order: if several could
+  // start matching from the same node, only the first one that matches is
+  // used, and in each round earlier rewrites' matches are replaced first.
+  template <typename Subgraph>
+  void FindAndReplaceSubgraphs(const QList<Rewrite<Subgraph>>& rewrites);
+
   // Writes a DOT representation of this graph to the stream.  Nodes must have
   // a WriteDot function to write their own state.
   void WriteDot(QTextStream& os) const;
   void WriteDotToFile(const QString& filename) const;
 
  private:
-  bool HasNodeByID(const IDType& id) const;
+  // Edges live in one flat vector.  Each node has a singly linked list of its
+  // incoming edges and another of its outgoing edges, threaded through the
+  // vector by index.  Removed edges stay in the lists as tombstones until
+  // there are enough of them to be worth compacting.
+  struct Edge {
+    Handle from;
+    Handle to;
+    int next_incoming;  // Index of the next edge into "to", or -1.
+    int next_outgoing;  // Index of the next edge out of "from", or -1.
+    bool removed;
+  };
 
-  QList<NodeType> Neighbours(const NodeType& node,
-                             const QMap<IDType, QSet<IDType>>& direction) const;
+  struct Adjacency {
+    int first_incoming = -1;
+    int first_outgoing = -1;
+    int incoming_count = 0;
+    int outgoing_count = 0;
+    bool removed = false;
+  };
+
+  static void AddToIndex(const QString& key, Handle handle,
+                         QHash<QString, QSet<Handle>>* index) {
+    (*index)[key].insert(handle);
+  }
+  static void RemoveFromIndex(const QString& key, Handle handle,
+                              QHash<QString, QSet<Handle>>* index) {
+    auto it = index->find(key);
+    if (it != index->end()) {
+      it->remove(handle);
+      if (it->isEmpty()) {
+        index->erase(it);
+      }
+    }
+  }
+
+  static quint64 EdgeKey(Handle from, Handle to) {
+    return (quint64(quint32(from)) << 32) | quint32(to);
+  }
+
+  bool HasNodeByKey(const KeyType& key) const;
+
+  // Sorts handles by their nodes' IDs, building each ID once.
+  void SortByID(QVector<Handle>* handles) const;
+
+  void RemoveEdgeByIndex(int index);
+  void RemoveNodeByHandle(Handle handle);
+  void CompactEdges();
+
+  QList<NodeType> Neighbours(const NodeType& node, bool incoming) const;
+
+  // A partial placement of a subgraph over this graph.
+  struct MatchState {
+    // Indexed by subgraph handle.  The handle in this graph of each subgraph
+    // node that has been matched so far, or -1.
+    QVector<Handle> matched;
+
+    // Subgraph handles in the order they were matched, so a failed branch of
+    // the search can be undone without copying the state.
+    QVector<int> undo_log;
+
+    void Undo(int mark) {
+      while (undo_log.count() > mark) {
+        matched[undo_log.takeLast()] = -1;
+      }
+    }
+  };
 
+  // A subgraph to search for, and the subgraph node to start matching from.
   template <typename Subgraph>
-  bool MatchRecursive(
-      const NodeType& node,
-      const Subgraph& subgraph,
-      const typename Subgraph::NodeType& subgraph_node,
-      QMap<typename Subgraph::IDType, NodeType>* match) const;
-
-  QMap<IDType, N> nodes_;
-  QSet<EdgeType> edges_;
-  QMap<IDType, QSet<IDType>> incoming_edges_;
-  QMap<IDType, QSet<IDType>> outgoing_edges_;
+  struct Search {
+    const Subgraph* subgraph;
+    int start_node;
+
+    // The index keys of nodes that could match the start node, or empty if
+    // any node could.
+    QSet<QString> keys;
+
+    // How far the start node is from the furthest node in the subgraph.
+    int radius;
+  };
+
+  // A match of one of the searches, indexed by subgraph handle.
+  struct Found {
+    int search;
+    QVector<Handle> match;
+  };
+
+  // Picks the subgraph node with the fewest candidates to start from.
+  template <typename Subgraph>
+  Search<Subgraph> MakeSearch(const Subgraph& subgraph) const;
+
+  // Returns the nodes with any of the index keys, or all nodes if keys is
+  // empty, in ID order.
+  QVector<Handle> CandidatesForKeys(const QSet<QString>& keys) const;
+
+  // Tries each search's start node against each of the candidates, and keeps
+  // the first search that matches at each candidate.  Matches are returned in
+  // the order of their candidates, but the search is spread over the global
+  // QThreadPool.
+  template <typename Subgraph>
+  QVector<Found> MatchFrom(const QVector<Handle>& candidates,
+                           const QVector<Search<Subgraph>>& searches) const;
+
+  template <typename Subgraph>
+  QMap<typename Subgraph::IDType, NodeType> MatchToMap(
+      const QVector<Handle>& match, const Subgraph& subgraph) const;
+
+  void Touch(Handle handle) {
+    if (tracking_touched_) {
+      touched_.append(handle);
+    }
+  }
+
+  template <typename Subgraph>
+  bool MatchRecursive(Handle node, const Subgraph& subgraph,
+                      int subgraph_node, MatchState* state) const;
+
+  template <typename Subgraph>
+  bool MatchNeighbours(const NeighbourRange& neighbours,
+                       const typename Subgraph::NeighbourRange& subgraph_nodes,
+                       const Subgraph& subgraph, MatchState* state) const;
+
+  // Indexed by handle.  Removed nodes are left behind as default-constructed
+  // values.
+  QVector<NodeType> nodes_;
+  QVector<Adjacency> adjacency_;
+
+  // Interns node keys.  This is unordered, so AllNodes and
+  // FindSubgraphMatches sort nodes by ID to visit them in the same order
+  // whatever order they were added in.
+  QHash<KeyType, Handle> handles_;
+
+  // Nodes grouped by IndexKey() and LookupKey().  Nodes with an empty
+  // LookupKey() aren't in lookup_.
+  QVector<QString> index_keys_;
+  QHash<QString, QSet<Handle>> index_;
+  QVector<QString> lookup_keys_;
+  QHash<QString, QSet<Handle>> lookup_;
+
+  QVector<Edge> edges_;
+  QHash<quint64, int> edge_indices_;
+  int removed_edge_count_ = 0;
+
+  // While FindAndReplaceSubgraph is running, the nodes that were added or
+  // changed, or had edges added or removed.  May contain duplicates.
+  bool tracking_touched_ = false;
+  QVector<Handle> touched_;
+};
+
+
+template <typename NodeType>
+class Graph<NodeType>::NeighbourRange {
+ public:
+  class const_iterator {
+   public:
+    const_iterator(const QVector<Edge>* edges, int index, bool incoming)
+        : edges_(edges), index_(index), incoming_(incoming) {
+      SkipRemoved();
+    }
+
+    Handle operator*() const {
+      const Edge& edge = (*edges_)[index_];
+      return incoming_ ? edge.from : edge.to;
+    }
+
+    const_iterator& operator++() {
+      index_ = Next();
+      SkipRemoved();
+      return *this;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    int Next() const {
+      const Edge& edge = (*edges_)[index_];
+      return incoming_ ? edge.next_incoming : edge.next_outgoing;
+    }
+
+    void SkipRemoved() {
+      while (index_ != -1 && (*edges_)[index_].removed) {
+        index_ = Next();
+      }
+    }
+
+    const QVector<Edge>* edges_;
+    int index_;
+    bool incoming_;
+  };
+
+  NeighbourRange(const QVector<Edge>* edges, int first, bool incoming)
+      : edges_(edges), first_(first), incoming_(incoming) {}
+
+  const_iterator begin() const {
+    return const_iterator(edges_, first_, incoming_);
+  }
+  const_iterator end() const { return const_iterator(edges_, -1, incoming_); }
+  bool empty() const { return begin() == end(); }
+
+ private:
+  const QVector<Edge>* edges_;
+  int first_;
+  bool incoming_;
 };
 
 
 template <typename NodeType>
 void Graph<NodeType>::AddNode(const NodeType& node) {
-  nodes_[node.ID()] = node;
+  AddNode(node, node.Key(), node.IndexKey(), node.LookupKey());
+}
+
+template <typename NodeType>
+typename Graph<NodeType>::Handle Graph<NodeType>::AddNode(
+    const NodeType& node, const KeyType& key, const QString& index_key,
+    const QString& lookup_key) {
+  auto it = handles_.find(key);
+  if (it != handles_.end()) {
+    const Handle handle = it.value();
+    Touch(handle);
+    nodes_[handle] = node;
+    if (index_keys_[handle] != index_key) {
+      RemoveFromIndex(index_keys_[handle], handle, &index_);
+      AddToIndex(index_key, handle, &index_);
+      index_keys_[handle] = index_key;
+    }
+    if (lookup_keys_[handle] != lookup_key) {
+      RemoveFromIndex(lookup_keys_[handle], handle, &lookup_);
+      if (!lookup_key.isEmpty()) {
+        AddToIndex(lookup_key, handle, &lookup_);
+      }
+      lookup_keys_[handle] = lookup_key;
+    }
+    return handle;
+  }
+
+  const Handle handle = nodes_.count();
+  Touch(handle);
+  handles_.insert(key, handle);
+  nodes_.append(node);
+  adjacency_.append(Adjacency());
+  index_keys_.append(index_key);
+  AddToIndex(index_key, handle, &index_);
+  lookup_keys_.append(lookup_key);
+  if (!lookup_key.isEmpty()) {
+    AddToIndex(lookup_key, handle, &lookup_);
+  }
+  return handle;
 }
 
 template <typename NodeType>
@@ -121,83 +436,232 @@ void Graph<NodeType>::AddEdge(const NodeType& from, const NodeType& to) {
   if (!HasNode(to)) {
     AddNode(to);
   }
-  AddEdgeByID(from.ID(), to.ID());
+  AddEdgeByKey(from.Key(), to.Key());
 }
 
 template <typename NodeType>
-void Graph<NodeType>::AddEdgeByID(const IDType& from, const IDType& to) {
-  CHECK(HasNodeByID(from));
-  CHECK(HasNodeByID(to));
+void Graph<NodeType>::AddEdgeByKey(const KeyType& from, const KeyType& to) {
+  const Handle from_handle = FindHandle(from);
+  const Handle to_handle = FindHandle(to);
+  CHECK_NE(-1, from_handle);
+  CHECK_NE(-1, to_handle);
 
-  edges_.insert(qMakePair(from, to));
-  outgoing_edges_[from].insert(to);
-  incoming_edges_[to].insert(from);
+  AddEdgeByHandle(from_handle, to_handle);
+}
+
+template <typename NodeType>
+void Graph<NodeType>::AddEdgeByHandle(Handle from, Handle to) {
+  const quint64 key = EdgeKey(from, to);
+  if (edge_indices_.contains(key)) {
+    return;
+  }
+
+  Adjacency* from_adjacency = &adjacency_[from];
+  Adjacency* to_adjacency = &adjacency_[to];
+
+  Edge edge;
+  edge.from = from;
+  edge.to = to;
+  edge.next_incoming = to_adjacency->first_incoming;
+  edge.next_outgoing = from_adjacency->first_outgoing;
+  edge.removed = false;
+
+  const int index = edges_.count();
+  edges_.append(edge);
+  edge_indices_.insert(key, index);
+
+  Touch(from);
+  Touch(to);
+  to_adjacency->first_incoming = index;
+  to_adjacency->incoming_count++;
+  from_adjacency->first_outgoing = index;
+  from_adjacency->outgoing_count++;
 }
 
 template <typename NodeType>
 void Graph<NodeType>::RemoveEdge(const NodeType& from, const NodeType& to) {
-  RemoveEdgeByID(from.ID(), to.ID());
+  RemoveEdgeByKey(from.Key(), to.Key());
 }
 
 template <typename NodeType>
-void Graph<NodeType>::RemoveEdgeByID(const IDType& from, const IDType& to) {
-  CHECK(HasNodeByID(from));
-  CHECK(HasNodeByID(to));
+void Graph<NodeType>::RemoveEdgeByKey(const KeyType& from, const KeyType& to) {
+  const Handle from_handle = FindHandle(from);
+  const Handle to_handle = FindHandle(to);
+  CHECK_NE(-1, from_handle);
+  CHECK_NE(-1, to_handle);
 
-  edges_.remove(qMakePair(from, to));
-  outgoing_edges_[from].remove(to);
-  incoming_edges_[to].remove(from);
+  auto it = edge_indices_.constFind(EdgeKey(from_handle, to_handle));
+  if (it != edge_indices_.constEnd()) {
+    RemoveEdgeByIndex(it.value());
+    CompactEdges();
+  }
+}
+
+template <typename NodeType>
+void Graph<NodeType>::RemoveEdgeByIndex(int index) {
+  Edge* edge = &edges_[index];
+  edge->removed = true;
+  Touch(edge->from);
+  Touch(edge->to);
+  edge_indices_.remove(EdgeKey(edge->from, edge->to));
+  adjacency_[edge->from].outgoing_count--;
+  adjacency_[edge->to].incoming_count--;
+  removed_edge_count_++;
 }
 
 template <typename NodeType>
 void Graph<NodeType>::RemoveNode(const NodeType& node) {
-  const IDType id = node.ID();
-  nodes_.remove(id);
-  for (const IDType& neighbour_id : incoming_edges_[id]) {
-    edges_.remove(EdgeType(neighbour_id, id));
-    outgoing_edges_[neighbour_id].remove(id);
+  const Handle handle = FindHandle(node.Key());
+  if (handle != -1) {
+    RemoveNodeByHandle(handle);
+    CompactEdges();
   }
-  for (const IDType& neighbour_id : outgoing_edges_[id]) {
-    edges_.remove(EdgeType(id, neighbour_id));
-    incoming_edges_[neighbour_id].remove(id);
+}
+
+template <typename NodeType>
+void Graph<NodeType>::RemoveNodeByHandle(Handle handle) {
+  Adjacency* adjacency = &adjacency_[handle];
+  for (int i = adjacency->first_incoming; i != -1;
+       i = edges_[i].next_incoming) {
+    if (!edges_[i].removed) {
+      RemoveEdgeByIndex(i);
+    }
+  }
+  for (int i = adjacency->first_outgoing; i != -1;
+       i = edges_[i].next_outgoing) {
+    if (!edges_[i].removed) {
+      RemoveEdgeByIndex(i);
+    }
+  }
+  *adjacency = Adjacency();
+  adjacency->removed = true;
+
+  RemoveFromIndex(index_keys_[handle], handle, &index_);
+  RemoveFromIndex(lookup_keys_[handle], handle, &lookup_);
+
+  handles_.remove(nodes_[handle].Key());
+  nodes_[handle] = NodeType();
+  index_keys_[handle] = QString();
+  lookup_keys_[handle] = QString();
+}
+
+template <typename NodeType>
+void Graph<NodeType>::CompactEdges() {
+  if (removed_edge_count_ < 1024 || removed_edge_count_ * 2 < edges_.count()) {
+    return;
+  }
+
+  QVector<Edge> old_edges;
+  old_edges.swap(edges_);
+  edges_.reserve(old_edges.count() - removed_edge_count_);
+  edge_indices_.clear();
+  removed_edge_count_ = 0;
+  for (Adjacency& adjacency : adjacency_) {
+    adjacency.first_incoming = -1;
+    adjacency.first_outgoing = -1;
+    adjacency.incoming_count = 0;
+    adjacency.outgoing_count = 0;
+  }
+
+  // Re-adding the edges in their original order keeps the neighbour lists in
+  // the same order.
+  for (const Edge& edge : old_edges) {
+    if (!edge.removed) {
+      AddEdgeByHandle(edge.from, edge.to);
+    }
   }
-  incoming_edges_.remove(id);
-  outgoing_edges_.remove(id);
 }
 
 template <typename NodeType>
 void Graph<NodeType>::AddEdges(std::initializer_list<NodeType> nodes) {
   int i = 0;
-  IDType last_id;
+  KeyType last_key = KeyType();
   for (auto it = nodes.begin(); it != nodes.end(); ++it, ++i) {
     if (!HasNode(*it)) {
       AddNode(*it);
     }
+    const KeyType key = it->Key();
     if (i != 0) {
-      AddEdgeByID(last_id, it->ID());
+      AddEdgeByKey(last_key, key);
     }
-    last_id = it->ID();
+    last_key = key;
   }
 }
 
 template <typename NodeType>
 bool Graph<NodeType>::HasNode(const NodeType& node) const {
-  return HasNodeByID(node.ID());
+  return HasNodeByKey(node.Key());
 }
 
 template <typename NodeType>
-bool Graph<NodeType>::HasNodeByID(const IDType& id) const {
-  return nodes_.find(id) != nodes_.end();
+bool Graph<NodeType>::HasNodeByKey(const KeyType& key) const {
+  return handles_.contains(key);
+}
+
+template <typename NodeType>
+typename Graph<NodeType>::Handle Graph<NodeType>::FindHandle(
+    const KeyType& key) const {
+  return handles_.value(key, -1);
+}
+
+template <typename NodeType>
+QVector<typename Graph<NodeType>::Handle> Graph<NodeType>::AllHandles() const {
+  QVector<Handle> ret;
+  ret.reserve(handles_.count());
+  for (Handle handle : handles_) {
+    ret.append(handle);
+  }
+  SortByID(&ret);
+  return ret;
+}
+
+template <typename NodeType>
+void Graph<NodeType>::SortByID(QVector<Handle>* handles) const {
+  QVector<QPair<IDType, Handle>> sorted;
+  sorted.reserve(handles->count());
+  for (Handle handle : *handles) {
+    sorted.append(qMakePair(nodes_[handle].ID(), handle));
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < sorted.count(); ++i) {
+    (*handles)[i] = sorted[i].second;
+  }
+}
+
+template <typename NodeType>
+QVector<typename Graph<NodeType>::Handle> Graph<NodeType>::FindByLookupKey(
+    const QString& key) const {
+  QVector<Handle> ret;
+  auto it = lookup_.constFind(key);
+  if (it != lookup_.constEnd()) {
+    for (Handle handle : it.value()) {
+      ret.append(handle);
+    }
+    SortByID(&ret);
+  }
+  return ret;
 }
 
 template <typename NodeType>
 QList<NodeType> Graph<NodeType>::AllNodes() const {
-  return nodes_.values();
+  QList<NodeType> ret;
+  ret.reserve(handles_.count());
+  for (Handle handle : AllHandles()) {
+    ret.append(nodes_[handle]);
+  }
+  return ret;
 }
 
 template <typename NodeType>
 QList<typename Graph<NodeType>::EdgeType> Graph<NodeType>::AllEdges() const {
-  return edges_.values();
+  QList<EdgeType> ret;
+  ret.reserve(edges_.count() - removed_edge_count_);
+  for (const Edge& edge : edges_) {
+    if (!edge.removed) {
+      ret.append(EdgeType(id(edge.from), id(edge.to)));
+    }
+  }
+  return ret;
 }
 
 template <typename NodeType>
@@ -210,137 +674,184 @@ template <typename NodeType>
 template <typename Iterator>
 void Graph<NodeType>::ReplaceSubgraph(Iterator begin, Iterator end,
                                       const NodeType& replacement) {
-  QSet<IDType> removing;
-  QSet<IDType> incoming;
-  QSet<IDType> outgoing;
+  QSet<Handle> removing;
   for (Iterator it = begin; it != end; ++it) {
-    const NodeType& node = *it;
-
-    // Remove the node.
-    removing.insert(node.ID());
-    nodes_.remove(node.ID());
-
-    // Record any incoming edges.
-    for (const IDType& neighbour_id : incoming_edges_[node.ID()]) {
-      incoming.insert(neighbour_id);
-      edges_.remove(qMakePair(neighbour_id, node.ID()));
-      outgoing_edges_[neighbour_id].remove(node.ID());
+    const Handle handle = FindHandle(it->Key());
+    if (handle != -1) {
+      removing.insert(handle);
     }
+  }
 
-    // Record any outgoing edges.
-    for (const IDType& neighbour_id : outgoing_edges_[node.ID()]) {
-      outgoing.insert(neighbour_id);
-      edges_.remove(qMakePair(node.ID(), neighbour_id));
-      incoming_edges_[neighbour_id].remove(node.ID());
+  // Record the edges to neighbouring nodes, excluding internal edges between
+  // nodes that are being removed.
+  QVector<Handle> incoming;
+  QVector<Handle> outgoing;
+  QSet<Handle> seen_incoming;
+  QSet<Handle> seen_outgoing;
+  for (Iterator it = begin; it != end; ++it) {
+    const Handle handle = FindHandle(it->Key());
+    if (handle == -1) {
+      continue;
     }
-
-    incoming_edges_.remove(node.ID());
-    outgoing_edges_.remove(node.ID());
+    for (Handle neighbour : IncomingHandles(handle)) {
+      if (!removing.contains(neighbour) && !seen_incoming.contains(neighbour)) {
+        seen_incoming.insert(neighbour);
+        incoming.append(neighbour);
+      }
+    }
+    for (Handle neighbour : OutgoingHandles(handle)) {
+      if (!removing.contains(neighbour) && !seen_outgoing.contains(neighbour)) {
+        seen_outgoing.insert(neighbour);
+        outgoing.append(neighbour);
+      }
+    }
+    RemoveNodeByHandle(handle);
   }
 
-  // Add the replacement node.
-  AddNode(replacement);
-
-  // Re-add the edges to neighbouring nodes, excluding internal edges between
-  // nodes that were removed.
-  for (const IDType& neighbour_id : incoming) {
-    if (!removing.contains(neighbour_id)) {
-      AddEdgeByID(neighbour_id, replacement.ID());
-    }
+  // Add the replacement node and connect it to the neighbours.
+  const Handle replacement_handle = AddNode(
+      replacement, replacement.Key(), replacement.IndexKey(),
+      replacement.LookupKey());
+  for (Handle neighbour : incoming) {
+    AddEdgeByHandle(neighbour, replacement_handle);
   }
-  for (const IDType& neighbour_id : outgoing) {
-    if (!removing.contains(neighbour_id)) {
-      AddEdgeByID(replacement.ID(), neighbour_id);
-    }
+  for (Handle neighbour : outgoing) {
+    AddEdgeByHandle(replacement_handle, neighbour);
   }
+  CompactEdges();
 }
 
 template <typename NodeType>
-QList<NodeType> Graph<NodeType>::Neighbours(
-    const NodeType& node,
-    const QMap<IDType, QSet<IDType>>& direction) const {
+typename Graph<NodeType>::NeighbourRange Graph<NodeType>::IncomingHandles(
+    Handle handle) const {
+  return NeighbourRange(&edges_, adjacency_[handle].first_incoming, true);
+}
+
+template <typename NodeType>
+typename Graph<NodeType>::NeighbourRange Graph<NodeType>::OutgoingHandles(
+    Handle handle) const {
+  return NeighbourRange(&edges_, adjacency_[handle].first_outgoing, false);
+}
+
+template <typename NodeType>
+QList<NodeType> Graph<NodeType>::Neighbours(const NodeType& node,
+                                            bool incoming) const {
   QList<NodeType> ret;
-  auto it = direction.find(node.ID());
-  if (it == direction.end()) {
+  const Handle handle = FindHandle(node.Key());
+  if (handle == -1) {
     return ret;
   }
-  for (const IDType& id : it.value()) {
-    ret.push_back(nodes_[id]);
+  for (Handle neighbour :
+       incoming ? IncomingHandles(handle) : OutgoingHandles(handle)) {
+    ret.push_back(nodes_[neighbour]);
   }
   return ret;
 }
 
 template <typename NodeType>
 QList<NodeType> Graph<NodeType>::Incoming(const NodeType& node) const {
-  return Neighbours(node, incoming_edges_);
+  return Neighbours(node, true);
 }
 
 template <typename NodeType>
 QList<NodeType> Graph<NodeType>::Outgoing(const NodeType& node) const {
-  return Neighbours(node, outgoing_edges_);
+  return Neighbours(node, false);
 }
 
 template <typename NodeType>
 template <typename Subgraph>
-bool Graph<NodeType>::MatchRecursive(
-    const NodeType& node,
-    const Subgraph& subgraph,
-    const typename Subgraph::NodeType& subgraph_node,
-    QMap<typename Subgraph::IDType, NodeType>* match) const {
+bool Graph<NodeType>::MatchRecursive(Handle node, const Subgraph& subgraph,
+                                     int subgraph_node,
+                                     MatchState* state) const {
+  const auto& pattern = subgraph.node(subgraph_node);
+
+  // Check the neighbour counts first, since they're cheaper than Match.
+  // Without an exact count, a node with any subgraph neighbours in one
+  // direction still needs at least one neighbour in that direction.
+  const int incoming_count = subgraph.IncomingCount(subgraph_node);
+  const int outgoing_count = subgraph.OutgoingCount(subgraph_node);
+  if (pattern.ExactIncomingNeighbourCount()
+          ? IncomingCount(node) != incoming_count
+          : incoming_count != 0 && IncomingCount(node) == 0) {
+    return false;
+  }
+  if (pattern.ExactOutgoingNeighbourCount()
+          ? OutgoingCount(node) != outgoing_count
+          : outgoing_count != 0 && OutgoingCount(node) == 0) {
+    return false;
+  }
+
   // Try to match this node.
-  if (!subgraph_node.Match(node)) {
+  if (!pattern.Match(nodes_[node])) {
     return false;
   }
 
-  QMap<typename Subgraph::IDType, NodeType> child_match = *match;
-  child_match[subgraph_node.ID()] = node;
+  const int undo_mark = state->undo_log.count();
+  state->matched[subgraph_node] = node;
+  state->undo_log.append(subgraph_node);
 
-  auto match_neighbours_fn = [&child_match, &subgraph, &subgraph_node, this](
-      const QList<NodeType>& neighbours,
-      const QList<typename Subgraph::NodeType>& subgraph_neighbours,
-      bool expects_exact_count) {
-    if (expects_exact_count &&
-        neighbours.size() != subgraph_neighbours.size()) {
-      return false;
-    }
+  // Match all incoming and outgoing nodes.
+  if (!MatchNeighbours(IncomingHandles(node),
+                       subgraph.IncomingHandles(subgraph_node),
+                       subgraph, state) ||
+      !MatchNeighbours(OutgoingHandles(node),
+                       subgraph.OutgoingHandles(subgraph_node),
+                       subgraph, state)) {
+    state->Undo(undo_mark);
+    return false;
+  }
+  return true;
+}
 
-    for (const auto& subgraph_neighbour : subgraph_neighbours) {
-      if (child_match.find(subgraph_neighbour.ID()) != child_match.end()) {
-        // We've already matched this node.
-        continue;
-      }
+template <typename NodeType>
+template <typename Subgraph>
+bool Graph<NodeType>::MatchNeighbours(
+    const NeighbourRange& neighbours,
+    const typename Subgraph::NeighbourRange& subgraph_nodes,
+    const Subgraph& subgraph,
+    MatchState* state) const {
+  for (int subgraph_node : subgraph_nodes) {
+    if (state->matched[subgraph_node] != -1) {
+      // We've already matched this node.
+      continue;
+    }
 
-      bool found = false;
-      for (const auto& neighbour : neighbours) {
-        if (MatchRecursive(neighbour,
-                           subgraph,
-                           subgraph_neighbour,
-                           &child_match)) {
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
-        return false;
+    bool found = false;
+    for (Handle neighbour : neighbours) {
+      if (MatchRecursive(neighbour, subgraph, subgraph_node, state)) {
+        found = true;
+        break;
       }
     }
-    return true;
-  };
+    if (!found) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  // Match all incoming and outgoing nodes.
-  if (!match_neighbours_fn(Incoming(node),
-                           subgraph.Incoming(subgraph_node),
-                           subgraph_node.ExactIncomingNeighbourCount())) {
-    return false;
+template <typename NodeType>
+QVector<typename Graph<NodeType>::Handle> Graph<NodeType>::CandidatesForKeys(
+    const QSet<QString>& keys) const {
+  QVector<Handle> ret;
+  if (keys.isEmpty()) {
+    return AllHandles();
   }
-  if (!match_neighbours_fn(Outgoing(node),
-                           subgraph.Outgoing(subgraph_node),
-                           subgraph_node.ExactOutgoingNeighbourCount())) {
-    return false;
+
+  for (const QString& key : keys) {
+    auto it = index_.constFind(key);
+    if (it != index_.constEnd()) {
+      for (Handle handle : it.value()) {
+        ret.append(handle);
+      }
+    }
   }
 
-  *match = child_match;
-  return true;
+  // Visit candidates in ID order, like nodes without an index key.
+  std::sort(ret.begin(), ret.end());
+  ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+  SortByID(&ret);
+  return ret;
 }
 
 template <typename NodeType>
@@ -355,27 +866,188 @@ Graph<NodeType>::FindSubgraphMatches(const Subgraph& subgraph) const {
     return ret;
   }
 
-  const typename Subgraph::NodeType start_node = *subgraph.AllNodes().begin();
+  const Search<Subgraph> search = MakeSearch(subgraph);
+  for (const Found& found :
+       MatchFrom(CandidatesForKeys(search.keys),
+                 QVector<Search<Subgraph>>{search})) {
+    ret.append(MatchToMap(found.match, subgraph));
+  }
+  return ret;
+}
+
+template <typename NodeType>
+template <typename Subgraph>
+typename Graph<NodeType>::template Search<Subgraph>
+Graph<NodeType>::MakeSearch(const Subgraph& subgraph) const {
+  Search<Subgraph> ret;
+  ret.subgraph = &subgraph;
+  ret.start_node = -1;
+
+  int start_candidate_count = 0;
+  for (int subgraph_node : subgraph.AllHandles()) {
+    const QStringList keys = subgraph.node(subgraph_node).CandidateIndexKeys();
+    int candidate_count = 0;
+    if (keys.isEmpty()) {
+      candidate_count = count();
+    } else {
+      for (const QString& key : keys) {
+        candidate_count += index_.value(key).count();
+      }
+    }
+
+    if (ret.start_node == -1 || candidate_count < start_candidate_count) {
+      ret.start_node = subgraph_node;
+      ret.keys = keys.toSet();
+      start_candidate_count = candidate_count;
+    }
+  }
+
+  ret.radius = 0;
+  for (int reached = 1;; ++ret.radius) {
+    const int next_reached =
+        subgraph.NodesWithinDistance({ret.start_node}, ret.radius + 1).count();
+    if (next_reached == reached) {
+      break;
+    }
+    reached = next_reached;
+  }
+  return ret;
+}
+
+template <typename NodeType>
+template <typename Subgraph>
+QVector<typename Graph<NodeType>::Found> Graph<NodeType>::MatchFrom(
+    const QVector<Handle>& candidates,
+    const QVector<Search<Subgraph>>& searches) const {
+  // Each chunk is a contiguous run of candidates with its own match state and
+  // results, so the chunks' results can be joined in candidate order.
+  struct Chunk {
+    int begin;
+    int end;
+    QVector<Found> found;
+  };
+
+  const int kMinChunkSize = 256;
+  const int chunk_count = qBound(
+      1, candidates.count() / kMinChunkSize,
+      QThreadPool::globalInstance()->maxThreadCount() * 4);
+  QVector<Chunk> chunks(chunk_count);
+  for (int i = 0; i < chunk_count; ++i) {
+    chunks[i].begin = qint64(candidates.count()) * i / chunk_count;
+    chunks[i].end = qint64(candidates.count()) * (i + 1) / chunk_count;
+  }
+
+  auto match_chunk = [this, &candidates, &searches](Chunk& chunk) {
+    QVector<MatchState> states(searches.count());
+    for (int i = 0; i < searches.count(); ++i) {
+      states[i].matched.fill(-1, searches[i].subgraph->handle_limit());
+    }
+
+    for (int i = chunk.begin; i < chunk.end; ++i) {
+      const Handle candidate = candidates[i];
+      for (int j = 0; j < searches.count(); ++j) {
+        const Search<Subgraph>& search = searches[j];
+        if (!search.keys.isEmpty() &&
+            !search.keys.contains(index_keys_[candidate])) {
+          continue;
+        }
+
+        MatchState* state = &states[j];
+        if (MatchRecursive(candidate, *search.subgraph, search.start_node,
+                           state)) {
+          chunk.found.append(Found{j, state->matched});
+          state->Undo(0);
+          break;
+        }
+      }
+    }
+  };
+  if (chunk_count == 1) {
+    match_chunk(chunks[0]);
+  } else {
+    QtConcurrent::blockingMap(chunks, match_chunk);
+  }
+
+  QVector<Found> ret;
+  for (const Chunk& chunk : chunks) {
+    ret += chunk.found;
+  }
+  return ret;
+}
+
+template <typename NodeType>
+template <typename Subgraph>
+QMap<typename Subgraph::IDType, NodeType> Graph<NodeType>::MatchToMap(
+    const QVector<Handle>& match, const Subgraph& subgraph) const {
+  QMap<typename Subgraph::IDType, NodeType> ret;
+  for (int subgraph_node = 0; subgraph_node < match.count(); ++subgraph_node) {
+    if (match[subgraph_node] != -1) {
+      ret.insert(subgraph.id(subgraph_node), nodes_[match[subgraph_node]]);
+    }
+  }
+  return ret;
+}
+
+template <typename NodeType>
+QVector<typename Graph<NodeType>::Handle> Graph<NodeType>::NodesWithinDistance(
+    const QVector<Handle>& from, int distance) const {
+  QVector<Handle> ret;
+  QSet<Handle> seen;
+  for (Handle handle : from) {
+    if (!adjacency_[handle].removed && !seen.contains(handle)) {
+      seen.insert(handle);
+      ret.append(handle);
+    }
+  }
 
-  for (const NodeType& node : nodes_) {
-    QMap<typename Subgraph::IDType, NodeType> match;
-    if (MatchRecursive(node, subgraph, start_node, &match)) {
-      ret.append(match);
+  int frontier_begin = 0;
+  for (int i = 0; i < distance; ++i) {
+    const int frontier_end = ret.count();
+    for (int j = frontier_begin; j < frontier_end; ++j) {
+      const Handle handle = ret[j];
+      for (Handle neighbour : IncomingHandles(handle)) {
+        if (!seen.contains(neighbour)) {
+          seen.insert(neighbour);
+          ret.append(neighbour);
+        }
+      }
+      for (Handle neighbour : OutgoingHandles(handle)) {
+        if (!seen.contains(neighbour)) {
+          seen.insert(neighbour);
+          ret.append(neighbour);
+        }
+      }
     }
+    frontier_begin = frontier_end;
   }
   return ret;
 }
 
 template <typename NodeType>
 void Graph<NodeType>::WriteDot(QTextStream& os) const {
+  // Every node's ID is written several times, so they're built once here.
+  QVector<IDType> ids(nodes_.count());
+  QVector<Handle> handles;
+  handles.reserve(handles_.count());
+  for (Handle handle : handles_) {
+    ids[handle] = nodes_[handle].ID();
+    handles.append(handle);
+  }
+  std::sort(handles.begin(), handles.end(), [&ids](Handle a, Handle b) {
+    return ids[a] < ids[b];
+  });
+
   os << "digraph {\n";
-  for (const NodeType& node : AllNodes()) {
-    os << "  \"" << node.ID() << "\" [";
-    node.WriteDot(os);
+  for (Handle handle : handles) {
+    os << "  \"" << ids[handle] << "\" [";
+    nodes_[handle].WriteDot(os);
     os << "];\n";
   }
-  for (const auto& edge : AllEdges()) {
-    os << "  \"" << edge.first << "\" -> \"" << edge.second << "\";\n";
+  for (const Edge& edge : edges_) {
+    if (!edge.removed) {
+      os << "  \"" << ids[edge.from] << "\" -> \"" << ids[edge.to]
+         << "\";\n";
+    }
   }
   os << "}\n";
 }
@@ -397,18 +1069,84 @@ template <typename Subgraph, typename ReplaceFn>
 void Graph<NodeType>::FindAndReplaceSubgraph(
     const Subgraph& subgraph,
     ReplaceFn replace_fn) {
-  for (int i = 0; i < 100; ++i) {
-    const auto& matches = FindSubgraphMatches(subgraph);
-    if (matches.empty()) {
-      return;
+  if (subgraph.empty()) {
+    LOG(WARNING) << "Empty subgraph";
+    return;
+  }
+  FindAndReplaceSubgraphs(
+      QList<Rewrite<Subgraph>>{Rewrite<Subgraph>{subgraph, replace_fn}});
+}
+
+template <typename NodeType>
+template <typename Subgraph>
+void Graph<NodeType>::FindAndReplaceSubgraphs(
+    const QList<Rewrite<Subgraph>>& rewrites) {
+  QVector<Search<Subgraph>> searches;
+  QSet<QString> keys;
+  bool any_key = false;
+  int radius = 0;
+  for (const Rewrite<Subgraph>& rewrite : rewrites) {
+    CHECK(!rewrite.subgraph.empty());
+    searches.append(MakeSearch(rewrite.subgraph));
+    const Search<Subgraph>& search = searches.last();
+    if (search.keys.isEmpty()) {
+      any_key = true;
     }
+    keys.unite(search.keys);
+    radius = qMax(radius, search.radius);
+  }
+  if (any_key) {
+    keys.clear();
+  }
+
+  QVector<Found> found = MatchFrom(CandidatesForKeys(keys), searches);
+  while (!found.empty()) {
+    touched_.clear();
+    tracking_touched_ = true;
 
-    for (const auto& match : matches) {
-      replace_fn(match);
+    // Matches of earlier rewrites are replaced first.  Matches can overlap.
+    // Only the first of any overlapping matches is replaced - the others are
+    // found again in the next round if they still match after the first one
+    // has been replaced.
+    std::stable_sort(found.begin(), found.end(),
+                     [](const Found& a, const Found& b) {
+      return a.search < b.search;
+    });
+    QSet<Handle> replaced;
+    for (const Found& f : found) {
+      bool overlaps = false;
+      for (Handle handle : f.match) {
+        if (handle != -1 && replaced.contains(handle)) {
+          overlaps = true;
+          break;
+        }
+      }
+      if (overlaps) {
+        continue;
+      }
+      for (Handle handle : f.match) {
+        if (handle != -1) {
+          replaced.insert(handle);
+        }
+      }
+      rewrites[f.search].replace_fn(
+          MatchToMap(f.match, *searches[f.search].subgraph));
+    }
+    tracking_touched_ = false;
+
+    // A new match must include a node that a replace_fn changed, so its start
+    // node can't be further from a changed node than the start node is from
+    // the rest of its subgraph.
+    QVector<Handle> candidates;
+    for (Handle handle : NodesWithinDistance(touched_, radius)) {
+      if (keys.isEmpty() || keys.contains(index_keys_[handle])) {
+        candidates.append(handle);
+      }
     }
+    SortByID(&candidates);
+    found = MatchFrom(candidates, searches);
   }
-  LOG(FATAL) << "FindAndReplaceSubgraph matched too many times - maybe the "
-                "replace_fn isn't removing the matches from the graph.";
+  touched_.clear();
 }
 
 #endif // GRAPH_H
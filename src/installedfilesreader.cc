@@ -18,28 +18,31 @@ InstalledFilesReader::InstalledFilesReader() {
 }
 
 void InstalledFilesReader::Read(
-    std::unique_ptr<utils::RecordFile<pb::Record>> file) {
-  while (!file->AtEnd()) {
-    pb::Record record;
-    CHECK(file->ReadRecord(&record));
-
+    std::unique_ptr<utils::RecordReader<pb::Record>> file) {
+  auto records = file->Records();
+  for (const pb::Record& record : records) {
     if (record.has_installed_file()) {
-      files_.append(record.installed_file());
+      Add(record.installed_file());
     }
   }
+  CHECK(records.ok());
+}
+
+void InstalledFilesReader::Add(const pb::InstalledFile& file) {
+  files_by_original_name_[file.original().name()].append(files_.count());
+  files_.append(file);
 }
 
 bool InstalledFilesReader::Find(
     const QString& name,
     const QList<pb::InstalledFile_Type>& types,
     pb::InstalledFile* file) const {
-  for (const pb::InstalledFile& f : files_) {
-    if (f.original().name() == name) {
-      for (pb::InstalledFile_Type type : types) {
-        if (f.type() == type) {
-          file->CopyFrom(f);
-          return true;
-        }
+  for (int index : files_by_original_name_.value(name)) {
+    const pb::InstalledFile& f = files_[index];
+    for (pb::InstalledFile_Type type : types) {
+      if (f.type() == type) {
+        file->CopyFrom(f);
+        return true;
       }
     }
   }
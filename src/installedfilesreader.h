@@ -17,6 +17,9 @@
 
 #include <memory>
 
+#include <QHash>
+#include <QVector>
+
 #include "tracer.pb.h"
 #include "utils/recordfile.h"
 
@@ -24,7 +27,8 @@ class InstalledFilesReader {
  public:
   InstalledFilesReader();
 
-  void Read(std::unique_ptr<utils::RecordFile<pb::Record>> file);
+  void Read(std::unique_ptr<utils::RecordReader<pb::Record>> file);
+  void Add(const pb::InstalledFile& file);
   bool Find(const QString& name,
             const QList<pb::InstalledFile_Type>& types,
             pb::InstalledFile* file) const;
@@ -32,6 +36,9 @@ class InstalledFilesReader {
 
  private:
   QList<pb::InstalledFile> files_;
+
+  // Indexes into files_, keyed by original().name(), in file order.
+  QHash<QString, QVector<int>> files_by_original_name_;
 };
 
 #endif // INSTALLEDFILESREADER_H
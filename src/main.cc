@@ -16,6 +16,7 @@
 #include <cstdio>
 #include <functional>
 #include <iostream>
+#include <memory>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -27,9 +28,12 @@
 #include <QTemporaryFile>
 #include <QTextStream>
 
+#include "analyzeall.h"
 #include "fromapt.h"
 #include "tracecontroller.h"
+#include "tracemerger.h"
 #include "tracer.h"
+#include "tracereader.h"
 #include "analysis/configure.h"
 #include "analysis/install.h"
 #include "analysis/make.h"
@@ -43,6 +47,15 @@ DEFINE_string(project_name, "", "The name of the project.  Default is to guess "
               "from the name of the project_root directory");
 DEFINE_string(project_root, "", "The directory containing the source code, if "
               "different to the current directory");
+DEFINE_bool(write_intermediate_files, true, "If false, analyze-all doesn't "
+            "write the .files and .targets files that analyze-install and "
+            "analyze-make would");
+DEFINE_int32(process_id, -1, "If set, dump only prints the process with this "
+             "ID from a trace");
+DEFINE_string(writes, "", "If set, dump only prints the processes that "
+              "created, modified or renamed this file in an indexed trace");
+DEFINE_string(runs, "", "If set, dump only prints the processes that ran this "
+              "executable in an indexed trace");
 
 namespace {
 
@@ -78,12 +91,61 @@ bool AnalyzeMake(const QStringList& args) {
   opts.output_filename = args[0] + ".targets";
   opts.graph_output_filename = args[0] + ".dot";
   opts.intermediate_graph_output_filename = args[0] + ".intermediate.dot";
+  opts.graph_cache_filename = args[0] + ".graph";
   opts.install_filename = args[1] + ".files";
 
   return analysis::Make::Run(opts);
 }
 
 
+bool UpdateMake(const QStringList& args) {
+  analysis::Make::Options opts;
+  opts.trace_filename = args[0] + ".trace";
+  opts.output_filename = args[0] + ".targets";
+  opts.graph_output_filename = args[0] + ".dot";
+  opts.intermediate_graph_output_filename = args[0] + ".intermediate.dot";
+  opts.graph_cache_filename = args[0] + ".graph";
+  opts.install_filename = args[1] + ".files";
+  opts.base_targets_filename = args[2] + ".targets";
+
+  return analysis::Make::Run(opts);
+}
+
+
+bool TraceMake(const QStringList& args) {
+  analysis::Make::Options make_opts;
+  make_opts.output_filename = args[0] + ".targets";
+  make_opts.graph_output_filename = args[0] + ".dot";
+  make_opts.intermediate_graph_output_filename =
+      args[0] + ".intermediate.dot";
+  make_opts.install_filename = args[1] + ".files";
+
+  std::unique_ptr<analysis::Make> make =
+      analysis::Make::StartLive(make_opts);
+
+  trace_controller::Options opts;
+  opts.output_filename = args[0] + ".trace";
+  opts.args = args.mid(2);
+  opts.working_directory = QDir::currentPath();
+  opts.observer = make->live_writer();
+  opts.process_exited = [&make](int ordering) {
+    make->ProcessExited(ordering);
+  };
+
+  if (!FLAGS_project_name.empty()) {
+    opts.project_name = utils::str::StlToQt(FLAGS_project_name);
+  }
+  if (!FLAGS_project_root.empty()) {
+    opts.project_root = utils::str::StlToQt(FLAGS_project_root);
+  }
+
+  if (!trace_controller::Run(opts)) {
+    return false;
+  }
+  return make->FinishLive();
+}
+
+
 bool AnalyzeInstall(const QStringList& args) {
   analysis::Install::Options opts;
   opts.trace_filename = args[0] + ".trace";
@@ -95,36 +157,114 @@ bool AnalyzeInstall(const QStringList& args) {
 
 template <typename T>
 bool TryDump(const QString& filename) {
-  utils::RecordFile<T> fh(filename);
-  if (!fh.Open(QIODevice::ReadOnly)) {
+  auto file = utils::OpenRecordReader<T>(filename);
+  if (!file) {
     LOG(ERROR) << "Failed to open " << filename << " for reading";
     return false;
   }
 
-  while (!fh.AtEnd()) {
-    T msg;
-    if (!fh.ReadRecord(&msg)) {
+  // Only the first record is checked for unknown fields, so the file is read
+  // once and printed as it goes.
+  bool first = true;
+  auto records = file->Records();
+  for (const T& msg : records) {
+    if (first && !msg.GetReflection()->GetUnknownFields(msg).empty()) {
+      return false;
+    }
+    first = false;
+
+    msg.PrintDebugString();
+    std::cout << "\n";
+  }
+  return records.ok();
+}
+
+
+bool DumpProcess(const QString& filename, int id) {
+  pb::Process process;
+
+  IndexedTraceReader index;
+  if (index.Open(filename)) {
+    if (!index.ReadProcess(id, &process)) {
+      LOG(ERROR) << "Process " << id << " not found in " << filename;
+      return false;
+    }
+  } else {
+    LOG(INFO) << filename << " has no index - reading the whole trace";
+
+    auto file = utils::OpenRecordReader<pb::Record>(filename);
+    if (!file) {
+      LOG(ERROR) << "Failed to open " << filename << " for reading";
       return false;
     }
-    if (!msg.GetReflection()->GetUnknownFields(msg).empty()) {
+
+    bool found = false;
+    auto records = file->Records();
+    for (pb::Record& record : records) {
+      if (record.has_process() && record.process().id() == id) {
+        process.Swap(record.mutable_process());
+        found = true;
+        break;
+      }
+    }
+    if (!records.ok()) {
+      LOG(ERROR) << "Couldn't parse " << filename;
+      return false;
+    }
+    if (!found) {
+      LOG(ERROR) << "Process " << id << " not found in " << filename;
       return false;
     }
   }
 
-  fh.Open(QIODevice::ReadOnly);
-  while (!fh.AtEnd()) {
-    T msg;
-    fh.ReadRecord(&msg);
-    msg.PrintDebugString();
+  process.PrintDebugString();
+  return true;
+}
+
+
+bool DumpIndexedProcesses(const QString& filename) {
+  IndexedTraceReader index;
+  if (!index.Open(filename)) {
+    LOG(ERROR) << filename << " has no index - --writes and --runs need one";
+    return false;
+  }
+
+  const QList<int> ids = FLAGS_writes.empty()
+      ? index.ProcessesRunning(utils::str::StlToQt(FLAGS_runs))
+      : index.ProcessesWritingFile(utils::str::StlToQt(FLAGS_writes));
+  for (int id : ids) {
+    pb::Process process;
+    if (!index.ReadProcess(id, &process)) {
+      return false;
+    }
+    process.PrintDebugString();
     std::cout << "\n";
   }
   return true;
 }
 
 
+bool MergeTraces(const QStringList& args) {
+  TraceMerger::Options opts;
+  opts.output_filename = args[0] + ".trace";
+  for (const QString& name : args.mid(1)) {
+    opts.input_filenames.append(name + ".trace");
+  }
+
+  return TraceMerger::Run(opts);
+}
+
+
 bool Dump(const QStringList& args) {
   const QString filename = args[0];
 
+  if (FLAGS_process_id >= 0) {
+    return DumpProcess(filename, FLAGS_process_id);
+  }
+  if (!FLAGS_writes.empty() || !FLAGS_runs.empty()) {
+    return DumpIndexedProcesses(filename);
+  }
+
   if (TryDump<pb::Record>(filename)) return true;
 
   LOG(ERROR) << "Couldn't parse " << filename;
@@ -157,6 +297,26 @@ bool FromAptCommand(const QStringList& args) {
 }
 
 
+bool AnalyzeAllCommand(const QStringList& args) {
+  AnalyzeAll::Options opts;
+  opts.configure.trace_filename = args[0] + ".trace";
+  opts.configure.output_filename = args[0] + ".outputs";
+  opts.install.trace_filename = args[2] + ".trace";
+  opts.make.trace_filename = args[1] + ".trace";
+  opts.make.graph_output_filename = args[1] + ".dot";
+  opts.make.intermediate_graph_output_filename =
+      args[1] + ".intermediate.dot";
+  opts.make.graph_cache_filename = args[1] + ".graph";
+  if (FLAGS_write_intermediate_files) {
+    opts.install.output_filename = args[2] + ".files";
+    opts.make.output_filename = args[1] + ".targets";
+  }
+  opts.bazel.workspace_path = args[3];
+
+  return AnalyzeAll::Run(opts);
+}
+
+
 bool GenBazel(const QStringList& args) {
   gen::bazel::Generator::Options opts;
   opts.target_filename = args[0] + ".targets";
@@ -166,7 +326,7 @@ bool GenBazel(const QStringList& args) {
 }
 
 
-const std::array<utils::SubcommandSpec, 8> kSubcommands = {{
+const std::array<utils::SubcommandSpec, 12> kSubcommands = {{
   {"trace", "<name> <command> [<arg> ...]",
    "Runs a command and writes a trace file.\n"
    "\n"
@@ -185,11 +345,43 @@ const std::array<utils::SubcommandSpec, 8> kSubcommands = {{
    2,
    AnalyzeMake,
   },
+  {"trace-make", "<make-name> <install-name> <command> [<arg> ...]",
+   "Runs a compile and analyzes it while it runs.\n"
+   "\n"
+   "This is the same as running trace followed by analyze-make, but the build\n"
+   "graph is built as each process exits instead of after the build has\n"
+   "finished.  The trace is still written to <make-name>.trace.\n"
+   "\n"
+   "<install-name>.files is only read once the build has finished.  If\n"
+   "analyze-install hasn't been run yet no targets are marked as installed.",
+   3,
+   TraceMake,
+  },
+  {"update-make", "<make-name> <install-name> <base-make-name>",
+   "Analyzes the trace of a partial rebuild.\n"
+   "\n"
+   "Only the targets rebuilt in <make-name>.trace are regenerated.  The rest\n"
+   "are copied from <base-make-name>.targets, written by an earlier\n"
+   "analyze-make of the whole build.  Rebuilt targets keep their names from\n"
+   "the base.  All the targets are written to <make-name>.targets.",
+   3,
+   UpdateMake,
+  },
   {"analyze-install", "<name>",
    "Analyzes the trace of a 'make install'.",
    1,
    AnalyzeInstall,
   },
+  {"merge-traces", "<name> <input-name> [<input-name> ...]",
+   "Merges the traces of several parts of a build into one trace.\n"
+   "\n"
+   "Use this when a build was split across several machines or containers.\n"
+   "The merged trace is written to <name>.trace and can be given to\n"
+   "analyze-make like any other trace.  Processes from different inputs are\n"
+   "ordered so that files are read after the input that wrote them.",
+   2,
+   MergeTraces,
+  },
   {"gen-bazel", "<make-name> <install-name> <workspace>",
    "Writes bazel BUILD files into the given workspace.\n"
    "\n"
@@ -198,8 +390,27 @@ const std::array<utils::SubcommandSpec, 8> kSubcommands = {{
    3,
    GenBazel,
   },
+  {"analyze-all", "<conf-name> <make-name> <install-name> <workspace>",
+   "Runs analyze-conf, analyze-install, analyze-make and gen-bazel.\n"
+   "\n"
+   "This gives the same output as running them separately, but the configure\n"
+   "and install traces are analyzed at the same time and the intermediate\n"
+   "results aren't read back from disk.  Pass\n"
+   "--nowrite_intermediate_files to skip writing <install-name>.files and\n"
+   "<make-name>.targets.",
+   4,
+   AnalyzeAllCommand,
+  },
   {"dump", "<filename>",
-   "Prints a human-readable representation of a protobuf record file.",
+   "Prints a human-readable representation of a protobuf record file.\n"
+   "\n"
+   "With --process_id, prints just that process from a trace.  This is fast\n"
+   "on traces that have an index.\n"
+   "\n"
+   "On traces that have an index, --writes=<filename> prints the processes\n"
+   "that created, modified or renamed the file and --runs=<executable> prints\n"
+   "the processes that ran it.  Filenames are as recorded in the trace, and\n"
+   "executables are given without their directory.",
    1,
    Dump,
   },
@@ -13,6 +13,9 @@
 // limitations under the License.
 
 #include "reference.h"
+
+#include <QHash>
+
 #include "utils/logging.h"
 
 void CreateReference(const pb::MetaData& metadata,
@@ -70,3 +73,15 @@ bool operator<(const pb::Reference& a, const pb::Reference& b) {
 
 #undef COMPARE
 }
+
+namespace pb {
+
+bool operator==(const Reference& a, const Reference& b) {
+  return a.type() == b.type() && a.name() == b.name();
+}
+
+uint qHash(const Reference& ref, uint seed) {
+  return ::qHash(ref.name(), seed) ^ uint(ref.type());
+}
+
+}  // namespace pb
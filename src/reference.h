@@ -23,4 +23,11 @@ extern void CreateReference(const pb::MetaData& metadata,
 
 extern bool operator<(const pb::Reference& a, const pb::Reference& b);
 
+// These are in the pb namespace so QHash can find them by argument-dependent
+// lookup.
+namespace pb {
+extern bool operator==(const Reference& a, const Reference& b);
+extern uint qHash(const Reference& ref, uint seed = 0);
+}  // namespace pb
+
 #endif // REFERENCE_H
@@ -0,0 +1,190 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stringtable.h"
+
+#include "utils/logging.h"
+
+int StringTable::Intern(const QString& str) {
+  auto it = ids_.find(str);
+  if (it != ids_.end()) {
+    return it.value();
+  }
+
+  const int id = strings_.count();
+  strings_.append(str);
+  ids_.insert(str, id);
+  return id;
+}
+
+void StringTable::Append(const pb::StringTable& table) {
+  for (const QString& str : table.entry()) {
+    const int id = strings_.count();
+    strings_.append(str);
+    ids_.insert(str, id);
+  }
+}
+
+const QString& StringTable::Lookup(int id) const {
+  CHECK(id >= 0 && id < strings_.count())
+      << "String ID " << id << " is not in the table";
+  return strings_.at(id);
+}
+
+int StringTable::Encode(const QString& str, pb::StringTable* new_strings) {
+  const int count = strings_.count();
+  const int id = Intern(str);
+  if (id == count) {
+    new_strings->add_entry(str);
+  }
+  return id;
+}
+
+void StringTable::Encode(pb::Process* process, pb::StringTable* new_strings) {
+  if (process->has_filename()) {
+    process->set_filename_id(Encode(process->filename(), new_strings));
+    process->clear_filename();
+  }
+  if (process->has_working_directory()) {
+    process->set_working_directory_id(
+        Encode(process->working_directory(), new_strings));
+    process->clear_working_directory();
+  }
+  if (process->argv_size() != 0) {
+    // The process may have been resolved from another table already.
+    process->clear_argv_id();
+    for (const QString& arg : process->argv()) {
+      process->add_argv_id(Encode(arg, new_strings));
+    }
+    process->clear_argv();
+  }
+
+  for (pb::File& file : *process->mutable_files()) {
+    Encode(&file, new_strings);
+  }
+}
+
+void StringTable::Encode(pb::FileSet* file_set, pb::StringTable* new_strings) {
+  for (pb::File& file : *file_set->mutable_files()) {
+    Encode(&file, new_strings);
+  }
+}
+
+void StringTable::Encode(pb::File* file, pb::StringTable* new_strings) {
+  if (file->has_filename()) {
+    file->set_filename_id(Encode(file->filename(), new_strings));
+    file->clear_filename();
+  }
+  if (file->has_renamed_from()) {
+    file->set_renamed_from_id(Encode(file->renamed_from(), new_strings));
+    file->clear_renamed_from();
+  }
+}
+
+void StringTable::Resolve(pb::Process* process) {
+  if (process->has_filename_id()) {
+    process->set_filename(Lookup(process->filename_id()));
+  } else if (process->has_filename()) {
+    process->set_filename_id(Intern(process->filename()));
+    process->set_filename(Lookup(process->filename_id()));
+  }
+
+  if (process->has_working_directory_id()) {
+    process->set_working_directory(Lookup(process->working_directory_id()));
+  } else if (process->has_working_directory()) {
+    process->set_working_directory_id(Intern(process->working_directory()));
+    process->set_working_directory(Lookup(process->working_directory_id()));
+  }
+
+  if (process->argv_id_size() != 0) {
+    QStringList argv;
+    for (int id : process->argv_id()) {
+      argv.append(Lookup(id));
+    }
+    process->set_argv(argv);
+  } else if (process->argv_size() != 0) {
+    QStringList argv;
+    for (const QString& arg : process->argv()) {
+      const int id = Intern(arg);
+      process->add_argv_id(id);
+      argv.append(Lookup(id));
+    }
+    process->set_argv(argv);
+  }
+
+  for (pb::File& file : *process->mutable_files()) {
+    Resolve(&file);
+  }
+}
+
+void StringTable::Resolve(pb::FileSet* file_set) {
+  for (pb::File& file : *file_set->mutable_files()) {
+    Resolve(&file);
+  }
+}
+
+void StringTable::Resolve(pb::File* file) {
+  if (file->has_filename_id()) {
+    file->set_filename(Lookup(file->filename_id()));
+  } else if (file->has_filename()) {
+    file->set_filename_id(Intern(file->filename()));
+    file->set_filename(Lookup(file->filename_id()));
+  }
+
+  if (file->has_renamed_from_id()) {
+    file->set_renamed_from(Lookup(file->renamed_from_id()));
+  } else if (file->has_renamed_from()) {
+    file->set_renamed_from_id(Intern(file->renamed_from()));
+    file->set_renamed_from(Lookup(file->renamed_from_id()));
+  }
+}
+
+
+StringTableWriter::StringTableWriter(
+    std::unique_ptr<utils::RecordWriter<pb::Record>> writer)
+    : writer_(std::move(writer)) {
+}
+
+void StringTableWriter::WriteRecord(const pb::Record& record) {
+  if (record.has_trace_index()) {
+    pb::Record index(record);
+    for (qint64 offset : string_table_offsets_) {
+      index.mutable_trace_index()->add_string_table_offset(offset);
+    }
+    writer_->WriteRecord(index);
+    return;
+  }
+
+  if (!record.has_process() && !record.has_file_set()) {
+    writer_->WriteRecord(record);
+    return;
+  }
+
+  pb::Record encoded(record);
+  pb::Record strings;
+  if (encoded.has_process()) {
+    table_.Encode(encoded.mutable_process(), strings.mutable_string_table());
+  } else {
+    table_.Encode(encoded.mutable_file_set(), strings.mutable_string_table());
+  }
+
+  if (strings.string_table().entry_size() != 0) {
+    const qint64 offset = writer_->Offset();
+    if (offset >= 0) {
+      string_table_offsets_.append(offset);
+    }
+    writer_->WriteRecord(strings);
+  }
+  writer_->WriteRecord(encoded);
+}
@@ -0,0 +1,83 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef STRINGTABLE_H
+#define STRINGTABLE_H
+
+#include <memory>
+
+#include <QHash>
+#include <QVector>
+
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
+// Maps strings to small integer IDs.  IDs are assigned in the order strings are
+// first added, starting at 0.
+class StringTable {
+ public:
+  // Returns the ID of the string, adding it to the table if necessary.
+  int Intern(const QString& str);
+
+  // Returns -1 if the string isn't in the table.
+  int Find(const QString& str) const { return ids_.value(str, -1); }
+
+  const QString& Get(int id) const { return strings_.at(id); }
+  int count() const { return strings_.count(); }
+
+  // Adds the entries from a string_table record to the end of the table.
+  void Append(const pb::StringTable& table);
+
+  // Replaces the strings in the process with IDs.  Any strings that weren't in
+  // the table already are added to it and to new_strings.
+  void Encode(pb::Process* process, pb::StringTable* new_strings);
+  void Encode(pb::FileSet* file_set, pb::StringTable* new_strings);
+
+  // Sets the strings in the process from their IDs.  Processes that only have
+  // strings (from traces without a string table) get IDs added instead.  Either
+  // way the strings share their data with the table.
+  void Resolve(pb::Process* process);
+  void Resolve(pb::FileSet* file_set);
+
+ private:
+  int Encode(const QString& str, pb::StringTable* new_strings);
+  void Encode(pb::File* file, pb::StringTable* new_strings);
+  void Resolve(pb::File* file);
+  const QString& Lookup(int id) const;
+
+  QVector<QString> strings_;
+  QHash<QString, int> ids_;
+};
+
+
+// Writes Process and FileSet records with their filenames and arguments
+// replaced by string table IDs.  New strings are written in a string_table
+// record just before the first record that uses them.  The offsets of the
+// string_table records are added to any TraceIndex written through this
+// writer.
+class StringTableWriter : public utils::RecordWriter<pb::Record> {
+ public:
+  explicit StringTableWriter(
+      std::unique_ptr<utils::RecordWriter<pb::Record>> writer);
+
+  void WriteRecord(const pb::Record& record) override;
+  qint64 Offset() const override { return writer_->Offset(); }
+
+ private:
+  std::unique_ptr<utils::RecordWriter<pb::Record>> writer_;
+  StringTable table_;
+  QList<qint64> string_table_offsets_;
+};
+
+#endif // STRINGTABLE_H
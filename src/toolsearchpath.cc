@@ -18,41 +18,170 @@
 #include "utils/path.h"
 #include "utils/str.h"
 
+#include <QCryptographicHash>
+#include <QDateTime>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QProcess>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtConcurrentMap>
 
-QSet<QString> ToolSearchPath::Get(const QString& program) {
-  const auto& it = cache_.find(program);
-  if (it != cache_.end()) {
+namespace {
+
+// Running a compiler can take a while on a busy machine, so this is generous.
+const int kTimeoutMs = 30000;
+
+}  // namespace
+
+ToolSearchPath::ToolSearchPath()
+    : ToolSearchPath(QStandardPaths::writableLocation(
+                         QStandardPaths::GenericCacheLocation) +
+                     "/maketrace/toolsearchpath") {
+}
+
+ToolSearchPath::ToolSearchPath(const QString& cache_directory)
+    : cache_directory_(cache_directory) {
+}
+
+ToolSearchPath::~ToolSearchPath() {
+  Wait();
+}
+
+void ToolSearchPath::Prefetch(const QSet<QString>& programs) {
+  Wait();
+
+  for (const QString& program : programs) {
+    if (IsTool(program) && !cache_.contains(program)) {
+      pending_.append({program, QSet<QString>()});
+    }
+  }
+  prefetch_ = QtConcurrent::map(pending_, [this](Pending& pending) {
+    pending.paths = Find(pending.program);
+  });
+}
+
+void ToolSearchPath::Wait() {
+  prefetch_.waitForFinished();
+
+  for (const Pending& pending : pending_) {
+    LOG(INFO) << "Library search path for " << pending.program << ":";
+    for (const QString& path : pending.paths) {
+      LOG(INFO) << "  " << path;
+    }
+    cache_.insert(pending.program, pending.paths);
+  }
+  pending_.clear();
+}
+
+QSet<QString> ToolSearchPath::Get(const QString& program) const {
+  const auto it = cache_.constFind(program);
+  if (it != cache_.constEnd()) {
     return it.value();
   }
+  if (IsTool(program)) {
+    LOG(WARNING) << "Library search path for " << program
+                 << " wasn't prefetched";
+  }
+  return QSet<QString>();
+}
 
+bool ToolSearchPath::IsTool(const QString& program) {
+  const QString filename = utils::path::Filename(program);
+  return filename == "gcc" || filename == "g++" || filename == "ld";
+}
+
+QSet<QString> ToolSearchPath::Find(const QString& program) const {
   QSet<QString> ret;
+
+  // The cache entry is only valid for this exact binary.
+  pb::ToolSearchPathCacheEntry key;
+  QString cache_filename;
+  const QFileInfo info(program);
+  QFile file(program);
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  if (!cache_directory_.isEmpty() && info.exists() &&
+      file.open(QIODevice::ReadOnly) && hash.addData(&file)) {
+    key.set_program(program);
+    key.set_size(info.size());
+    key.set_mtime(info.lastModified().toMSecsSinceEpoch());
+    key.set_sha1(hash.result());
+    cache_filename = cache_directory_ + "/" + QCryptographicHash::hash(
+        program.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    if (ReadCache(cache_filename, key, &ret)) {
+      return ret;
+    }
+  }
+
   const QString filename = utils::path::Filename(program);
+  bool ok = false;
   if (filename == "gcc" || filename == "g++") {
-    GetGcc(program, &ret);
+    ok = GetGcc(program, &ret);
   } else if (filename == "ld") {
-    GetLd(program, &ret);
+    ok = GetLd(program, &ret);
   }
 
-  LOG(INFO) << "Library search path for " << program << ":";
-  for (const QString& path : ret) {
-    LOG(INFO) << "  " << path;
+  if (ok && !cache_filename.isEmpty()) {
+    pb::ToolSearchPathCacheEntry entry(key);
+    for (const QString& path : ret) {
+      entry.add_library_search_path(path);
+    }
+    WriteCache(cache_filename, entry);
   }
-
-  cache_.insert(program, ret);
   return ret;
 }
 
-void ToolSearchPath::GetGcc(const QString& program, QSet<QString>* ret) {
+bool ToolSearchPath::ReadCache(const QString& cache_filename,
+                               const pb::ToolSearchPathCacheEntry& key,
+                               QSet<QString>* ret) const {
+  QFile file(cache_filename);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  const QByteArray bytes = file.readAll();
+  pb::ToolSearchPathCacheEntry entry;
+  if (!entry.ParseFromArray(bytes.constData(), bytes.size()) ||
+      entry.program() != key.program() ||
+      entry.size() != key.size() ||
+      entry.mtime() != key.mtime() ||
+      entry.sha1() != key.sha1()) {
+    return false;
+  }
+  for (const QString& path : entry.library_search_path()) {
+    ret->insert(path);
+  }
+  return true;
+}
+
+void ToolSearchPath::WriteCache(
+    const QString& cache_filename,
+    const pb::ToolSearchPathCacheEntry& entry) const {
+  QByteArray bytes;
+  bytes.resize(entry.ByteSize());
+  entry.SerializeToArray(bytes.data(), bytes.size());
+
+  // Other analyses may be reading or writing the same entry, so it's written
+  // to a temporary file and renamed over the old one.
+  QSaveFile file(cache_filename);
+  if (!QDir().mkpath(cache_directory_) ||
+      !file.open(QIODevice::WriteOnly) ||
+      file.write(bytes) != bytes.size() ||
+      !file.commit()) {
+    LOG(WARNING) << "Failed to write " << cache_filename;
+  }
+}
+
+bool ToolSearchPath::GetGcc(const QString& program, QSet<QString>* ret) {
   QProcess proc;
   proc.start(program,
              QStringList() << "-print-search-dirs",
              QProcess::ReadOnly);
-  if (!proc.waitForFinished(1000)) {
+  if (!proc.waitForFinished(kTimeoutMs)) {
     LOG(WARNING) << "Failed to run " << program << " to find library search "
                     "path";
-    return;
+    return false;
   }
 
   const QString kLinePrefix("libraries: ");
@@ -71,17 +200,18 @@ void ToolSearchPath::GetGcc(const QString& program, QSet<QString>* ret) {
     }
     break;
   }
+  return true;
 }
 
-void ToolSearchPath::GetLd(const QString& program, QSet<QString>* ret) {
+bool ToolSearchPath::GetLd(const QString& program, QSet<QString>* ret) {
   QProcess proc;
   proc.start(program,
              QStringList() << "--verbose",
              QProcess::ReadOnly);
-  if (!proc.waitForFinished(1000)) {
+  if (!proc.waitForFinished(kTimeoutMs)) {
     LOG(WARNING) << "Failed to run " << program << " to find library search "
                     "path";
-    return;
+    return false;
   }
 
   QRegExp re("SEARCH_DIR\\(\"=*([^\"]+)\"\\);",
@@ -98,5 +228,5 @@ void ToolSearchPath::GetLd(const QString& program, QSet<QString>* ret) {
       pos += re.matchedLength();
     }
   }
+  return true;
 }
-
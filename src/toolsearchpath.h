@@ -16,16 +16,58 @@
 #define TOOLSEARCHPATH_H_
 
 #include "common.h"
+#include "tracer.pb.h"
 
+#include <QFuture>
+#include <QHash>
+
+// Finds the library search paths of compilers and linkers by running them.
+// Results are saved in a directory shared by every analysis, so each binary
+// only has to be run once.
 class ToolSearchPath {
  public:
-  QSet<QString> Get(const QString& program);
+  ToolSearchPath();
+
+  // An empty cache_directory doesn't save the results.
+  explicit ToolSearchPath(const QString& cache_directory);
+  ~ToolSearchPath();
+
+  // Starts finding the search paths of the programs in the background.
+  // Programs that aren't compilers or linkers are ignored.
+  void Prefetch(const QSet<QString>& programs);
+
+  // Waits for Prefetch to finish.
+  void Wait();
+
+  // Returns the library search path of a prefetched program.  Doesn't change
+  // anything, so it's safe to call from several threads after Wait.
+  QSet<QString> Get(const QString& program) const;
 
  private:
-  static void GetGcc(const QString& program, QSet<QString>* ret);
-  static void GetLd(const QString& program, QSet<QString>* ret);
+  struct Pending {
+    QString program;
+    QSet<QString> paths;
+  };
+
+  static bool IsTool(const QString& program);
+  QSet<QString> Find(const QString& program) const;
+
+  bool ReadCache(const QString& cache_filename,
+                 const pb::ToolSearchPathCacheEntry& key,
+                 QSet<QString>* ret) const;
+  void WriteCache(const QString& cache_filename,
+                  const pb::ToolSearchPathCacheEntry& entry) const;
+
+  // Return false if the program couldn't be run.
+  static bool GetGcc(const QString& program, QSet<QString>* ret);
+  static bool GetLd(const QString& program, QSet<QString>* ret);
+
+  const QString cache_directory_;
+
+  QHash<QString, QSet<QString>> cache_;
 
-  QMap<QString, QSet<QString>> cache_;
+  QList<Pending> pending_;
+  QFuture<void> prefetch_;
 };
 
 #endif  // TOOLSEARCHPATH_H_
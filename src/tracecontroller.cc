@@ -13,6 +13,8 @@
 // limitations under the License.
 
 #include "common.h"
+#include "fileset.h"
+#include "stringtable.h"
 #include "tracecontroller.h"
 #include "tracer.h"
 #include "tracer.pb.h"
@@ -33,34 +35,53 @@ bool Run(Options opts) {
   }
 
   // Open the file.
-  auto file = make_unique<utils::RecordFile<pb::Record>>(
+  auto file = make_unique<utils::BufferedRecordWriter<pb::Record>>(
       opts.output_filename);
-  if (!file->Open(QFile::WriteOnly)) {
+  if (!file->Open()) {
     LOG(ERROR) << "Failed to open " << opts.output_filename
                << " for writing";
     return false;
   }
+  // The tracer owns the writer chain, but the file is closed here so write
+  // errors can be reported.
+  utils::BufferedRecordWriter<pb::Record>* trace_file = file.get();
+  std::unique_ptr<utils::RecordWriter<pb::Record>> output(file.release());
+  if (opts.observer != nullptr) {
+    output = make_unique<utils::TeeRecordWriter<pb::Record>>(
+        std::move(output), opts.observer);
+  }
 
   // Write the metadata record.
   pb::Record metadata_record;
   pb::MetaData* metadata = metadata_record.mutable_metadata();
   metadata->set_project_root(opts.project_root);
   metadata->set_project_name(opts.project_name);
+  metadata->set_format_version(3);
 
   if (opts.project_root != QDir::currentPath()) {
     metadata->set_build_dir(
         utils::path::MakeRelativeTo(QDir::currentPath(),
                                     opts.project_root));
   }
-  file->WriteRecord(metadata_record);
+  output->WriteRecord(metadata_record);
 
-  // Start the trace.
+  // Start the trace.  Files that many processes read are written to shared
+  // file sets, and filenames and arguments are written to a string table.
   Tracer t(opts.project_root,
-           std::unique_ptr<utils::RecordWriter<pb::Record>>(file.release()));
+           make_unique<FileSetWriter>(
+               make_unique<StringTableWriter>(std::move(output))));
+  if (opts.process_exited) {
+    t.set_process_exited_callback(opts.process_exited);
+  }
   if (!t.Start(Tracer::Subprocess(opts.args, opts.working_directory))) {
     return false;
   }
-  return t.TraceUntilExit();
+  const bool traced = t.TraceUntilExit();
+  if (!trace_file->Close()) {
+    LOG(ERROR) << "Failed to write " << opts.output_filename;
+    return false;
+  }
+  return traced;
 }
 
 }  // namespace trace_controller
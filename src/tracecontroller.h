@@ -15,9 +15,14 @@
 #ifndef TRACECONTROLLER_H
 #define TRACECONTROLLER_H
 
+#include <functional>
+
 #include <QString>
 #include <QStringList>
 
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
 namespace trace_controller {
 
 struct Options {
@@ -36,6 +41,12 @@ struct Options {
   // All filenames will be made relative to this directory.  If unset,
   // defaults to the current directory.
   QString project_root;
+
+  // If set, every record written to the trace file is also written here as
+  // soon as it's written, and process_exited is called after each process'
+  // record with an ordering that every later file event is after.
+  utils::RecordWriter<pb::Record>* observer = nullptr;
+  std::function<void(int ordering)> process_exited;
 };
 
 bool Run(Options opts);
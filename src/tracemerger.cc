@@ -0,0 +1,468 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tracemerger.h"
+
+#include <algorithm>
+
+#include "fileset.h"
+#include "make_unique.h"
+#include "utils/logging.h"
+
+namespace {
+
+QString OutputKey(const QString& filename, const QByteArray& sha1) {
+  return filename + QChar(0) + QString::fromLatin1(sha1.toHex());
+}
+
+bool IsRelative(const QString& filename) {
+  return !filename.isEmpty() && !filename.startsWith('/');
+}
+
+int MaxOrdering(const pb::Process& process) {
+  int ret = std::max(process.begin_ordering(), process.end_ordering());
+  for (const pb::File& file : process.files()) {
+    ret = std::max(ret, std::max(file.open_ordering(), file.close_ordering()));
+  }
+  return ret;
+}
+
+}  // namespace
+
+
+struct TraceMerger::Input {
+  QString filename;
+  std::unique_ptr<utils::RecordReader<pb::Record>> file;
+
+  pb::MetaData metadata;
+  StringTable strings;
+  QHash<int, pb::FileSet> file_sets;
+
+  // Filled by FindOutputs.
+  int max_id = -1;
+  int max_ordering = -1;
+  int id_offset = 0;
+
+  // Filled by FindDependencies, sorted by open_ordering.
+  QList<Dependency> dependencies;
+
+  // Used by Merge.  ordering_map maps this input's orderings to merged
+  // orderings for every ordering less than next_ordering.
+  QVector<int> ordering_map;
+  int next_ordering = 0;
+  pb::Process head;
+  int head_max_ordering = 0;
+  bool has_head = false;
+
+  double progress() const {
+    return double(next_ordering) / (max_ordering + 1);
+  }
+  bool finished() const {
+    return !has_head && next_ordering > max_ordering;
+  }
+};
+
+
+TraceMerger::TraceMerger(const Options& opts)
+    : opts_(opts) {
+}
+
+TraceMerger::~TraceMerger() {
+}
+
+bool TraceMerger::Run(const Options& opts) {
+  TraceMerger m(opts);
+  return m.Open() &&
+         m.FindOutputs() &&
+         m.FindDependencies() &&
+         m.Merge();
+}
+
+bool TraceMerger::Open() {
+  for (const QString& filename : opts_.input_filenames) {
+    std::unique_ptr<Input> input(new Input);
+    input->filename = filename;
+    if (!Rewind(input.get())) {
+      return false;
+    }
+    inputs_.push_back(std::move(input));
+  }
+
+  // The first input's project root is used for the merged trace.
+  metadata_ = inputs_[0]->metadata;
+  metadata_.clear_format_version();
+  for (const auto& input : inputs_) {
+    if (input->metadata.build_dir() != metadata_.build_dir()) {
+      LOG(WARNING) << input->filename << " has build_dir "
+                   << input->metadata.build_dir() << " but "
+                   << inputs_[0]->filename << " has "
+                   << metadata_.build_dir();
+    }
+  }
+  return true;
+}
+
+bool TraceMerger::Rewind(Input* input) {
+  input->file = utils::OpenRecordReader<pb::Record>(input->filename);
+  if (!input->file) {
+    LOG(ERROR) << "Failed to open " << input->filename << " for reading";
+    return false;
+  }
+  input->strings = StringTable();
+  input->file_sets.clear();
+
+  pb::Record record;
+  if (!input->file->ReadRecord(&record) || !record.has_metadata()) {
+    LOG(ERROR) << input->filename << " doesn't start with a metadata record";
+    return false;
+  }
+  input->metadata.Swap(record.mutable_metadata());
+  return true;
+}
+
+bool TraceMerger::ReadProcess(Input* input, pb::Process* process) {
+  pb::Record record;
+  while (!input->file->AtEnd()) {
+    record.Clear();
+    CHECK(input->file->ReadRecord(&record))
+        << "Couldn't parse " << input->filename;
+
+    if (record.has_string_table()) {
+      input->strings.Append(record.string_table());
+    } else if (record.has_file_set()) {
+      pb::FileSet* file_set = &input->file_sets[record.file_set().id()];
+      file_set->Swap(record.mutable_file_set());
+      input->strings.Resolve(file_set);
+    } else if (record.has_process()) {
+      process->Swap(record.mutable_process());
+      input->strings.Resolve(process);
+      for (const pb::FileSetReference& reference : process->file_set()) {
+        ExpandFileSet(input->file_sets[reference.file_set_id()], reference,
+                      process);
+      }
+      process->clear_file_set();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TraceMerger::FindOutputs() {
+  int next_id = 0;
+  for (int i = 0; i < int(inputs_.size()); ++i) {
+    Input* input = inputs_[i].get();
+
+    pb::Process process;
+    while (ReadProcess(input, &process)) {
+      input->max_id = std::max(input->max_id, process.id());
+      input->max_ordering = std::max(input->max_ordering,
+                                     MaxOrdering(process));
+
+      for (const pb::File& file : process.files()) {
+        if (!file.has_sha1_after() || file.access() == pb::File_Access_READ) {
+          continue;
+        }
+        const QString filename = RemapFilename(*input, file.filename());
+        if (!IsRelative(filename)) {
+          continue;
+        }
+
+        // Only the first producer in each input matters.
+        QList<Producer>* producers =
+            &producers_[OutputKey(filename, file.sha1_after())];
+        if (producers->isEmpty() || producers->last().input != i) {
+          producers->append(Producer{i, file.close_ordering()});
+        }
+      }
+    }
+
+    input->id_offset = next_id;
+    next_id += input->max_id + 1;
+  }
+  return true;
+}
+
+bool TraceMerger::FindDependencies() {
+  for (int i = 0; i < int(inputs_.size()); ++i) {
+    Input* input = inputs_[i].get();
+    if (!Rewind(input)) {
+      return false;
+    }
+
+    pb::Process process;
+    while (ReadProcess(input, &process)) {
+      for (const pb::File& file : process.files()) {
+        if (!file.has_sha1_before()) {
+          continue;
+        }
+        const QString filename = RemapFilename(*input, file.filename());
+        if (!IsRelative(filename)) {
+          continue;
+        }
+
+        auto it = producers_.constFind(OutputKey(filename, file.sha1_before()));
+        if (it == producers_.constEnd()) {
+          continue;
+        }
+        for (const Producer& producer : it.value()) {
+          if (producer.input != i) {
+            input->dependencies.append(
+                Dependency{file.open_ordering(), producer});
+            break;
+          }
+        }
+      }
+    }
+
+    std::stable_sort(input->dependencies.begin(), input->dependencies.end(),
+                     [](const Dependency& a, const Dependency& b) {
+      return a.open_ordering < b.open_ordering;
+    });
+  }
+  return true;
+}
+
+bool TraceMerger::Blocked(const Input& input) const {
+  if (input.dependencies.isEmpty() ||
+      input.dependencies.first().open_ordering != input.next_ordering) {
+    return false;
+  }
+  const Producer& producer = input.dependencies.first().producer;
+  return inputs_[producer.input]->next_ordering <= producer.close_ordering;
+}
+
+void TraceMerger::Advance(Input* input) {
+  input->ordering_map.append(next_ordering_++);
+  input->next_ordering++;
+  while (!input->dependencies.isEmpty() &&
+         input->dependencies.first().open_ordering < input->next_ordering) {
+    input->dependencies.removeFirst();
+  }
+}
+
+bool TraceMerger::Merge() {
+  utils::BufferedRecordWriter<pb::Record>* file =
+      new utils::BufferedRecordWriter<pb::Record>(opts_.output_filename);
+  FileSetWriter writer(make_unique<StringTableWriter>(
+      std::unique_ptr<utils::RecordWriter<pb::Record>>(file)));
+  if (!file->Open()) {
+    LOG(ERROR) << "Failed to open " << opts_.output_filename
+               << " for writing";
+    return false;
+  }
+
+  pb::Record metadata_record;
+  metadata_record.mutable_metadata()->CopyFrom(metadata_);
+  metadata_record.mutable_metadata()->set_format_version(3);
+  writer.WriteRecord(metadata_record);
+
+  for (const auto& input : inputs_) {
+    if (!Rewind(input.get())) {
+      return false;
+    }
+    input->ordering_map.reserve(input->max_ordering + 1);
+    input->has_head = ReadProcess(input.get(), &input->head);
+    if (input->has_head) {
+      input->head_max_ordering = MaxOrdering(input->head);
+    }
+  }
+
+  int written = 0;
+  for (;;) {
+    // Write every process whose orderings have all been merged.
+    for (const auto& input : inputs_) {
+      while (input->has_head &&
+             input->head_max_ordering < input->next_ordering) {
+        pb::Record record;
+        record.mutable_process()->Swap(&input->head);
+        Remap(*input, record.mutable_process());
+        writer.WriteRecord(record);
+        ++written;
+
+        input->head.Clear();
+        input->has_head = ReadProcess(input.get(), &input->head);
+        if (input->has_head) {
+          input->head_max_ordering = MaxOrdering(input->head);
+        }
+      }
+    }
+
+    // Pick the least advanced input that isn't waiting for another input, so
+    // the inputs are interleaved roughly in proportion to their length.
+    Input* next = nullptr;
+    Input* blocked = nullptr;
+    for (const auto& input : inputs_) {
+      if (input->next_ordering > input->max_ordering) {
+        continue;
+      }
+      Input** candidate = Blocked(*input) ? &blocked : &next;
+      if (*candidate == nullptr ||
+          input->progress() < (*candidate)->progress()) {
+        *candidate = input.get();
+      }
+    }
+
+    if (next == nullptr && blocked == nullptr) {
+      break;
+    }
+    if (next == nullptr) {
+      // Every input is waiting on another one, so the dependencies are
+      // circular.  Break the cycle at the least advanced input.
+      LOG(WARNING) << "Ignoring circular dependency on a file written by "
+                   << inputs_[blocked->dependencies.first().producer.input]
+                          ->filename
+                   << " at ordering " << blocked->next_ordering << " in "
+                   << blocked->filename;
+      blocked->dependencies.removeFirst();
+      continue;
+    }
+    Advance(next);
+  }
+
+  for (const auto& input : inputs_) {
+    if (input->has_head) {
+      LOG(ERROR) << "Process " << input->head.id() << " in " << input->filename
+                 << " has orderings past the end of the trace";
+      return false;
+    }
+  }
+
+  if (!file->Close()) {
+    LOG(ERROR) << "Failed to write " << opts_.output_filename;
+    return false;
+  }
+
+  LOG(INFO) << "Written " << written << " processes from "
+            << inputs_.size() << " traces to " << opts_.output_filename;
+  return true;
+}
+
+QString TraceMerger::RemapFilename(const Input& input,
+                                   const QString& filename) const {
+  const QString& root = input.metadata.project_root();
+  if (root.isEmpty() || root == metadata_.project_root()) {
+    return filename;
+  }
+  if (filename == root) {
+    return ".";
+  }
+  if (!filename.startsWith(root + "/")) {
+    return filename;
+  }
+  return filename.mid(root.length() + 1);
+}
+
+QString TraceMerger::RebasePath(const Input& input,
+                               const QString& path) const {
+  const QString relative = RemapFilename(input, path);
+  if (relative == path) {
+    return path;
+  }
+  if (relative == ".") {
+    return metadata_.project_root();
+  }
+  return metadata_.project_root() + "/" + relative;
+}
+
+QString TraceMerger::RebaseArgument(const Input& input,
+                                   const QString& arg) const {
+  const QString& root = input.metadata.project_root();
+  if (root.isEmpty() || root == metadata_.project_root()) {
+    return arg;
+  }
+
+  QString ret;
+  int copied = 0;
+  for (int i = arg.indexOf(root); i != -1; i = arg.indexOf(root, i + 1)) {
+    const int end = i + root.length();
+    if (end < arg.length() && arg[end] != '/') {
+      continue;
+    }
+
+    // The root has to start a path rather than be part way through another
+    // one, so look back to the flag or separator before it.
+    int j = i - 1;
+    while (j >= 0 && arg[j] != '/' && arg[j] != '=' && arg[j] != ',' &&
+           arg[j] != ':' && arg[j] != ' ') {
+      --j;
+    }
+    if (j >= 0 && arg[j] == '/') {
+      continue;
+    }
+
+    ret += arg.mid(copied, i - copied);
+    ret += metadata_.project_root();
+    copied = end;
+    i = end - 1;
+  }
+  ret += arg.mid(copied);
+  return ret;
+}
+
+void TraceMerger::Remap(const Input& input, pb::Process* process) const {
+  process->set_id(process->id() + input.id_offset);
+  if (process->has_parent_id()) {
+    process->set_parent_id(process->parent_id() + input.id_offset);
+  }
+  QList<int> children = process->child_process_id();
+  for (int& child : children) {
+    child += input.id_offset;
+  }
+  process->set_child_process_id(children);
+
+  if (process->has_begin_ordering()) {
+    process->set_begin_ordering(
+        input.ordering_map[process->begin_ordering()]);
+  }
+  if (process->has_end_ordering()) {
+    process->set_end_ordering(input.ordering_map[process->end_ordering()]);
+  }
+
+  // These are absolute, so they're moved to the merged project root.
+  if (process->has_filename()) {
+    process->set_filename(RebasePath(input, process->filename()));
+  }
+  if (process->has_working_directory()) {
+    process->set_working_directory(
+        RebasePath(input, process->working_directory()));
+  }
+  if (process->argv_size() != 0) {
+    QStringList argv;
+    for (const QString& arg : process->argv()) {
+      argv.append(RebaseArgument(input, arg));
+    }
+    process->set_argv(argv);
+  }
+
+  // The IDs refer to the input's string table.  New ones are assigned when the
+  // process is written.
+  process->clear_filename_id();
+  process->clear_working_directory_id();
+  process->clear_argv_id();
+
+  for (pb::File& file : *process->mutable_files()) {
+    if (file.has_open_ordering()) {
+      file.set_open_ordering(input.ordering_map[file.open_ordering()]);
+    }
+    if (file.has_close_ordering()) {
+      file.set_close_ordering(input.ordering_map[file.close_ordering()]);
+    }
+    file.set_filename(RemapFilename(input, file.filename()));
+    file.clear_filename_id();
+    if (file.has_renamed_from()) {
+      file.set_renamed_from(RemapFilename(input, file.renamed_from()));
+      file.clear_renamed_from_id();
+    }
+  }
+}
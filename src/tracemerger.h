@@ -0,0 +1,117 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TRACEMERGER_H
+#define TRACEMERGER_H
+
+#include <memory>
+#include <vector>
+
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include <QVector>
+
+#include "stringtable.h"
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
+// Merges several traces, eg. from the shards of a build that ran on different
+// machines, into one trace that can be analyzed as a single build.
+//
+// Process IDs are renumbered so they're unique across the inputs.  Orderings
+// are interleaved so that each input's orderings keep their relative order,
+// and so that a file read in one input is opened after it was closed by the
+// process that wrote it (with the same contents) in another input.  Filenames
+// under an input's project_root are made relative, so inputs traced in
+// different checkouts refer to the same files.
+//
+// The inputs are read from start to end three times: to find their sizes and
+// outputs, to find the reads that depend on other inputs' outputs, and to merge
+// them.  Only one process from each input is in memory at a time.
+class TraceMerger {
+ public:
+  struct Options {
+    QStringList input_filenames;
+    QString output_filename;
+  };
+
+  static bool Run(const Options& opts);
+
+ private:
+  struct Input;
+
+  // A process in another input that wrote a file.
+  struct Producer {
+    int input;
+    int close_ordering;
+  };
+
+  // A file opened at open_ordering that must be ordered after the producer's
+  // close.
+  struct Dependency {
+    int open_ordering;
+    Producer producer;
+  };
+
+  TraceMerger(const Options& opts);
+  ~TraceMerger();
+
+  bool Open();
+  bool FindOutputs();
+  bool FindDependencies();
+  bool Merge();
+
+  // (Re)starts reading an input from the beginning.
+  bool Rewind(Input* input);
+
+  // Reads the next process from the input with its strings resolved and its
+  // file sets expanded.  Returns false at the end of the input.
+  bool ReadProcess(Input* input, pb::Process* process);
+
+  // Returns true if the input's next ordering is an open of a file that hasn't
+  // been closed by its producer yet.
+  bool Blocked(const Input& input) const;
+
+  // Gives the input's next ordering the next merged ordering.
+  void Advance(Input* input);
+
+  // Renumbers the process' ID and orderings and fixes up its filenames.
+  void Remap(const Input& input, pb::Process* process) const;
+
+  // Makes filenames under the input's project root relative to it, as the
+  // tracer does for files.
+  QString RemapFilename(const Input& input, const QString& filename) const;
+
+  // Moves absolute paths under the input's project root to the same place
+  // under the merged project root.
+  QString RebasePath(const Input& input, const QString& path) const;
+
+  // Moves every path under the input's project root in a command line
+  // argument, including ones after a flag like -I/root/include or
+  // -Wl,-rpath,/root/lib.
+  QString RebaseArgument(const Input& input, const QString& arg) const;
+
+  const Options opts_;
+
+  std::vector<std::unique_ptr<Input>> inputs_;
+  pb::MetaData metadata_;
+
+  // Keyed by relative filename and sha1.
+  QHash<QString, QList<Producer>> producers_;
+
+  int next_ordering_ = 0;
+};
+
+#endif // TRACEMERGER_H
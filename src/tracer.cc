@@ -24,6 +24,7 @@
 #include <sys/user.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <cstdint>
 
 #include <glog/logging.h>
@@ -282,6 +283,7 @@ bool Tracer::TraceUntilExit() {
 
   while (true) {
     if (pids_.empty()) {
+      WriteIndex();
       return true;
     }
 
@@ -393,9 +395,19 @@ void Tracer::HandleProcessExited(PidState* state, int exit_code) {
 
   state->process_pb->set_exit_code(exit_code);
   state->process_pb->set_end_ordering(next_ordering_++);
+  AddToIndex(*state->process_pb, trace_writer_->Offset());
   trace_writer_->WriteRecord(state->record_pb);
   pids_.remove(state->pid);
   delete state;
+
+  if (process_exited_callback_) {
+    // Every file a running process opens is after the process began.
+    int ordering = next_ordering_;
+    for (const PidState* running : pids_) {
+      ordering = std::min(ordering, running->process_pb->begin_ordering());
+    }
+    process_exited_callback_(ordering);
+  }
 }
 
 void Tracer::WriteFileProtos(PidState* state) {
@@ -508,6 +520,65 @@ void Tracer::WriteFileProtos(PidState* state) {
   });
 }
 
+void Tracer::AddToIndex(const pb::Process& process, qint64 offset) {
+  if (offset < 0) {
+    return;
+  }
+
+  pb::TraceIndex_ProcessOffset entry;
+  entry.set_id(process.id());
+  entry.set_offset(offset);
+  index_processes_.append(entry);
+
+  if (process.has_filename()) {
+    index_executables_[utils::path::Filename(process.filename())].append(
+        process.id());
+  }
+
+  for (const pb::File& file : process.files()) {
+    if (file.has_renamed_from() ||
+        file.access() == pb::File_Access_CREATED ||
+        file.access() == pb::File_Access_MODIFIED ||
+        file.access() == pb::File_Access_WRITTEN_BUT_UNCHANGED) {
+      index_outputs_[file.filename()].append(process.id());
+    }
+  }
+}
+
+void Tracer::WriteIndex() {
+  const qint64 offset = trace_writer_->Offset();
+  if (offset < 0 || index_processes_.isEmpty()) {
+    return;
+  }
+
+  pb::Record record;
+  pb::TraceIndex* index = record.mutable_trace_index();
+  for (const pb::TraceIndex_ProcessOffset& entry : index_processes_) {
+    index->add_process()->CopyFrom(entry);
+  }
+  for (auto it = index_outputs_.constBegin();
+       it != index_outputs_.constEnd(); ++it) {
+    pb::TraceIndex_Key* key = index->add_output();
+    key->set_name(it.key());
+    key->set_process_id(it.value());
+  }
+  for (auto it = index_executables_.constBegin();
+       it != index_executables_.constEnd(); ++it) {
+    pb::TraceIndex_Key* key = index->add_executable();
+    key->set_name(it.key());
+    key->set_process_id(it.value());
+  }
+  trace_writer_->WriteRecord(record);
+
+  pb::Record footer;
+  footer.set_trace_index_offset(offset);
+  trace_writer_->WriteRecord(footer);
+
+  index_processes_.clear();
+  index_outputs_.clear();
+  index_executables_.clear();
+}
+
 void Tracer::Registers::FromPid(pid_t pid) {
   #define GET_REGISTER(field, reg) \
     field = ptrace(PTRACE_PEEKUSER, pid, \
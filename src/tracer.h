@@ -26,6 +26,10 @@ class Tracer {
  public:
   typedef std::function<void()> Tracee;
 
+  // Called after each process' record is written, with an ordering that every
+  // file event in records still to be written is after.
+  typedef std::function<void(int ordering)> ProcessExitedCallback;
+
   Tracer(const QString& root_directory,
          std::unique_ptr<utils::RecordWriter<pb::Record>> writer);
 
@@ -35,6 +39,10 @@ class Tracer {
   bool Start(Tracee tracee);
   bool TraceUntilExit();
 
+  void set_process_exited_callback(ProcessExitedCallback callback) {
+    process_exited_callback_ = callback;
+  }
+
  private:
   struct ChildEvent;
   struct FileState;
@@ -79,14 +87,28 @@ class Tracer {
   // state to the pb::Process.
   void WriteFileProtos(PidState* state);
 
+  // Records where a process' record was written so it can be added to the
+  // index.  Does nothing if the writer can't report offsets.
+  void AddToIndex(const pb::Process& process, qint64 offset);
+
+  // Writes the TraceIndex and the footer record that points to it.  Called
+  // once all the traced processes have exited.
+  void WriteIndex();
+
   const QString root_directory_;
   std::unique_ptr<utils::RecordWriter<pb::Record>> trace_writer_;
+  ProcessExitedCallback process_exited_callback_;
   QMap<pid_t, PidState*> pids_;
   QSet<pid_t> stopped_children_;
 
   int next_id_ = 0;
   int next_ordering_ = 0;
 
+  // Filled by AddToIndex.
+  QList<pb::TraceIndex_ProcessOffset> index_processes_;
+  QMap<QString, QList<int>> index_outputs_;
+  QMap<QString, QList<int>> index_executables_;
+
 };
 
 #endif // TRACER_H
@@ -14,12 +14,34 @@
 
 #include "tracereader.h"
 
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite_inl.h>
+
+#include <QCryptographicHash>
+
+#include "fileset.h"
 #include "utils/path.h"
 
 using utils::path::Extension;
 using utils::path::Filename;
 
+namespace {
+
+// Size of the last record in an indexed trace: a 4 byte length, a 1 byte tag
+// and the 8 byte trace_index_offset.
+const qint64 kIndexFooterSize = 13;
+
+}  // namespace
+
 TraceReader::TraceReader() {
+  processes_.argv_offset.append(0);
+  processes_.child_offset.append(0);
+  processes_.file_offset.append(0);
+  digest_offset_.append(0);
 }
 
 void TraceReader::IgnoreFileExtensions(
@@ -36,39 +58,830 @@ void TraceReader::IgnoreProcessFilenames(
   }
 }
 
-void TraceReader::Read(std::unique_ptr<utils::RecordFile<pb::Record>> file) {
-  while (!file->AtEnd()) {
-    pb::Record record;
-    CHECK(file->ReadRecord(&record));
-
-    if (record.has_metadata()) {
-      metadata_ = record.metadata();
-    } else if (record.has_process()) {
-      const pb::Process* pb = &record.process();
-      if (pb->argv_size() == 0) {
-        continue;
-      }
+struct TraceReader::DecodedFile {
+  int filename_id = -1;
+  int renamed_from_id = -1;
 
-      if (process_blacklist_.contains(Filename(pb->filename()))) {
-        continue;
-      }
+  // Only set in traces without a string table.
+  QString filename;
+  QString renamed_from;
+
+  int access = 0;
+  QByteArray sha1_before;
+  QByteArray sha1_after;
+  int open_ordering = 0;
+  int close_ordering = 0;
+};
+
+struct TraceReader::DecodedProcess {
+  // The serialized pb::Process.
+  QByteArray bytes;
+
+  // False if the process was filtered out.
+  bool keep = false;
+
+  int id = 0;
+  int parent_id = -1;
+  int begin_ordering = 0;
+  int end_ordering = 0;
+  int exit_code = 0;
+  int filename_id = -1;
+  int working_directory_id = -1;
+  QVector<int> argv_ids;
+
+  // Only set in traces without a string table.
+  QString filename;
+  QString working_directory;
+  QStringList argv;
+
+  QVector<int> child_ids;
+  QVector<DecodedFile> files;
+  QList<pb::FileSetReference> file_sets;
+};
+
+namespace {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+// Reads a length-delimited field.  The bytes point into the buffer that the
+// stream is reading.
+bool ReadBytes(CodedInputStream* in, const char* buffer, QByteArray* bytes) {
+  quint32 length;
+  if (!in->ReadVarint32(&length)) {
+    return false;
+  }
+  const int pos = in->CurrentPosition();
+  if (!in->Skip(length)) {
+    return false;
+  }
+  *bytes = QByteArray::fromRawData(buffer + pos, length);
+  return true;
+}
+
+bool ReadString(CodedInputStream* in, const char* buffer, QString* str) {
+  QByteArray bytes;
+  if (!ReadBytes(in, buffer, &bytes)) {
+    return false;
+  }
+  *str = QString::fromUtf8(bytes);
+  return true;
+}
+
+bool ReadInt32(CodedInputStream* in, int* value) {
+  quint32 varint;
+  if (!in->ReadVarint32(&varint)) {
+    return false;
+  }
+  *value = int(varint);
+  return true;
+}
+
+// Reads a repeated int32 field that may or may not be packed.
+bool ReadRepeatedInt32(CodedInputStream* in, quint32 tag,
+                       QVector<int>* values) {
+  if (WireFormatLite::GetTagWireType(tag) !=
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+    int value;
+    if (!ReadInt32(in, &value)) {
+      return false;
+    }
+    values->append(value);
+    return true;
+  }
+
+  quint32 length;
+  if (!in->ReadVarint32(&length)) {
+    return false;
+  }
+  const CodedInputStream::Limit limit = in->PushLimit(length);
+  while (in->BytesUntilLimit() > 0) {
+    int value;
+    if (!ReadInt32(in, &value)) {
+      return false;
+    }
+    values->append(value);
+  }
+  in->PopLimit(limit);
+  return true;
+}
 
-      while (processes_by_id_.size() <= pb->id()) {
-        processes_by_id_.append(pb::Process());
+// Finds the process in a serialized pb::Record.  Returns false if the record
+// isn't a process.
+bool FindProcess(const QByteArray& record, QByteArray* process) {
+  CodedInputStream in(reinterpret_cast<const uint8_t*>(record.constData()),
+                      record.size());
+  bool found = false;
+  while (quint32 tag = in.ReadTag()) {
+    if (WireFormatLite::GetTagFieldNumber(tag) ==
+            pb::Record::kProcessFieldNumber &&
+        WireFormatLite::GetTagWireType(tag) ==
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      if (!ReadBytes(&in, record.constData(), process)) {
+        return false;
       }
-      processes_by_id_[pb->id()] = *pb;
+      found = true;
+    } else if (!WireFormatLite::SkipField(&in, tag)) {
+      return false;
+    }
+  }
+  return found;
+}
+
+bool DecodeFile(const QByteArray& bytes, TraceReader::DecodedFile* file) {
+  const char* buffer = bytes.constData();
+  CodedInputStream in(reinterpret_cast<const uint8_t*>(buffer), bytes.size());
+  while (quint32 tag = in.ReadTag()) {
+    bool ok;
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case pb::File::kFilenameFieldNumber:
+        ok = ReadString(&in, buffer, &file->filename);
+        break;
+      case pb::File::kRenamedFromFieldNumber:
+        ok = ReadString(&in, buffer, &file->renamed_from);
+        break;
+      case pb::File::kAccessFieldNumber:
+        ok = ReadInt32(&in, &file->access);
+        break;
+      case pb::File::kSha1BeforeFieldNumber:
+        ok = ReadBytes(&in, buffer, &file->sha1_before);
+        break;
+      case pb::File::kSha1AfterFieldNumber:
+        ok = ReadBytes(&in, buffer, &file->sha1_after);
+        break;
+      case pb::File::kOpenOrderingFieldNumber:
+        ok = ReadInt32(&in, &file->open_ordering);
+        break;
+      case pb::File::kCloseOrderingFieldNumber:
+        ok = ReadInt32(&in, &file->close_ordering);
+        break;
+      case pb::File::kFilenameIdFieldNumber:
+        ok = ReadInt32(&in, &file->filename_id);
+        break;
+      case pb::File::kRenamedFromIdFieldNumber:
+        ok = ReadInt32(&in, &file->renamed_from_id);
+        break;
+      default:
+        ok = WireFormatLite::SkipField(&in, tag);
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
 
-      for (int i = 0; i < pb->files_size(); ++i) {
-        const pb::File* file = &pb->files(i);
+bool TraceReader::ShouldKeep(const QByteArray& process) const {
+  CodedInputStream in(reinterpret_cast<const uint8_t*>(process.constData()),
+                      process.size());
 
-        if (file_extension_blacklist_.contains(Extension(file->filename()))) {
-          continue;
-        }
+  // Only the filename and argv are looked at - the files are skipped over
+  // without being decoded.
+  bool has_argv = false;
+  int filename_id = -1;
+  QByteArray filename;
+  while (quint32 tag = in.ReadTag()) {
+    bool ok;
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case pb::Process::kFilenameFieldNumber:
+        ok = ReadBytes(&in, process.constData(), &filename);
+        break;
+      case pb::Process::kFilenameIdFieldNumber:
+        ok = ReadInt32(&in, &filename_id);
+        break;
+      case pb::Process::kArgvFieldNumber:
+      case pb::Process::kArgvIdFieldNumber:
+        has_argv = true;
+        ok = WireFormatLite::SkipField(&in, tag);
+        break;
+      default:
+        ok = WireFormatLite::SkipField(&in, tag);
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+
+  if (!has_argv) {
+    return false;
+  }
+  if (process_blacklist_.isEmpty()) {
+    return true;
+  }
+  const QString name = filename_id != -1 ? strings_.Get(filename_id)
+                                         : QString::fromUtf8(filename);
+  return !process_blacklist_.contains(Filename(name));
+}
 
-        events_.append(FileEvent{file->close_ordering(), pb->id(), i});
+bool TraceReader::Decode(DecodedProcess* process) const {
+  const char* buffer = process->bytes.constData();
+  CodedInputStream in(reinterpret_cast<const uint8_t*>(buffer),
+                      process->bytes.size());
+  while (quint32 tag = in.ReadTag()) {
+    bool ok;
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case pb::Process::kIdFieldNumber:
+        ok = ReadInt32(&in, &process->id);
+        break;
+      case pb::Process::kParentIdFieldNumber:
+        ok = ReadInt32(&in, &process->parent_id);
+        break;
+      case pb::Process::kBeginOrderingFieldNumber:
+        ok = ReadInt32(&in, &process->begin_ordering);
+        break;
+      case pb::Process::kEndOrderingFieldNumber:
+        ok = ReadInt32(&in, &process->end_ordering);
+        break;
+      case pb::Process::kFilenameFieldNumber:
+        ok = ReadString(&in, buffer, &process->filename);
+        break;
+      case pb::Process::kArgvFieldNumber: {
+        QString arg;
+        ok = ReadString(&in, buffer, &arg);
+        process->argv.append(arg);
+        break;
+      }
+      case pb::Process::kWorkingDirectoryFieldNumber:
+        ok = ReadString(&in, buffer, &process->working_directory);
+        break;
+      case pb::Process::kExitCodeFieldNumber:
+        ok = ReadInt32(&in, &process->exit_code);
+        break;
+      case pb::Process::kFilesFieldNumber: {
+        QByteArray bytes;
+        process->files.append(DecodedFile());
+        ok = ReadBytes(&in, buffer, &bytes) &&
+             DecodeFile(bytes, &process->files.last());
+        break;
+      }
+      case pb::Process::kChildProcessIdFieldNumber:
+        ok = ReadRepeatedInt32(&in, tag, &process->child_ids);
+        break;
+      case pb::Process::kFilenameIdFieldNumber:
+        ok = ReadInt32(&in, &process->filename_id);
+        break;
+      case pb::Process::kArgvIdFieldNumber:
+        ok = ReadRepeatedInt32(&in, tag, &process->argv_ids);
+        break;
+      case pb::Process::kWorkingDirectoryIdFieldNumber:
+        ok = ReadInt32(&in, &process->working_directory_id);
+        break;
+      case pb::Process::kFileSetFieldNumber: {
+        QByteArray bytes;
+        pb::FileSetReference reference;
+        ok = ReadBytes(&in, buffer, &bytes) &&
+             reference.ParseFromArray(bytes.constData(), bytes.size());
+        process->file_sets.append(reference);
+        break;
       }
+      default:
+        ok = WireFormatLite::SkipField(&in, tag);
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TraceReader::Read(std::unique_ptr<utils::RecordReader<pb::Record>> file,
+                       QByteArray* sha1) {
+  // The records aren't copied out of a memory-mapped file - they're only
+  // parsed as far as they need to be.
+  QVector<QByteArray> records;
+  CHECK(file->ReadAllRaw(&records));
+
+  if (sha1) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QByteArray& bytes : records) {
+      hash.addData(bytes);
+    }
+    *sha1 = hash.result();
+  }
+
+  // Everything except the processes is small, so parse that up front.  Then
+  // every string is in the table before any process is decoded.
+  QVector<DecodedProcess> processes;
+  for (const QByteArray& bytes : records) {
+    QByteArray process;
+    if (FindProcess(bytes, &process)) {
+      processes.append(DecodedProcess());
+      processes.last().bytes = process;
+      continue;
+    }
+
+    pb::Record record;
+    CHECK(record.ParseFromArray(bytes.constData(), bytes.size()));
+    AddOtherRecord(&record);
+  }
+
+  // Filtered processes are rejected after reading just their filename and
+  // argv, so their files are never decoded.  Decoding doesn't modify the
+  // string table, so it's done in parallel.
+  const bool ok =
+      utils::DecodeParallel(&processes, [this](DecodedProcess& pb) {
+    pb.keep = ShouldKeep(pb.bytes);
+    return !pb.keep || Decode(&pb);
+  });
+  CHECK(ok) << "Failed to parse a process";
+
+  // Each process' events, sorted, and where each process' events start.
+  QVector<FileEvent> process_events;
+  QVector<int> process_event_offsets{0};
+
+  for (DecodedProcess& pb : processes) {
+    if (!pb.keep) {
+      continue;
+    }
+    AddProcess(&pb, &process_events);
+    pb = DecodedProcess();
+    process_event_offsets.append(process_events.count());
+  }
+
+  digest_ids_.clear();
+  MergeEvents(process_events, process_event_offsets);
+}
+
+void TraceReader::AddRecord(const pb::Record& record) {
+  if (!record.has_process()) {
+    pb::Record copy(record);
+    AddOtherRecord(&copy);
+    return;
+  }
+
+  const std::string bytes = record.process().SerializeAsString();
+  DecodedProcess pb;
+  pb.bytes = QByteArray::fromRawData(bytes.data(), bytes.size());
+  if (!ShouldKeep(pb.bytes)) {
+    return;
+  }
+  CHECK(Decode(&pb)) << "Failed to parse process " << record.process().id();
+
+  QVector<FileEvent> events;
+  AddProcess(&pb, &events);
+  for (const FileEvent& event : events) {
+    pending_events_.push(event);
+  }
+}
+
+int TraceReader::TakeEvents(int before_ordering) {
+  const int first = events_.count();
+  while (!pending_events_.empty() &&
+         pending_events_.top().ordering < before_ordering) {
+    events_.append(pending_events_.top());
+    pending_events_.pop();
+  }
+  return first;
+}
+
+void TraceReader::AddOtherRecord(pb::Record* record) {
+  if (record->has_metadata()) {
+    metadata_ = record->metadata();
+  } else if (record->has_string_table()) {
+    strings_.Append(record->string_table());
+  } else if (record->has_file_set()) {
+    pb::FileSet* file_set = &file_sets_[record->file_set().id()];
+    file_set->Swap(record->mutable_file_set());
+    strings_.Resolve(file_set);
+  }
+}
+
+void TraceReader::AddProcess(DecodedProcess* pb, QVector<FileEvent>* events) {
+  const int first_file = files_.filename_id.count();
+  AddColumns(pb);
+
+  const int file_count = files_.filename_id.count() - first_file;
+  const int events_begin = events->count();
+  for (int i = 0; i < file_count; ++i) {
+    const int filename_id = files_.filename_id[first_file + i];
+    auto ignored = ignored_filenames_.find(filename_id);
+    if (ignored == ignored_filenames_.end()) {
+      ignored = ignored_filenames_.insert(
+          filename_id,
+          file_extension_blacklist_.contains(Extension(String(filename_id))));
+    }
+    if (ignored.value()) {
+      continue;
+    }
+    events->append(FileEvent{
+        files_.close_ordering[first_file + i], processes_.id.last(), i});
+  }
+  std::sort(events->begin() + events_begin, events->end());
+}
+
+int TraceReader::Intern(int id, const QString& str) {
+  if (id != -1 || str.isNull()) {
+    return id;
+  }
+  return strings_.Intern(str);
+}
+
+void TraceReader::AddColumns(DecodedProcess* pb) {
+  const int id = pb->id;
+  while (row_by_id_.count() <= id) {
+    row_by_id_.append(-1);
+  }
+  row_by_id_[id] = processes_.id.count();
+
+  processes_.id.append(id);
+  processes_.parent_id.append(pb->parent_id);
+  processes_.begin_ordering.append(pb->begin_ordering);
+  processes_.end_ordering.append(pb->end_ordering);
+  processes_.exit_code.append(pb->exit_code);
+  processes_.filename_id.append(Intern(pb->filename_id, pb->filename));
+  processes_.working_directory_id.append(
+      Intern(pb->working_directory_id, pb->working_directory));
+
+  argv_ids_ += pb->argv_ids;
+  for (const QString& arg : pb->argv) {
+    argv_ids_.append(strings_.Intern(arg));
+  }
+  processes_.argv_offset.append(argv_ids_.count());
+
+  child_ids_ += pb->child_ids;
+  processes_.child_offset.append(child_ids_.count());
+
+  for (const DecodedFile& file : pb->files) {
+    AddFile(Intern(file.filename_id, file.filename),
+            Intern(file.renamed_from_id, file.renamed_from),
+            file.access, file.sha1_before, file.sha1_after,
+            file.open_ordering, file.close_ordering);
+  }
+
+  // Files in file sets are numbered after the process' own files.  They're
+  // copied into the process' own rows rather than shared: each process opens
+  // them at different orderings, and every file needs a row for its events.
+  // The filenames and digests in the rows are still only stored once.
+  for (const pb::FileSetReference& reference : pb->file_sets) {
+    auto it = file_sets_.constFind(reference.file_set_id());
+    CHECK(it != file_sets_.constEnd())
+        << "Process " << id << " refers to missing file set "
+        << reference.file_set_id();
+    CHECK_EQ(it->files_size(), reference.open_ordering_size());
+    CHECK_EQ(it->files_size(), reference.close_ordering_size());
+    for (int i = 0; i < it->files_size(); ++i) {
+      const pb::File& file = it->files(i);
+      AddFile(file.filename_id(),
+              file.has_renamed_from_id() ? file.renamed_from_id() : -1,
+              file.access(), file.sha1_before(), file.sha1_after(),
+              reference.open_ordering()[i], reference.close_ordering()[i]);
+    }
+  }
+  processes_.file_offset.append(files_.filename_id.count());
+}
+
+void TraceReader::AddFile(int filename_id, int renamed_from_id, int access,
+                          const QByteArray& sha1_before,
+                          const QByteArray& sha1_after,
+                          int open_ordering, int close_ordering) {
+  files_.filename_id.append(filename_id);
+  files_.renamed_from_id.append(renamed_from_id);
+  files_.sha1_before.append(AddDigest(sha1_before));
+  files_.sha1_after.append(AddDigest(sha1_after));
+  files_.open_ordering.append(open_ordering);
+  files_.close_ordering.append(close_ordering);
+  files_.access.append(access);
+}
+
+int TraceReader::AddDigest(const QByteArray& digest) {
+  if (digest.isEmpty()) {
+    return -1;
+  }
+
+  auto it = digest_ids_.find(digest);
+  if (it != digest_ids_.end()) {
+    return it.value();
+  }
+
+  const int id = digest_offset_.count() - 1;
+  digest_pool_.append(digest);
+  digest_offset_.append(digest_pool_.size());
+
+  // The digest may point into a record that's about to be freed.
+  digest_ids_.insert(QByteArray(digest.constData(), digest.size()), id);
+  return id;
+}
+
+QByteArray TraceReader::digest(int id) const {
+  if (id == -1) {
+    return QByteArray();
+  }
+  const int offset = digest_offset_[id];
+  return QByteArray(digest_pool_.constData() + offset,
+                    digest_offset_[id + 1] - offset);
+}
+
+const QString& TraceReader::String(int id) const {
+  static const QString kEmpty;
+  if (id == -1) {
+    return kEmpty;
+  }
+  return strings_.Get(id);
+}
+
+void TraceReader::MergeEvents(const QVector<FileEvent>& events,
+                              const QVector<int>& offsets) {
+  // The position in each process' events, ordered by the ordering of the
+  // event at that position.
+  typedef QPair<int, int> Cursor;  // (position, end)
+  auto later = [&events](const Cursor& a, const Cursor& b) {
+    return events[a.first].ordering > events[b.first].ordering;
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heads(
+      later);
+  for (int i = 0; i + 1 < offsets.count(); ++i) {
+    if (offsets[i] != offsets[i + 1]) {
+      heads.push(Cursor(offsets[i], offsets[i + 1]));
+    }
+  }
+
+  events_.clear();
+  events_.reserve(events.count());
+  while (!heads.empty()) {
+    Cursor cursor = heads.top();
+    heads.pop();
+    events_.append(events[cursor.first]);
+    if (++cursor.first != cursor.second) {
+      heads.push(cursor);
+    }
+  }
+}
+
+TraceReader::Process TraceReader::process(int id) const {
+  if (id < 0 || id >= row_by_id_.count()) {
+    return Process(this, -1);
+  }
+  return Process(this, row_by_id_[id]);
+}
+
+int TraceReader::Process::id() const {
+  return row_ == -1 ? 0 : reader_->processes_.id[row_];
+}
+
+bool TraceReader::Process::has_parent_id() const {
+  return row_ != -1 && reader_->processes_.parent_id[row_] != -1;
+}
+
+int TraceReader::Process::parent_id() const {
+  return has_parent_id() ? reader_->processes_.parent_id[row_] : 0;
+}
+
+int TraceReader::Process::begin_ordering() const {
+  return row_ == -1 ? 0 : reader_->processes_.begin_ordering[row_];
+}
+
+int TraceReader::Process::end_ordering() const {
+  return row_ == -1 ? 0 : reader_->processes_.end_ordering[row_];
+}
+
+int TraceReader::Process::exit_code() const {
+  return row_ == -1 ? 0 : reader_->processes_.exit_code[row_];
+}
+
+const QString& TraceReader::Process::filename() const {
+  return reader_->String(
+      row_ == -1 ? -1 : reader_->processes_.filename_id[row_]);
+}
+
+const QString& TraceReader::Process::working_directory() const {
+  return reader_->String(
+      row_ == -1 ? -1 : reader_->processes_.working_directory_id[row_]);
+}
+
+int TraceReader::Process::argv_size() const {
+  if (row_ == -1) {
+    return 0;
+  }
+  return reader_->processes_.argv_offset[row_ + 1] -
+         reader_->processes_.argv_offset[row_];
+}
+
+const QString& TraceReader::Process::argv(int i) const {
+  CHECK(i >= 0 && i < argv_size());
+  return reader_->String(
+      reader_->argv_ids_[reader_->processes_.argv_offset[row_] + i]);
+}
+
+QStringList TraceReader::Process::argv() const {
+  QStringList ret;
+  for (int i = 0; i < argv_size(); ++i) {
+    ret.append(argv(i));
+  }
+  return ret;
+}
+
+QList<int> TraceReader::Process::child_process_id() const {
+  QList<int> ret;
+  if (row_ == -1) {
+    return ret;
+  }
+  for (int i = reader_->processes_.child_offset[row_];
+       i < reader_->processes_.child_offset[row_ + 1]; ++i) {
+    ret.append(reader_->child_ids_[i]);
+  }
+  return ret;
+}
+
+int TraceReader::Process::file_count() const {
+  if (row_ == -1) {
+    return 0;
+  }
+  return reader_->processes_.file_offset[row_ + 1] -
+         reader_->processes_.file_offset[row_];
+}
+
+TraceReader::File TraceReader::Process::file(int index) const {
+  CHECK(index >= 0 && index < file_count())
+      << "File " << index << " out of range in process " << id();
+  return File(reader_, reader_->processes_.file_offset[row_] + index);
+}
+
+const QString& TraceReader::File::filename() const {
+  return reader_->String(reader_->files_.filename_id[row_]);
+}
+
+int TraceReader::File::filename_id() const {
+  return reader_->files_.filename_id[row_];
+}
+
+bool TraceReader::File::has_renamed_from() const {
+  return reader_->files_.renamed_from_id[row_] != -1;
+}
+
+const QString& TraceReader::File::renamed_from() const {
+  return reader_->String(reader_->files_.renamed_from_id[row_]);
+}
+
+pb::File_Access TraceReader::File::access() const {
+  return pb::File_Access(reader_->files_.access[row_]);
+}
+
+bool TraceReader::File::has_sha1_before() const {
+  return reader_->files_.sha1_before[row_] != -1;
+}
+
+QByteArray TraceReader::File::sha1_before() const {
+  return reader_->digest(reader_->files_.sha1_before[row_]);
+}
+
+bool TraceReader::File::has_sha1_after() const {
+  return reader_->files_.sha1_after[row_] != -1;
+}
+
+QByteArray TraceReader::File::sha1_after() const {
+  return reader_->digest(reader_->files_.sha1_after[row_]);
+}
+
+int TraceReader::File::sha1_before_id() const {
+  return reader_->files_.sha1_before[row_];
+}
+
+int TraceReader::File::sha1_after_id() const {
+  return reader_->files_.sha1_after[row_];
+}
+
+int TraceReader::File::open_ordering() const {
+  return reader_->files_.open_ordering[row_];
+}
+
+int TraceReader::File::close_ordering() const {
+  return reader_->files_.close_ordering[row_];
+}
+
+bool IndexedTraceReader::Open(const QString& filename) {
+  file_.reset(new utils::MappedRecordReader<pb::Record>(filename));
+  if (!file_->Open()) {
+    LOG(ERROR) << "Failed to open " << filename << " for reading";
+    return false;
+  }
+
+  // The metadata is always the first record.
+  pb::Record record;
+  if (!file_->ReadRecord(&record) || !record.has_metadata()) {
+    LOG(ERROR) << filename << " doesn't start with a metadata record";
+    return false;
+  }
+  metadata_ = record.metadata();
+
+  // The last record points to the index.
+  if (file_->size() < kIndexFooterSize ||
+      !file_->Seek(file_->size() - kIndexFooterSize) ||
+      !file_->ReadRecord(&record) ||
+      !record.has_trace_index_offset()) {
+    return false;
+  }
+  if (!file_->Seek(record.trace_index_offset()) ||
+      !file_->ReadRecord(&record) ||
+      !record.has_trace_index()) {
+    LOG(ERROR) << filename << " has a corrupt index";
+    return false;
+  }
+
+  const pb::TraceIndex& index = record.trace_index();
+  process_ids_.clear();
+  process_ids_.reserve(index.process_size());
+  for (const pb::TraceIndex_ProcessOffset& entry : index.process()) {
+    process_ids_.append(entry.id());
+    process_offsets_[entry.id()] = entry.offset();
+  }
+  for (const pb::TraceIndex_FileSetOffset& entry : index.file_set()) {
+    file_set_offsets_[entry.id()] = entry.offset();
+  }
+  for (const pb::TraceIndex_Key& key : index.output()) {
+    processes_by_output_[key.name()] = key.process_id();
+  }
+  for (const pb::TraceIndex_Key& key : index.executable()) {
+    processes_by_executable_[key.name()] = key.process_id();
+  }
+
+  // Load the whole string table up front - it's small compared to the
+  // processes that refer to it.
+  for (qint64 offset : index.string_table_offset()) {
+    pb::Record strings;
+    if (!file_->Seek(offset) ||
+        !file_->ReadRecord(&strings) ||
+        !strings.has_string_table()) {
+      LOG(ERROR) << filename << " has a corrupt index";
+      return false;
+    }
+    strings_.Append(strings.string_table());
+  }
+  return true;
+}
+
+bool IndexedTraceReader::ReadProcess(int id, pb::Process* process) {
+  auto it = process_offsets_.find(id);
+  if (it == process_offsets_.end()) {
+    return false;
+  }
+
+  // The offset may point at string_table and file_set records written just
+  // before the process.  They're read separately.
+  pb::Record record;
+  bool ok = file_->Seek(it.value());
+  do {
+    ok = ok && file_->ReadRecord(&record);
+  } while (ok && (record.has_string_table() || record.has_file_set()));
+  if (!ok || !record.has_process() || record.process().id() != id) {
+    LOG(ERROR) << "Bad index entry for process " << id << " in "
+               << file_->filename();
+    return false;
+  }
+
+  process->Swap(record.mutable_process());
+  strings_.Resolve(process);
+
+  for (const pb::FileSetReference& reference : process->file_set()) {
+    const pb::FileSet* file_set = FileSet(reference.file_set_id());
+    if (file_set == nullptr) {
+      LOG(ERROR) << "Bad file set " << reference.file_set_id()
+                 << " in process " << id << " in " << file_->filename();
+      return false;
     }
+    ExpandFileSet(*file_set, reference, process);
+  }
+  process->clear_file_set();
+  return true;
+}
+
+const pb::FileSet* IndexedTraceReader::FileSet(int id) {
+  auto cached = file_sets_.find(id);
+  if (cached != file_sets_.end()) {
+    return &cached.value();
+  }
+
+  auto it = file_set_offsets_.find(id);
+  if (it == file_set_offsets_.end()) {
+    return nullptr;
+  }
+
+  // The file set may be preceded by the string_table record for its strings.
+  pb::Record record;
+  bool ok = file_->Seek(it.value());
+  do {
+    ok = ok && file_->ReadRecord(&record);
+  } while (ok && record.has_string_table());
+  if (!ok || !record.has_file_set() || record.file_set().id() != id) {
+    return nullptr;
   }
 
-  qSort(events_);
+  pb::FileSet* file_set = &file_sets_[id];
+  file_set->Swap(record.mutable_file_set());
+  strings_.Resolve(file_set);
+  return file_set;
+}
+
+QList<int> IndexedTraceReader::ProcessesWritingFile(
+    const QString& filename) const {
+  return processes_by_output_.value(filename);
+}
+
+QList<int> IndexedTraceReader::ProcessesRunning(
+    const QString& executable) const {
+  return processes_by_executable_.value(executable);
 }
@@ -16,7 +16,15 @@
 #define TRACEREADER_H
 
 #include <memory>
+#include <queue>
+#include <vector>
 
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+
+#include "stringtable.h"
 #include "tracer.pb.h"
 #include "utils/recordfile.h"
 
@@ -31,26 +39,247 @@ struct FileEvent {
 };
 
 
+// Reads a whole trace into memory.  Processes and files are stored in flat
+// arrays of their fields rather than as protos: strings are IDs in a
+// StringTable, and sha1s are IDs of digests stored once each in a single byte
+// array.  Process and File give proto-like access to them.
 class TraceReader {
  public:
+  class File;
+
+  // A process in the trace.  Processes that were filtered out or aren't in the
+  // trace have every field unset, like an empty pb::Process.  Only valid as
+  // long as the TraceReader is.
+  class Process {
+   public:
+    int id() const;
+    bool has_parent_id() const;
+    int parent_id() const;
+    int begin_ordering() const;
+    int end_ordering() const;
+    int exit_code() const;
+    const QString& filename() const;
+    const QString& working_directory() const;
+
+    int argv_size() const;
+    const QString& argv(int i) const;
+    QStringList argv() const;
+
+    QList<int> child_process_id() const;
+
+    // Files read by the process, including the ones in shared file sets.
+    int file_count() const;
+    File file(int index) const;
+
+   private:
+    friend class TraceReader;
+    Process(const TraceReader* reader, int row) : reader_(reader), row_(row) {}
+
+    const TraceReader* reader_;
+    int row_;  // -1 for processes that aren't in the trace.
+  };
+
+  // A file opened by a process.  Only valid as long as the TraceReader is.
+  class File {
+   public:
+    const QString& filename() const;
+    int filename_id() const;  // ID of the filename in strings().
+    bool has_renamed_from() const;
+    const QString& renamed_from() const;
+    pb::File_Access access() const;
+    bool has_sha1_before() const;
+    QByteArray sha1_before() const;
+    bool has_sha1_after() const;
+    QByteArray sha1_after() const;
+
+    // IDs of the digests, for digest(), or -1 if they're unset.
+    int sha1_before_id() const;
+    int sha1_after_id() const;
+    int open_ordering() const;
+    int close_ordering() const;
+
+   private:
+    friend class TraceReader;
+    File(const TraceReader* reader, int row) : reader_(reader), row_(row) {}
+
+    const TraceReader* reader_;
+    int row_;
+  };
+
+  // A process or file decoded from a serialized record.
+  struct DecodedProcess;
+  struct DecodedFile;
+
   TraceReader();
 
   void IgnoreProcessFilenames(std::initializer_list<QString> filename);
   void IgnoreFileExtensions(std::initializer_list<QString> extension);
 
-  void Read(std::unique_ptr<utils::RecordFile<pb::Record>> file);
+  // If sha1 isn't null it's set to a hash of every record read, so a trace
+  // can be identified without reading it again.
+  void Read(std::unique_ptr<utils::RecordReader<pb::Record>> file,
+            QByteArray* sha1 = nullptr);
+
+  // Adds records one at a time as they're written, eg. by a running Tracer.
+  // Events are held back until TakeEvents is called.
+  void AddRecord(const pb::Record& record);
+
+  // Moves the events from AddRecord with an ordering before this one onto the
+  // end of events(), in order.  Returns the index of the first new event.
+  int TakeEvents(int before_ordering);
 
   const pb::MetaData& metadata() const { return metadata_; }
-  QList<FileEvent> events() const { return events_; }
-  const pb::Process& process(int id) const { return processes_by_id_[id]; }
+
+  // Every file opened by the processes that weren't filtered out, ordered by
+  // their close_ordering.
+  const QVector<FileEvent>& events() const { return events_; }
+
+  Process process(int id) const;
+
+  // FileEvent::file_index is an index into these.
+  int file_count(int process_id) const {
+    return process(process_id).file_count();
+  }
+  File file(int process_id, int index) const {
+    return process(process_id).file(index);
+  }
+
+  // Every filename and argument is stored in this table.  Traces without a
+  // string table get IDs assigned as they're read.
+  const StringTable& strings() const { return strings_; }
+
+  // Every sha1 is stored once.  Returns an empty digest for -1.
+  QByteArray digest(int id) const;
 
  private:
+  // Returns false if the serialized process should be filtered out.
+  bool ShouldKeep(const QByteArray& process) const;
+
+  // Decodes the process' serialized bytes into its fields.
+  bool Decode(DecodedProcess* process) const;
+
+  // Handles metadata, string table and file set records.
+  void AddOtherRecord(pb::Record* record);
+
+  // Adds the process to the columns and appends its events, sorted, to events.
+  void AddProcess(DecodedProcess* process, QVector<FileEvent>* events);
+
+  // Adds the process and its files to the columns.
+  void AddColumns(DecodedProcess* process);
+  void AddFile(int filename_id, int renamed_from_id, int access,
+               const QByteArray& sha1_before, const QByteArray& sha1_after,
+               int open_ordering, int close_ordering);
+
+  // Returns the ID, or interns the string if the trace didn't have an ID.
+  int Intern(int id, const QString& str);
+
+  // Returns the ID of the digest in digest_pool_, or -1 if it's empty.
+  int AddDigest(const QByteArray& digest);
+
+  const QString& String(int id) const;
+
+  // Merges the events of each process, which are sorted already, into
+  // events_.
+  void MergeEvents(const QVector<FileEvent>& events,
+                   const QVector<int>& offsets);
+
   QSet<QString> process_blacklist_;
   QSet<QString> file_extension_blacklist_;
 
   pb::MetaData metadata_;
-  QList<FileEvent> events_;
-  QList<pb::Process> processes_by_id_;
+  StringTable strings_;
+  QHash<int, pb::FileSet> file_sets_;
+  QVector<FileEvent> events_;
+
+  // Whether files with each filename ID have an ignored extension.
+  QHash<int, bool> ignored_filenames_;
+
+  // Events from AddRecord that haven't been taken yet, earliest first.
+  struct LaterEvent {
+    bool operator()(const FileEvent& a, const FileEvent& b) const {
+      return b < a;
+    }
+  };
+  std::priority_queue<FileEvent, std::vector<FileEvent>, LaterEvent>
+      pending_events_;
+
+  // Row of each process ID in the process columns, or -1.
+  QVector<int> row_by_id_;
+
+  // Process columns.  Unset fields are -1 (parent_id, *_id) or 0.
+  struct {
+    QVector<int> id;
+    QVector<int> parent_id;
+    QVector<int> begin_ordering;
+    QVector<int> end_ordering;
+    QVector<int> exit_code;
+    QVector<int> filename_id;
+    QVector<int> working_directory_id;
+
+    // The process in row r has the argvs, children and files from
+    // argv_offset[r] to argv_offset[r + 1], etc.
+    QVector<int> argv_offset;
+    QVector<int> child_offset;
+    QVector<int> file_offset;
+  } processes_;
+  QVector<int> argv_ids_;
+  QVector<int> child_ids_;
+
+  // File columns.  Unset IDs are -1.
+  struct {
+    QVector<int> filename_id;
+    QVector<int> renamed_from_id;
+    QVector<int> sha1_before;
+    QVector<int> sha1_after;
+    QVector<int> open_ordering;
+    QVector<int> close_ordering;
+    QVector<quint8> access;
+  } files_;
+
+  // Digest d is the bytes from digest_offset_[d] to digest_offset_[d + 1].
+  QByteArray digest_pool_;
+  QVector<int> digest_offset_;
+
+  // Only used while reading.
+  QHash<QByteArray, int> digest_ids_;
+};
+
+
+// Reads individual processes from a trace without reading the whole file.
+// Only works on traces that end with a TraceIndex.
+class IndexedTraceReader {
+ public:
+  // Returns false if the file couldn't be opened or doesn't have an index.
+  bool Open(const QString& filename);
+
+  const pb::MetaData& metadata() const { return metadata_; }
+
+  // In the order the processes were written to the trace.
+  const QVector<int>& process_ids() const { return process_ids_; }
+
+  // Reads the process and appends the files from any file sets it refers to.
+  bool ReadProcess(int id, pb::Process* process);
+
+  // IDs of the processes that created, modified or renamed the file.
+  QList<int> ProcessesWritingFile(const QString& filename) const;
+
+  // IDs of the processes that ran the executable.  Takes the executable's
+  // filename without its directory.
+  QList<int> ProcessesRunning(const QString& executable) const;
+
+ private:
+  const pb::FileSet* FileSet(int id);
+
+  std::unique_ptr<utils::MappedRecordReader<pb::Record>> file_;
+
+  pb::MetaData metadata_;
+  StringTable strings_;
+  QVector<int> process_ids_;
+  QHash<int, qint64> process_offsets_;
+  QHash<int, qint64> file_set_offsets_;
+  QHash<int, pb::FileSet> file_sets_;
+  QHash<QString, QList<int>> processes_by_output_;
+  QHash<QString, QList<int>> processes_by_executable_;
 };
 
 #endif // TRACEREADER_H
@@ -15,10 +15,20 @@
 #ifndef RECORDFILE_H
 #define RECORDFILE_H
 
+#include <sys/mman.h>
+
+#include <iterator>
+#include <memory>
+
 #include <QDataStream>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QVector>
+#include <QtConcurrentMap>
+#include <QtEndian>
 
+#include "make_unique.h"
 #include "utils/logging.h"
 
 namespace utils {
@@ -30,11 +40,19 @@ class RecordWriter {
 
   virtual void WriteRecord(const T& message) = 0;
 
+  // Returns the offset in the file that the next record will be written at, or
+  // -1 if the writer doesn't write to a seekable file.
+  virtual qint64 Offset() const { return -1; }
+
   template <typename Container>
   void WriteAll(const Container& list);
 };
 
 
+template <typename T>
+class RecordRange;
+
+
 template <typename T>
 class RecordReader {
  public:
@@ -43,8 +61,85 @@ class RecordReader {
   virtual bool AtEnd() const = 0;
   virtual bool ReadRecord(T* message) = 0;
 
+  // Reads the next record's serialized bytes without parsing them.  The bytes
+  // may point into memory owned by the reader, so they're only valid while the
+  // reader is.
+  virtual bool ReadRawRecord(QByteArray* bytes) = 0;
+
   template <typename Container>
   bool ReadAll(Container* list);
+  bool ReadAllRaw(QVector<QByteArray>* list);
+
+  // Iterates over the remaining records one at a time:
+  //   auto records = reader->Records();
+  //   for (const T& record : records) { ... }
+  //   if (!records.ok()) { ... }
+  RecordRange<T> Records() { return RecordRange<T>(this); }
+};
+
+
+// An input range over the records in a RecordReader.  Every record is parsed
+// into the same message, which is cleared between records, so only one record
+// is in memory at a time.  A record must be copied (or swapped out) to keep it
+// after the iterator is incremented.
+template <typename T>
+class RecordRange {
+ public:
+  class iterator {
+   public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef T* pointer;
+    typedef T& reference;
+
+    explicit iterator(RecordRange* range) : range_(range) {}
+
+    T& operator*() const { return range_->message_; }
+    T* operator->() const { return &range_->message_; }
+
+    iterator& operator++() {
+      range_->Next();
+      return *this;
+    }
+
+    bool operator==(const iterator& other) const {
+      return AtEnd() == other.AtEnd();
+    }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+   private:
+    bool AtEnd() const { return range_ == nullptr || range_->done_; }
+
+    RecordRange* range_;
+  };
+
+  explicit RecordRange(RecordReader<T>* reader) : reader_(reader) {}
+
+  iterator begin() {
+    Next();
+    return iterator(this);
+  }
+  iterator end() { return iterator(nullptr); }
+
+  // False if iteration stopped because a record couldn't be read.
+  bool ok() const { return ok_; }
+
+ private:
+  void Next() {
+    message_.Clear();
+    if (reader_->AtEnd()) {
+      done_ = true;
+    } else if (!reader_->ReadRecord(&message_)) {
+      ok_ = false;
+      done_ = true;
+    }
+  }
+
+  RecordReader<T>* reader_;
+  T message_;
+  bool done_ = false;
+  bool ok_ = true;
 };
 
 
@@ -61,9 +156,11 @@ class RecordFile : public RecordReader<T>, public RecordWriter<T> {
   // Reading.
   bool AtEnd() const override;
   bool ReadRecord(T* message) override;
+  bool ReadRawRecord(QByteArray* bytes) override;
 
   // Writing.
   void WriteRecord(const T& message) override;
+  qint64 Offset() const override;
 
   // Convenience functions.
   static QList<T> ReadAllFrom(const QString& filename);
@@ -75,6 +172,113 @@ class RecordFile : public RecordReader<T>, public RecordWriter<T> {
 };
 
 
+// Writes records in the same format as RecordFile, but serializes each message
+// straight into a large reusable buffer and writes the buffer to the file in
+// big unbuffered writes.  Nothing is allocated per record.  The buffer is
+// flushed when it's full and when the writer is destroyed.
+template <typename T>
+class BufferedRecordWriter : public RecordWriter<T> {
+ public:
+  explicit BufferedRecordWriter(const QString& filename,
+                                int buffer_size = 1024 * 1024);
+  ~BufferedRecordWriter();
+
+  QString filename() const { return file_.fileName(); }
+
+  bool Open();
+
+  void WriteRecord(const T& message) override;
+  qint64 Offset() const override { return written_ + used_; }
+
+  // Writes everything in the buffer to the file.
+  bool Flush();
+
+  // Flushes and closes the file.  Returns false if any write to it failed.
+  bool Close();
+
+  // False once a write to the file has failed.  Records written after that
+  // are dropped, so the file only ever holds a prefix of the records.
+  bool ok() const { return ok_; }
+
+ private:
+  QFile file_;
+  QByteArray buffer_;
+  int used_ = 0;
+  qint64 written_ = 0;
+  bool ok_ = true;
+};
+
+
+// Reads records from a memory-mapped file.  Records are parsed directly out of
+// the mapping, so nothing is allocated or copied per record.  Reads the same
+// format as RecordFile: each record is a big-endian 32-bit length followed by
+// the serialized message.
+template <typename T>
+class MappedRecordReader : public RecordReader<T> {
+ public:
+  explicit MappedRecordReader(const QString& filename);
+  ~MappedRecordReader();
+
+  QString filename() const { return file_.fileName(); }
+
+  bool Open();
+
+  bool AtEnd() const override;
+  bool ReadRecord(T* message) override;
+  bool ReadRawRecord(QByteArray* bytes) override;
+
+  // Random access.  The offset must be the start of a record.
+  qint64 size() const { return size_; }
+  qint64 pos() const { return pos_; }
+  bool Seek(qint64 pos);
+
+ private:
+  QFile file_;
+  uchar* data_ = nullptr;
+  qint64 size_ = 0;
+  qint64 pos_ = 0;
+};
+
+
+// Opens a file for reading records.  Regular files are memory-mapped, anything
+// else (eg. a pipe) is read through a RecordFile.  Returns nullptr if the file
+// couldn't be opened.
+template <typename T>
+std::unique_ptr<RecordReader<T>> OpenRecordReader(const QString& filename);
+
+
+// Calls decode on every item on the global QThreadPool, eg. to parse the
+// records from ReadAllRaw.  Each call may only modify its own item.  Returns
+// false if any call returned false.
+template <typename Container, typename Decode>
+bool DecodeParallel(Container* items, Decode decode);
+
+// Parses raw records in parallel into messages, in the same order.
+template <typename T>
+bool ParseRawRecordsParallel(const QVector<QByteArray>& records,
+                             QVector<T>* messages);
+
+
+// Writes every record to two writers.  Offsets are the first writer's.
+template <typename T>
+class TeeRecordWriter : public RecordWriter<T> {
+ public:
+  TeeRecordWriter(std::unique_ptr<RecordWriter<T>> first,
+                  RecordWriter<T>* second)
+      : first_(std::move(first)), second_(second) {}
+
+  void WriteRecord(const T& record) override {
+    first_->WriteRecord(record);
+    second_->WriteRecord(record);
+  }
+  qint64 Offset() const override { return first_->Offset(); }
+
+ private:
+  std::unique_ptr<RecordWriter<T>> first_;
+  RecordWriter<T>* second_;
+};
+
+
 template <typename T>
 class MemoryRecordWriter : public RecordWriter<T> {
  public:
@@ -133,8 +337,28 @@ bool RecordReader<T>::ReadAll(Container* list) {
   return true;
 }
 
+template <typename T>
+bool RecordReader<T>::ReadAllRaw(QVector<QByteArray>* list) {
+  list->clear();
+  while (!AtEnd()) {
+    QByteArray bytes;
+    if (!ReadRawRecord(&bytes)) {
+      return false;
+    }
+    list->append(bytes);
+  }
+  return true;
+}
+
 template <typename T>
 bool RecordFile<T>::AtEnd() const {
+  QIODevice* device = stream_.device();
+  if (device != nullptr && device->isSequential()) {
+    // On a pipe, no data available yet doesn't mean the writer has finished.
+    // Block until there's more data or the pipe is closed.
+    char c;
+    return device->peek(&c, 1) <= 0;
+  }
   return stream_.atEnd();
 }
 
@@ -146,6 +370,12 @@ bool RecordFile<T>::ReadRecord(T* message) {
   return message->ParseFromArray(bytes.constData(), bytes.size());
 }
 
+template <typename T>
+bool RecordFile<T>::ReadRawRecord(QByteArray* bytes) {
+  stream_ >> *bytes;
+  return stream_.status() == QDataStream::Ok;
+}
+
 template <typename T>
 template <typename Container>
 void RecordWriter<T>::WriteAll(const Container& list) {
@@ -162,13 +392,201 @@ void RecordFile<T>::WriteRecord(const T& message) {
   stream_ << bytes;
 }
 
+template <typename T>
+BufferedRecordWriter<T>::BufferedRecordWriter(const QString& filename,
+                                              int buffer_size)
+    : file_(filename) {
+  buffer_.resize(buffer_size);
+}
+
+template <typename T>
+BufferedRecordWriter<T>::~BufferedRecordWriter() {
+  if (file_.isOpen()) {
+    Close();
+  }
+}
+
+template <typename T>
+bool BufferedRecordWriter<T>::Open() {
+  // QFile's own buffer would just copy everything again.
+  used_ = 0;
+  written_ = 0;
+  ok_ = true;
+  return file_.open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+template <typename T>
+bool BufferedRecordWriter<T>::Close() {
+  Flush();
+  file_.close();
+  return ok_;
+}
+
+template <typename T>
+void BufferedRecordWriter<T>::WriteRecord(const T& message) {
+  if (!ok_) {
+    return;
+  }
+
+  // ByteSize() caches the sizes of every submessage, so serializing doesn't
+  // have to compute them again.
+  const int size = message.ByteSize();
+  const int needed = sizeof(quint32) + size;
+
+  if (buffer_.size() - used_ < needed) {
+    if (!Flush()) {
+      return;
+    }
+    if (buffer_.size() < needed) {
+      // Keep the bigger buffer for the next large record.
+      buffer_.resize(needed);
+    }
+  }
+
+  uchar* out = reinterpret_cast<uchar*>(buffer_.data()) + used_;
+  qToBigEndian<quint32>(size, out);
+  message.SerializeWithCachedSizesToArray(out + sizeof(quint32));
+  used_ += needed;
+}
+
+template <typename T>
+bool BufferedRecordWriter<T>::Flush() {
+  const char* data = buffer_.constData();
+  int remaining = used_;
+  while (remaining > 0) {
+    const qint64 ret = file_.write(data, remaining);
+    if (ret <= 0) {
+      LOG(ERROR) << "Failed to write to " << file_.fileName() << ": "
+                 << file_.errorString();
+      used_ = 0;
+      ok_ = false;
+      return false;
+    }
+    data += ret;
+    remaining -= ret;
+    written_ += ret;
+  }
+  used_ = 0;
+  return true;
+}
+
+template <typename T>
+MappedRecordReader<T>::MappedRecordReader(const QString& filename)
+    : file_(filename) {
+}
+
+template <typename T>
+MappedRecordReader<T>::~MappedRecordReader() {
+  if (data_ != nullptr) {
+    file_.unmap(data_);
+  }
+}
+
+template <typename T>
+bool MappedRecordReader<T>::Open() {
+  if (!file_.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+
+  size_ = file_.size();
+  pos_ = 0;
+  if (size_ == 0) {
+    // Empty files can't be mapped.
+    return true;
+  }
+
+  data_ = file_.map(0, size_);
+  if (data_ == nullptr) {
+    return false;
+  }
+
+  // Records are read from start to end, so let the kernel read ahead.
+  madvise(data_, size_, MADV_SEQUENTIAL);
+  return true;
+}
+
+template <typename T>
+bool MappedRecordReader<T>::AtEnd() const {
+  return pos_ >= size_;
+}
+
+template <typename T>
+bool MappedRecordReader<T>::ReadRecord(T* message) {
+  QByteArray bytes;
+  if (!ReadRawRecord(&bytes)) {
+    return false;
+  }
+  return message->ParseFromArray(bytes.constData(), bytes.size());
+}
+
+template <typename T>
+bool MappedRecordReader<T>::ReadRawRecord(QByteArray* bytes) {
+  if (size_ - pos_ < qint64(sizeof(quint32))) {
+    pos_ = size_;
+    return false;
+  }
+
+  quint32 length = qFromBigEndian<quint32>(data_ + pos_);
+  pos_ += sizeof(quint32);
+
+  // QDataStream writes a null QByteArray with a length of 0xffffffff.
+  if (length == 0xffffffff) {
+    length = 0;
+  }
+
+  if (size_ - pos_ < qint64(length)) {
+    // Truncated file.
+    pos_ = size_;
+    return false;
+  }
+
+  *bytes = QByteArray::fromRawData(
+      reinterpret_cast<const char*>(data_ + pos_), length);
+  pos_ += length;
+  return true;
+}
+
+template <typename T>
+bool MappedRecordReader<T>::Seek(qint64 pos) {
+  if (pos < 0 || pos > size_) {
+    return false;
+  }
+  pos_ = pos;
+  return true;
+}
+
+template <typename T>
+std::unique_ptr<RecordReader<T>> OpenRecordReader(const QString& filename) {
+  if (QFileInfo(filename).isFile()) {
+    auto mapped = make_unique<MappedRecordReader<T>>(filename);
+    if (mapped->Open()) {
+      return std::move(mapped);
+    }
+  }
+
+  auto file = make_unique<RecordFile<T>>(filename);
+  if (file->Open(QFile::ReadOnly)) {
+    return std::move(file);
+  }
+  return nullptr;
+}
+
+template <typename T>
+qint64 RecordFile<T>::Offset() const {
+  const QIODevice* device = stream_.device();
+  if (device == nullptr || device->isSequential()) {
+    return -1;
+  }
+  return device->pos();
+}
+
 template <typename T>
 QList<T> RecordFile<T>::ReadAllFrom(const QString& filename) {
   QList<T> ret;
 
-  RecordFile<T> file(filename);
-  if (file.Open(QFile::ReadOnly)) {
-    if (!file.ReadAll(&ret)) {
+  auto file = OpenRecordReader<T>(filename);
+  if (file) {
+    if (!file->ReadAll(&ret)) {
       LOG(ERROR) << "Failed to read records from: " << filename;
     }
   }
@@ -177,8 +595,8 @@ QList<T> RecordFile<T>::ReadAllFrom(const QString& filename) {
 
 template <typename T>
 void RecordFile<T>::WriteAllTo(const QList<T>& records, const QString& filename) {
-  RecordFile<T> file(filename);
-  if (!file.Open(QFile::WriteOnly)) {
+  BufferedRecordWriter<T> file(filename);
+  if (!file.Open()) {
     LOG(ERROR) << "Failed to open " << filename << " for writing";
     return;
   }
@@ -186,6 +604,42 @@ void RecordFile<T>::WriteAllTo(const QList<T>& records, const QString& filename)
   file.WriteAll(records);
 }
 
+template <typename Container, typename Decode>
+bool DecodeParallel(Container* items, Decode decode) {
+  QAtomicInt failed(0);
+  QtConcurrent::blockingMap(
+      *items, [&decode, &failed](typename Container::value_type& item) {
+    if (!decode(item)) {
+      failed.store(1);
+    }
+  });
+  return failed.load() == 0;
+}
+
+template <typename T>
+bool ParseRawRecordsParallel(const QVector<QByteArray>& records,
+                             QVector<T>* messages) {
+  struct Span {
+    const QByteArray* bytes;
+    T* message;
+  };
+
+  messages->clear();
+  messages->resize(records.count());
+  QVector<Span> spans;
+  spans.reserve(records.count());
+  for (int i = 0; i < records.count(); ++i) {
+    spans.append(Span{&records[i], messages->data() + i});
+  }
+
+  // Each record is parsed into its own slot, so the messages are in order
+  // without any merging.
+  return DecodeParallel(&spans, [](Span& span) {
+    return span.message->ParseFromArray(span.bytes->constData(),
+                                        span.bytes->size());
+  });
+}
+
 }  // namespace utils
 
 #endif // RECORDFILE_H
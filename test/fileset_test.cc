@@ -0,0 +1,94 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryFile>
+
+#include "fileset.h"
+#include "make_unique.h"
+#include "stringtable.h"
+#include "testutil.h"
+#include "tracer.pb.h"
+#include "tracereader.h"
+#include "utils/recordfile.h"
+
+using testutil::CompileRecord;
+
+class FileSetTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_TRUE(file_.open());
+    file_.close();
+  }
+
+  void Write(const QList<pb::Record>& records) {
+    std::unique_ptr<utils::RecordFile<pb::Record>> file(
+        new utils::RecordFile<pb::Record>(file_.fileName()));
+    ASSERT_TRUE(file->Open(QFile::WriteOnly));
+
+    FileSetWriter writer(make_unique<StringTableWriter>(
+        std::unique_ptr<utils::RecordWriter<pb::Record>>(file.release())));
+    for (const pb::Record& record : records) {
+      writer.WriteRecord(record);
+    }
+  }
+
+  QTemporaryFile file_;
+};
+
+TEST_F(FileSetTest, SharedFilesAreWrittenOnce) {
+  Write({CompileRecord(1, 0), CompileRecord(2, 100)});
+
+  int file_sets = 0;
+  for (const pb::Record& record :
+       utils::RecordFile<pb::Record>::ReadAllFrom(file_.fileName())) {
+    if (record.has_file_set()) {
+      ++file_sets;
+    } else if (record.has_process()) {
+      EXPECT_EQ(1, record.process().files_size());
+      EXPECT_EQ(1, record.process().file_set_size());
+    }
+  }
+  EXPECT_EQ(1, file_sets);
+}
+
+TEST_F(FileSetTest, TraceReaderExpandsFileSets) {
+  const pb::Record original = CompileRecord(1, 0);
+  Write({original});
+
+  TraceReader reader;
+  reader.Read(utils::OpenRecordReader<pb::Record>(file_.fileName()));
+
+  ASSERT_EQ(5, reader.file_count(1));
+  QSet<QString> filenames;
+  for (int i = 0; i < reader.file_count(1); ++i) {
+    filenames.insert(reader.file(1, i).filename());
+  }
+  for (const pb::File& file : original.process().files()) {
+    EXPECT_TRUE(filenames.contains(file.filename())) << file.filename();
+  }
+
+  // Events are still ordered by each file's close ordering in the process.
+  const QVector<FileEvent>& events = reader.events();
+  ASSERT_EQ(5, events.count());
+  for (const FileEvent& event : events) {
+    const QString filename = reader.file(1, event.file_index).filename();
+    for (const pb::File& file : original.process().files()) {
+      if (file.filename() == filename) {
+        EXPECT_EQ(file.close_ordering(), event.ordering) << filename;
+      }
+    }
+  }
+}
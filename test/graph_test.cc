@@ -0,0 +1,369 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <QString>
+#include <QTextStream>
+
+#include "graph.h"
+
+namespace {
+
+class Node {
+ public:
+  Node() {}
+  explicit Node(const QString& id, int value = 0) : id_(id), value_(value) {}
+
+  using KeyType = QString;
+
+  QString ID() const { return id_; }
+  KeyType Key() const { return id_; }
+  QString IndexKey() const { return id_.left(1); }
+  QString LookupKey() const { return QString::number(value_); }
+  int value() const { return value_; }
+  void WriteDot(QTextStream& os) const { os << "label=\"" << value_ << "\""; }
+
+ private:
+  QString id_;
+  int value_ = 0;
+};
+
+// Matches nodes whose IDs start with a prefix.
+class PatternNode {
+ public:
+  PatternNode() {}
+  PatternNode(const QString& id, const QString& prefix, bool exact_incoming,
+              bool exact_outgoing)
+      : id_(id),
+        prefix_(prefix),
+        exact_incoming_(exact_incoming),
+        exact_outgoing_(exact_outgoing) {}
+
+  using KeyType = QString;
+
+  QString ID() const { return id_; }
+  KeyType Key() const { return id_; }
+  QString IndexKey() const { return QString(); }
+  QString LookupKey() const { return QString(); }
+  bool Match(const Node& node) const { return node.ID().startsWith(prefix_); }
+  bool ExactIncomingNeighbourCount() const { return exact_incoming_; }
+  bool ExactOutgoingNeighbourCount() const { return exact_outgoing_; }
+  QStringList CandidateIndexKeys() const { return {prefix_.left(1)}; }
+
+ private:
+  QString id_;
+  QString prefix_;
+  bool exact_incoming_ = false;
+  bool exact_outgoing_ = false;
+};
+
+// A node found by an integer key, whose ID is only built when it's asked for.
+class NumberNode {
+ public:
+  NumberNode() {}
+  explicit NumberNode(int number) : number_(number) {}
+
+  using KeyType = int;
+
+  QString ID() const { return "n" + QString::number(number_); }
+  KeyType Key() const { return number_; }
+  QString IndexKey() const { return QString(); }
+  QString LookupKey() const { return QString(); }
+  void WriteDot(QTextStream& os) const { os << "label=\"" << number_ << "\""; }
+
+ private:
+  int number_ = 0;
+};
+
+QStringList IDs(const QList<Node>& nodes) {
+  QStringList ret;
+  for (const Node& node : nodes) {
+    ret.append(node.ID());
+  }
+  ret.sort();
+  return ret;
+}
+
+}  // namespace
+
+TEST(GraphTest, AddAndRemove) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("a"), Node("b"), Node("c")});
+  graph.AddEdge(Node("a"), Node("c"));
+  graph.AddEdge(Node("a"), Node("c"));
+
+  EXPECT_EQ(3, graph.count());
+  EXPECT_EQ(3, graph.AllEdges().count());
+  EXPECT_EQ((QStringList{"b", "c"}), IDs(graph.Outgoing(Node("a"))));
+  EXPECT_EQ((QStringList{"a", "b"}), IDs(graph.Incoming(Node("c"))));
+
+  graph.RemoveEdge(Node("a"), Node("c"));
+  EXPECT_EQ((QStringList{"b"}), IDs(graph.Outgoing(Node("a"))));
+
+  graph.RemoveNode(Node("b"));
+  EXPECT_EQ(2, graph.count());
+  EXPECT_FALSE(graph.HasNode(Node("b")));
+  EXPECT_TRUE(graph.Outgoing(Node("a")).isEmpty());
+  EXPECT_TRUE(graph.Incoming(Node("c")).isEmpty());
+  EXPECT_TRUE(graph.AllEdges().isEmpty());
+}
+
+TEST(GraphTest, AddNodeReplacesValue) {
+  Graph<Node> graph;
+  graph.AddEdge(Node("a", 1), Node("b"));
+  graph.AddNode(Node("a", 2));
+
+  ASSERT_EQ(1, graph.Incoming(Node("b")).count());
+  EXPECT_EQ(2, graph.Incoming(Node("b"))[0].value());
+}
+
+TEST(GraphTest, Handles) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("b"), Node("a")});
+
+  // Handles are listed in ID order, not insertion order.
+  const QVector<Graph<Node>::Handle> handles = graph.AllHandles();
+  ASSERT_EQ(2, handles.count());
+  EXPECT_EQ("a", graph.id(handles[0]));
+  EXPECT_EQ("b", graph.node(handles[1]).ID());
+  EXPECT_EQ(-1, graph.FindHandle("c"));
+
+  const Graph<Node>::Handle a = graph.FindHandle("a");
+  const Graph<Node>::Handle b = graph.FindHandle("b");
+  EXPECT_EQ(1, graph.IncomingCount(a));
+  EXPECT_EQ(0, graph.OutgoingCount(a));
+  EXPECT_TRUE(graph.OutgoingHandles(a).empty());
+  for (Graph<Node>::Handle handle : graph.IncomingHandles(a)) {
+    EXPECT_EQ(b, handle);
+  }
+}
+
+TEST(GraphTest, FindsNodesByKey) {
+  Graph<NumberNode> graph;
+  graph.AddEdges({NumberNode(9), NumberNode(10), NumberNode(2)});
+
+  EXPECT_EQ(-1, graph.FindHandle(3));
+  const Graph<NumberNode>::Handle ten = graph.FindHandle(10);
+  ASSERT_NE(-1, ten);
+  EXPECT_EQ("n10", graph.id(ten));
+  EXPECT_EQ(1, graph.IncomingCount(ten));
+  EXPECT_EQ(1, graph.OutgoingCount(ten));
+
+  // Nodes are still visited in ID order rather than key order.
+  QStringList ids;
+  for (Graph<NumberNode>::Handle handle : graph.AllHandles()) {
+    ids.append(graph.id(handle));
+  }
+  EXPECT_EQ((QStringList{"n10", "n2", "n9"}), ids);
+
+  QString dot;
+  QTextStream os(&dot);
+  graph.WriteDot(os);
+  os.flush();
+  EXPECT_EQ("digraph {\n"
+            "  \"n10\" [label=\"10\"];\n"
+            "  \"n2\" [label=\"2\"];\n"
+            "  \"n9\" [label=\"9\"];\n"
+            "  \"n9\" -> \"n10\";\n"
+            "  \"n10\" -> \"n2\";\n"
+            "}\n", dot);
+
+  graph.RemoveEdge(NumberNode(9), NumberNode(10));
+  graph.RemoveNode(NumberNode(2));
+  EXPECT_EQ(-1, graph.FindHandle(2));
+  EXPECT_EQ(0, graph.IncomingCount(ten));
+  EXPECT_EQ(0, graph.OutgoingCount(ten));
+}
+
+TEST(GraphTest, ReplaceSubgraph) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("in"), Node("a"), Node("b"), Node("out")});
+  graph.AddEdge(Node("in"), Node("b"));
+
+  graph.ReplaceSubgraph({Node("a"), Node("b")}, Node("ab"));
+
+  EXPECT_EQ((QStringList{"ab", "in", "out"}), IDs(graph.AllNodes()));
+  EXPECT_EQ((QStringList{"ab"}), IDs(graph.Outgoing(Node("in"))));
+  EXPECT_EQ((QStringList{"out"}), IDs(graph.Outgoing(Node("ab"))));
+  EXPECT_EQ(2, graph.AllEdges().count());
+}
+
+TEST(GraphTest, ManyRemovals) {
+  // Enough removals to compact the edge storage.
+  Graph<Node> graph;
+  for (int i = 0; i < 5000; ++i) {
+    graph.AddEdge(Node("root"), Node(QString::number(i)));
+  }
+  for (int i = 0; i < 5000; i += 2) {
+    graph.RemoveNode(Node(QString::number(i)));
+  }
+
+  EXPECT_EQ(2501, graph.count());
+  EXPECT_EQ(2500, graph.Outgoing(Node("root")).count());
+  EXPECT_EQ(2500, graph.OutgoingCount(graph.FindHandle("root")));
+  EXPECT_EQ((QStringList{"root"}), IDs(graph.Incoming(Node("1"))));
+}
+
+TEST(GraphTest, FindSubgraphMatches) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("src1"), Node("proc1"), Node("out1")});
+  graph.AddEdges({Node("src2"), Node("proc2"), Node("out2")});
+  graph.AddEdge(Node("proc2"), Node("out3"));
+  graph.AddEdges({Node("src3"), Node("x"), Node("out4")});
+
+  Graph<PatternNode> subgraph;
+  subgraph.AddEdges({
+      PatternNode("input", "src", false, false),
+      PatternNode("proc", "proc", false, true),
+      PatternNode("output", "out", true, false),
+  });
+
+  // proc2 has two outputs, so only proc1 matches.
+  const auto matches = graph.FindSubgraphMatches(subgraph);
+  ASSERT_EQ(1, matches.count());
+  EXPECT_EQ("src1", matches[0]["input"].ID());
+  EXPECT_EQ("proc1", matches[0]["proc"].ID());
+  EXPECT_EQ("out1", matches[0]["output"].ID());
+
+  graph.RemoveEdge(Node("proc2"), Node("out3"));
+  EXPECT_EQ(2, graph.FindSubgraphMatches(subgraph).count());
+}
+
+TEST(GraphTest, FindAndReplaceSubgraphRunsUntilNoMatches) {
+  // Only the head of the chain matches, so this needs one round per node.
+  Graph<Node> graph;
+  for (int i = 1; i < 500; ++i) {
+    graph.AddEdge(Node("p" + QString::number(i - 1)),
+                  Node("p" + QString::number(i)));
+  }
+
+  Graph<PatternNode> subgraph;
+  subgraph.AddEdges({
+      PatternNode("head", "p", true, false),
+      PatternNode("next", "p", false, false),
+  });
+
+  int replacements = 0;
+  graph.FindAndReplaceSubgraph(subgraph, [&graph, &replacements](
+      const QMap<QString, Node>& match) {
+    graph.ReplaceSubgraph({match["head"], match["next"]},
+                          Node("pm" + QString::number(++replacements)));
+  });
+
+  EXPECT_EQ(499, replacements);
+  ASSERT_EQ(1, graph.count());
+  EXPECT_TRUE(graph.AllEdges().isEmpty());
+}
+
+TEST(GraphTest, FindSubgraphMatchesInParallel) {
+  // Enough candidates to be split across threads.
+  Graph<Node> graph;
+  for (int i = 0; i < 2000; ++i) {
+    const QString suffix = QString::number(i);
+    graph.AddEdges({Node("src" + suffix), Node("proc" + suffix),
+                    Node("out" + suffix)});
+  }
+
+  Graph<PatternNode> subgraph;
+  subgraph.AddEdges({
+      PatternNode("input", "src", false, false),
+      PatternNode("proc", "proc", false, true),
+      PatternNode("output", "out", true, false),
+  });
+
+  // Matches are in the same order as a single-threaded search would find
+  // them.
+  const auto matches = graph.FindSubgraphMatches(subgraph);
+  ASSERT_EQ(2000, matches.count());
+  for (int i = 1; i < matches.count(); ++i) {
+    EXPECT_LT(matches[i - 1]["proc"].ID(), matches[i]["proc"].ID());
+  }
+}
+
+TEST(GraphTest, FindAndReplaceSubgraphSkipsOverlappingMatches) {
+  // Both "a" processes read the same source file.
+  Graph<Node> graph;
+  graph.AddEdges({Node("src"), Node("a1"), Node("out1")});
+  graph.AddEdges({Node("src"), Node("a2"), Node("out2")});
+
+  Graph<PatternNode> subgraph;
+  subgraph.AddEdges({
+      PatternNode("input", "src", false, false),
+      PatternNode("proc", "a", false, true),
+  });
+
+  QStringList replaced;
+  graph.FindAndReplaceSubgraph(subgraph, [&graph, &replaced](
+      const QMap<QString, Node>& match) {
+    replaced.append(match["proc"].ID());
+    graph.ReplaceSubgraph({match["proc"]}, Node("b" + match["proc"].ID()));
+  });
+
+  EXPECT_EQ((QStringList{"a1", "a2"}), replaced);
+  EXPECT_EQ((QStringList{"ba1", "ba2"}), IDs(graph.Outgoing(Node("src"))));
+}
+
+TEST(GraphTest, FindAndReplaceSubgraphsUsesPriorityOrder) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("src"), Node("ar"), Node("out"), Node("ranlib")});
+
+  Graph<PatternNode> ar_ranlib;
+  ar_ranlib.AddEdges({
+      PatternNode("ar", "ar", false, true),
+      PatternNode("output", "out", true, false),
+      PatternNode("ranlib", "ranlib", true, false),
+  });
+  Graph<PatternNode> ar;
+  ar.AddEdges({
+      PatternNode("ar", "ar", false, true),
+      PatternNode("output", "out", true, false),
+  });
+
+  QStringList replaced;
+  QList<Graph<Node>::Rewrite<Graph<PatternNode>>> rewrites;
+  rewrites.append({ar_ranlib, [&graph, &replaced](
+      const QMap<QString, Node>& match) {
+    replaced.append("ar_ranlib");
+    graph.ReplaceSubgraph({match["ar"], match["ranlib"]}, Node("link"));
+  }});
+  rewrites.append({ar, [&graph, &replaced](const QMap<QString, Node>& match) {
+    replaced.append("ar");
+    graph.ReplaceSubgraph({match["ar"]}, Node("link"));
+  }});
+  graph.FindAndReplaceSubgraphs(rewrites);
+
+  EXPECT_EQ((QStringList{"ar_ranlib"}), replaced);
+  EXPECT_EQ((QStringList{"link", "out", "src"}), IDs(graph.AllNodes()));
+}
+
+TEST(GraphTest, FindByLookupKey) {
+  Graph<Node> graph;
+  graph.AddEdges({Node("b", 1), Node("a", 1), Node("c", 2)});
+
+  QVector<Graph<Node>::Handle> handles = graph.FindByLookupKey("1");
+  ASSERT_EQ(2, handles.count());
+  EXPECT_EQ("a", graph.id(handles[0]));
+  EXPECT_EQ("b", graph.id(handles[1]));
+
+  // The index follows changes to the graph.
+  graph.ReplaceSubgraph({Node("a", 1)}, Node("d", 2));
+  graph.AddNode(Node("c", 3));
+  graph.RemoveNode(Node("b"));
+  EXPECT_TRUE(graph.FindByLookupKey("1").isEmpty());
+  handles = graph.FindByLookupKey("2");
+  ASSERT_EQ(1, handles.count());
+  EXPECT_EQ("d", graph.id(handles[0]));
+  EXPECT_EQ(1, graph.FindByLookupKey("3").count());
+}
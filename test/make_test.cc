@@ -0,0 +1,505 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThreadPool>
+
+#include "analysis/make.h"
+#include "testutil.h"
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
+using testutil::AddFile;
+using testutil::Process;
+
+class MakeTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_TRUE(dir_.isValid());
+    utils::RecordFile<pb::Record>::WriteAllTo({}, Path("install.files"));
+  }
+
+  QString Path(const QString& name) const {
+    return dir_.path() + "/" + name;
+  }
+
+  analysis::Make::Options Options(const QString& name) const {
+    analysis::Make::Options opts;
+    opts.trace_filename = Path(name + ".trace");
+    opts.install_filename = Path("install.files");
+    opts.output_filename = Path(name + ".targets");
+    opts.intermediate_graph_output_filename =
+        Path(name + ".intermediate.dot");
+    return opts;
+  }
+
+  // cp reads a.in and writes b.mid while another cp turns b.mid into c.out.
+  // c.out is renamed to d.out and then read along with a.in to make e.out.
+  static QList<pb::Record> CopyProcesses() {
+    pb::Record p1 = Process(1, "/bin/cp", 1, 9);
+    AddFile(&p1, "a.in", pb::File_Access_READ, "a", 2);
+    AddFile(&p1, "b.mid", pb::File_Access_CREATED, "b", 3);
+
+    pb::Record p2 = Process(2, "/bin/cp", 4, 8);
+    AddFile(&p2, "b.mid", pb::File_Access_READ, "b", 5);
+    AddFile(&p2, "c.out", pb::File_Access_CREATED, "c", 6);
+
+    pb::Record p3 = Process(3, "/bin/mv", 10, 12);
+    AddFile(&p3, "d.out", pb::File_Access_CREATED, "c", 11)
+        ->set_renamed_from("c.out");
+
+    pb::Record p4 = Process(4, "/bin/cp", 13, 18);
+    AddFile(&p4, "d.out", pb::File_Access_READ, "c", 14);
+    AddFile(&p4, "a.in", pb::File_Access_READ, "a", 15);
+    AddFile(&p4, "e.out", pb::File_Access_CREATED, "e", 16);
+
+    return {p1, p2, p3, p4};
+  }
+
+  void WriteTrace(const QString& name,
+                  const QList<pb::Record>& processes) const {
+    QList<pb::Record> trace{testutil::Metadata("/src")};
+    trace.append(processes);
+    utils::RecordFile<pb::Record>::WriteAllTo(trace, Path(name + ".trace"));
+  }
+
+  // Feeds the processes to a live analysis in the order they exited, telling
+  // it about each exit the way the Tracer does.
+  static void FeedLive(const QList<pb::Record>& processes,
+                       analysis::Make* make) {
+    QList<pb::Record> by_end = processes;
+    std::stable_sort(by_end.begin(), by_end.end(),
+                     [](const pb::Record& a, const pb::Record& b) {
+      return a.process().end_ordering() < b.process().end_ordering();
+    });
+
+    for (const pb::Record& record : by_end) {
+      const int end = record.process().end_ordering();
+      make->live_writer()->WriteRecord(record);
+
+      // Files can't be opened before a still running process began.
+      int ordering = end + 1;
+      for (const pb::Record& other : processes) {
+        if (other.process().begin_ordering() < end &&
+            other.process().end_ordering() > end) {
+          ordering = std::min(ordering, other.process().begin_ordering());
+        }
+      }
+      make->ProcessExited(ordering);
+    }
+  }
+
+  // The lines of a dot file, sorted so edges added in a different order still
+  // compare equal.
+  static QStringList SortedLines(const QString& filename) {
+    QFile file(filename);
+    EXPECT_TRUE(file.open(QIODevice::ReadOnly));
+    QStringList ret = QTextStream(&file).readAll().split('\n');
+    ret.sort();
+    return ret;
+  }
+
+  // Appends a compiler driver and the cc1 and as processes it runs to compile
+  // source into object, in the order they exit.  Every file's hash is its
+  // name, so the same file written twice can be told apart by name.
+  void AddCompile(QList<pb::Record>* trace, const QString& source,
+                  const QStringList& flags, const QString& object) {
+    const int driver_id = next_id_++;
+    const int driver_begin = next_ordering_++;
+    const QString assembly =
+        QString("/tmp/cc%1.s").arg(driver_id);
+
+    pb::Record cc1 = Process(next_id_++, "/usr/lib/gcc/cc1",
+                             next_ordering_++, 0);
+    cc1.mutable_process()->set_parent_id(driver_id);
+    AddFile(&cc1, source, pb::File_Access_READ, source.toUtf8(),
+            next_ordering_++);
+    AddFile(&cc1, assembly, pb::File_Access_CREATED, assembly.toUtf8(),
+            next_ordering_++);
+    cc1.mutable_process()->set_end_ordering(next_ordering_++);
+
+    pb::Record as = Process(next_id_++, "/usr/bin/as", next_ordering_++, 0);
+    as.mutable_process()->set_parent_id(driver_id);
+    AddFile(&as, assembly, pb::File_Access_READ, assembly.toUtf8(),
+            next_ordering_++);
+    AddFile(&as, object, pb::File_Access_CREATED, object.toUtf8(),
+            next_ordering_++);
+    as.mutable_process()->set_end_ordering(next_ordering_++);
+
+    // cc isn't one of the drivers ToolSearchPath runs to find search paths.
+    pb::Record driver = Process(driver_id, "/usr/bin/cc", driver_begin,
+                                next_ordering_++);
+    for (const QString& arg :
+         flags + QStringList{"-c", source, "-o", object}) {
+      driver.mutable_process()->add_argv(arg);
+    }
+    trace->append({cc1, as, driver});
+  }
+
+  void AddStaticLink(QList<pb::Record>* trace, const QStringList& objects,
+                     const QString& library) {
+    pb::Record ar = Process(next_id_++, "/usr/bin/ar", next_ordering_++, 0);
+    for (const QString& object : objects) {
+      AddFile(&ar, object, pb::File_Access_READ, object.toUtf8(),
+              next_ordering_++);
+    }
+    AddFile(&ar, library, pb::File_Access_CREATED, library.toUtf8(),
+            next_ordering_++);
+    ar.mutable_process()->set_end_ordering(next_ordering_++);
+    trace->append(ar);
+  }
+
+  // A libtool-like build: every source is compiled with and without -fPIC,
+  // and both of foo's objects are archived into a libfoo.a.  Removing the
+  // duplicate compiles makes the two archives duplicates too, so it takes
+  // more than one round.
+  QList<pb::Record> LibtoolProcesses() {
+    QList<pb::Record> ret;
+    for (const QString& name : {"foo", "bar"}) {
+      AddCompile(&ret, name + ".c", {"-fPIC", "-DPIC", "-O2"},
+                 ".libs/" + name + ".o");
+      AddCompile(&ret, name + ".c", {"-O2"}, name + ".o");
+    }
+    AddStaticLink(&ret, {".libs/foo.o"}, ".libs/libfoo.a");
+    AddStaticLink(&ret, {"foo.o"}, "libfoo.a");
+    return ret;
+  }
+
+  QByteArray ReadFile(const QString& filename) const {
+    QFile file(filename);
+    EXPECT_TRUE(file.open(QIODevice::ReadOnly)) << filename.toStdString();
+    return file.readAll();
+  }
+
+  // Analyzes the same trace on every call, sharing one graph cache.
+  analysis::Make::Options CachedOptions(const QString& name) const {
+    analysis::Make::Options opts = Options(name);
+    opts.trace_filename = Path("cached.trace");
+    opts.graph_output_filename = Path(name + ".dot");
+    opts.graph_cache_filename = Path("graph.cache");
+    return opts;
+  }
+
+  QList<pb::GraphSnapshot> ReadCache() const {
+    return utils::RecordFile<pb::GraphSnapshot>::ReadAllFrom(
+        Path("graph.cache"));
+  }
+
+  // Keeps only the first snapshot in the cache, the one taken just after the
+  // graph was built, with its edges removed.  If a run uses it the graph it
+  // writes has no edges.
+  void WriteBuiltSnapshotWithoutEdges() const {
+    QList<pb::GraphSnapshot> snapshot;
+    for (pb::GraphSnapshot record : ReadCache()) {
+      if (record.has_header()) {
+        if (!snapshot.isEmpty()) {
+          break;
+        }
+        record.mutable_header()->set_edge_count(0);
+      }
+      if (record.edge_size() == 0) {
+        snapshot.append(record);
+      }
+    }
+    utils::RecordFile<pb::GraphSnapshot>::WriteAllTo(snapshot,
+                                                     Path("graph.cache"));
+  }
+
+  static int EdgeCount(const QString& dot_filename) {
+    return SortedLines(dot_filename).filter(" -> ").count();
+  }
+
+  QTemporaryDir dir_;
+  int next_id_ = 1;
+  int next_ordering_ = 1;
+};
+
+TEST_F(MakeTest, LiveAnalysisBuildsTheSameGraph) {
+  const QList<pb::Record> processes = CopyProcesses();
+  WriteTrace("batch", processes);
+  ASSERT_TRUE(analysis::Make::Run(Options("batch")));
+
+  std::unique_ptr<analysis::Make> make =
+      analysis::Make::StartLive(Options("live"));
+  make->live_writer()->WriteRecord(testutil::Metadata("/src"));
+  FeedLive(processes, make.get());
+  ASSERT_TRUE(make->FinishLive());
+
+  const QStringList batch = SortedLines(Path("batch.intermediate.dot"));
+  EXPECT_GT(batch.count(), 10);
+  EXPECT_EQ(batch, SortedLines(Path("live.intermediate.dot")));
+}
+
+TEST_F(MakeTest, LiveAnalysisDoesNotNeedInstalledFiles) {
+  pb::Record p1 = Process(1, "/bin/cp", 1, 4);
+  AddFile(&p1, "a.in", pb::File_Access_READ, "a", 2);
+  AddFile(&p1, "b.out", pb::File_Access_CREATED, "b", 3);
+
+  analysis::Make::Options opts = Options("live");
+  opts.install_filename = Path("missing.files");
+  std::unique_ptr<analysis::Make> make = analysis::Make::StartLive(opts);
+  make->live_writer()->WriteRecord(testutil::Metadata("/src"));
+  FeedLive({p1}, make.get());
+  EXPECT_TRUE(make->FinishLive());
+  EXPECT_TRUE(QFile::exists(Path("live.targets")));
+}
+
+TEST_F(MakeTest, GraphCacheRoundTrip) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+
+  const QList<pb::GraphSnapshot> cache = ReadCache();
+  ASSERT_FALSE(cache.isEmpty());
+  ASSERT_TRUE(cache.first().has_header());
+  EXPECT_EQ(pb::GraphSnapshot_Stage_BUILT, cache.first().header().stage());
+  EXPECT_GT(cache.first().header().node_count(), 0);
+  EXPECT_GT(cache.first().header().edge_count(), 0);
+  EXPECT_GT(EdgeCount(Path("first.intermediate.dot")), 0);
+
+  // Every stage is cached, so the second run goes straight to the targets.
+  // The intermediate graph is still written, from the built snapshot.
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_EQ(SortedLines(Path("first.intermediate.dot")),
+            SortedLines(Path("second.intermediate.dot")));
+  EXPECT_EQ(SortedLines(Path("first.dot")), SortedLines(Path("second.dot")));
+
+  // Reading back just the built graph gives the same nodes and edges.
+  QList<pb::GraphSnapshot> built;
+  for (const pb::GraphSnapshot& record : cache) {
+    if (record.has_header() && !built.isEmpty()) {
+      break;
+    }
+    built.append(record);
+  }
+  utils::RecordFile<pb::GraphSnapshot>::WriteAllTo(built, Path("graph.cache"));
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("third")));
+  EXPECT_EQ(SortedLines(Path("first.intermediate.dot")),
+            SortedLines(Path("third.intermediate.dot")));
+  EXPECT_EQ(SortedLines(Path("first.dot")), SortedLines(Path("third.dot")));
+}
+
+TEST_F(MakeTest, GraphCacheIsUsed) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+  WriteBuiltSnapshotWithoutEdges();
+
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_EQ(0, EdgeCount(Path("second.intermediate.dot")));
+}
+
+TEST_F(MakeTest, GraphCacheWithWrongVersionIsIgnored) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+  WriteBuiltSnapshotWithoutEdges();
+
+  QList<pb::GraphSnapshot> cache = ReadCache();
+  cache.first().mutable_header()->set_version(
+      cache.first().header().version() + 1);
+  utils::RecordFile<pb::GraphSnapshot>::WriteAllTo(cache, Path("graph.cache"));
+
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_EQ(SortedLines(Path("first.intermediate.dot")),
+            SortedLines(Path("second.intermediate.dot")));
+}
+
+TEST_F(MakeTest, GraphCacheFromDifferentAnalysisIsIgnored) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+  WriteBuiltSnapshotWithoutEdges();
+
+  QList<pb::GraphSnapshot> cache = ReadCache();
+  EXPECT_EQ(20, cache.first().header().analysis_sha1().size());
+  cache.first().mutable_header()->set_analysis_sha1("older analysis");
+  utils::RecordFile<pb::GraphSnapshot>::WriteAllTo(cache, Path("graph.cache"));
+
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_EQ(SortedLines(Path("first.intermediate.dot")),
+            SortedLines(Path("second.intermediate.dot")));
+}
+
+TEST_F(MakeTest, GraphCacheWithWrongTraceIsIgnored) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+  WriteBuiltSnapshotWithoutEdges();
+
+  // The same trace with one process left out.
+  WriteTrace("cached", CopyProcesses().mid(0, 3));
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_GT(EdgeCount(Path("second.intermediate.dot")), 0);
+
+  // A cache whose header names a different trace.
+  WriteBuiltSnapshotWithoutEdges();
+  QList<pb::GraphSnapshot> cache = ReadCache();
+  cache.first().mutable_header()->set_trace_sha1("not the trace");
+  utils::RecordFile<pb::GraphSnapshot>::WriteAllTo(cache, Path("graph.cache"));
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("third")));
+  EXPECT_EQ(SortedLines(Path("second.intermediate.dot")),
+            SortedLines(Path("third.intermediate.dot")));
+}
+
+TEST_F(MakeTest, TruncatedGraphCacheIsIgnored) {
+  WriteTrace("cached", CopyProcesses());
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("first")));
+  WriteBuiltSnapshotWithoutEdges();
+
+  QFile file(Path("graph.cache"));
+  ASSERT_TRUE(file.resize(file.size() - 3));
+
+  ASSERT_TRUE(analysis::Make::Run(CachedOptions("second")));
+  EXPECT_EQ(SortedLines(Path("first.intermediate.dot")),
+            SortedLines(Path("second.intermediate.dot")));
+}
+
+TEST_F(MakeTest, MergesBaseTargets) {
+  // A partial rebuild of two static libraries, with their objects copied into
+  // place.
+  pb::Record cp = Process(1, "/bin/cp", 1, 6);
+  AddFile(&cp, "a.in", pb::File_Access_READ, "a", 2);
+  AddFile(&cp, "foo.o", pb::File_Access_CREATED, "foo", 3);
+  AddFile(&cp, "gen.o", pb::File_Access_CREATED, "gen", 4);
+
+  pb::Record ar_foo = Process(2, "/usr/bin/ar", 7, 10);
+  AddFile(&ar_foo, "foo.o", pb::File_Access_READ, "foo", 8);
+  AddFile(&ar_foo, "libfoo.a", pb::File_Access_CREATED, "libfoo", 9);
+
+  pb::Record ar_baz = Process(3, "/usr/bin/ar", 11, 14);
+  AddFile(&ar_baz, "gen.o", pb::File_Access_READ, "gen", 12);
+  AddFile(&ar_baz, "sub/libbaz.a", pb::File_Access_CREATED, "libbaz", 13);
+  WriteTrace("merge", {cp, ar_foo, ar_baz});
+
+  auto base_target = [](const QString& name, const QString& output) {
+    pb::Record record;
+    record.mutable_build_target()->set_qualified_name(name);
+    pb::Reference* ref = record.mutable_build_target()->add_outputs();
+    ref->set_type(pb::Reference_Type_RELATIVE_TO_PROJECT_ROOT);
+    ref->set_name(output);
+    return record;
+  };
+  pb::Record libbar = base_target("//:libbar", "libbar.a");
+  libbar.mutable_build_target()->mutable_c_link()->add_flag("-base");
+  utils::RecordFile<pb::Record>::WriteAllTo({
+      base_target("//:foo_lib", "libfoo.a"),
+      libbar,
+      base_target("//sub:libbaz", "other/x.a"),
+      base_target("//:gen", "gen.o"),
+  }, Path("base.targets"));
+
+  analysis::Make::Options opts = Options("merge");
+  opts.base_targets_filename = Path("base.targets");
+  analysis::Make::Output output;
+  ASSERT_TRUE(analysis::Make::Run(opts, &output));
+
+  QMap<QString, pb::BuildTarget> targets;
+  for (const pb::BuildTarget& target : output.build_targets) {
+    EXPECT_FALSE(targets.contains(target.qualified_name()))
+        << target.qualified_name().toStdString();
+    targets[target.qualified_name()] = target;
+  }
+  EXPECT_EQ((QStringList{"//:foo_lib", "//:gen", "//:libbar", "//sub:libbaz",
+                         "//sub:libbaz_1"}),
+            targets.keys());
+
+  // The rebuilt library keeps its base name.
+  const pb::BuildTarget& foo = targets["//:foo_lib"];
+  EXPECT_TRUE(foo.c_link().is_library());
+  ASSERT_EQ(1, foo.srcs_size());
+  EXPECT_EQ("foo.o", foo.srcs(0).name());
+
+  // Base targets that weren't rebuilt are unchanged.
+  EXPECT_EQ(libbar.build_target().SerializeAsString(),
+            targets["//:libbar"].SerializeAsString());
+  EXPECT_EQ(base_target("//sub:libbaz", "other/x.a")
+                .build_target().SerializeAsString(),
+            targets["//sub:libbaz"].SerializeAsString());
+
+  // The new library gets a name that isn't taken, and its object is found in
+  // the base targets' outputs.
+  const pb::BuildTarget& baz = targets["//sub:libbaz_1"];
+  ASSERT_EQ(1, baz.outputs_size());
+  EXPECT_EQ("sub/libbaz.a", baz.outputs(0).name());
+  ASSERT_EQ(1, baz.srcs_size());
+  EXPECT_EQ(pb::Reference_Type_BUILD_TARGET, baz.srcs(0).type());
+  EXPECT_EQ("//:gen", baz.srcs(0).name());
+}
+
+TEST_F(MakeTest, ParallelTargetGenerationMatchesSequential) {
+  WriteTrace("libtool", LibtoolProcesses());
+
+  analysis::Make::Options opts = Options("sequential");
+  opts.trace_filename = Path("libtool.trace");
+  analysis::Make::Output output;
+  QThreadPool* pool = QThreadPool::globalInstance();
+  const int max_threads = pool->maxThreadCount();
+  pool->setMaxThreadCount(1);
+  const bool ok = analysis::Make::Run(opts, &output);
+  pool->setMaxThreadCount(max_threads);
+  ASSERT_TRUE(ok);
+
+  // Each duplicate compile and archive was removed.
+  QStringList names;
+  for (const pb::BuildTarget& target : output.build_targets) {
+    names.append(target.qualified_name());
+  }
+  names.sort();
+  EXPECT_EQ((QStringList{"//:bar", "//:foo", "//:libfoo"}), names);
+
+  opts = Options("parallel");
+  opts.trace_filename = Path("libtool.trace");
+  ASSERT_TRUE(analysis::Make::Run(opts));
+
+  const QByteArray sequential = ReadFile(Path("sequential.targets"));
+  EXPECT_FALSE(sequential.isEmpty());
+  EXPECT_EQ(sequential, ReadFile(Path("parallel.targets")));
+}
+
+TEST_F(MakeTest, IncrementalTargetsMatchFullRegeneration) {
+  WriteTrace("libtool", LibtoolProcesses());
+
+  analysis::Make::Options opts = Options("incremental");
+  opts.trace_filename = Path("libtool.trace");
+  ASSERT_TRUE(analysis::Make::Run(opts));
+
+  opts = Options("full");
+  opts.trace_filename = Path("libtool.trace");
+  opts.incremental_targets = false;
+  ASSERT_TRUE(analysis::Make::Run(opts));
+
+  const QByteArray incremental = ReadFile(Path("incremental.targets"));
+  EXPECT_FALSE(incremental.isEmpty());
+  EXPECT_EQ(incremental, ReadFile(Path("full.targets")));
+}
+
+TEST_F(MakeTest, StepsWithoutTargetsAreNotDuplicates) {
+  // The second compile has a flag GccBuildTargetGen doesn't understand, so it
+  // has no target.  It used to be grouped with the first target, and since
+  // its output has the shorter name it replaced that target.
+  QList<pb::Record> processes;
+  AddCompile(&processes, "bar.c", {"-O2"}, "bar.o");
+  AddCompile(&processes, "baz.c", {"--unknown-flag"}, "b.o");
+  WriteTrace("untargeted", processes);
+
+  analysis::Make::Output output;
+  ASSERT_TRUE(analysis::Make::Run(Options("untargeted"), &output));
+  ASSERT_EQ(1, output.build_targets.count());
+  EXPECT_EQ("//:bar", output.build_targets[0].qualified_name());
+  ASSERT_EQ(1, output.build_targets[0].outputs_size());
+  EXPECT_EQ("bar.o", output.build_targets[0].outputs(0).name());
+}
@@ -0,0 +1,255 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryFile>
+#include <QThreadPool>
+
+#include "tracer.pb.h"
+#include "utils/recordfile.h"
+
+class RecordFileTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_TRUE(file_.open());
+    file_.close();
+  }
+
+  void Write(const QList<pb::Record>& records) {
+    utils::RecordFile<pb::Record>::WriteAllTo(records, file_.fileName());
+  }
+
+  static pb::Record ProcessRecord(int id, const QString& filename) {
+    pb::Record record;
+    record.mutable_process()->set_id(id);
+    record.mutable_process()->set_filename(filename);
+    return record;
+  }
+
+  QTemporaryFile file_;
+};
+
+TEST_F(RecordFileTest, MappedReaderReadsRecordFile) {
+  Write({ProcessRecord(0, "gcc"), pb::Record(), ProcessRecord(1, "ld")});
+
+  utils::MappedRecordReader<pb::Record> reader(file_.fileName());
+  ASSERT_TRUE(reader.Open());
+
+  QList<pb::Record> records;
+  ASSERT_TRUE(reader.ReadAll(&records));
+  ASSERT_EQ(3, records.count());
+  EXPECT_EQ(0, records[0].process().id());
+  EXPECT_EQ("gcc", records[0].process().filename());
+  EXPECT_FALSE(records[1].has_process());
+  EXPECT_EQ(1, records[2].process().id());
+  EXPECT_EQ("ld", records[2].process().filename());
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+TEST_F(RecordFileTest, MappedReaderEmptyFile) {
+  utils::MappedRecordReader<pb::Record> reader(file_.fileName());
+  ASSERT_TRUE(reader.Open());
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+TEST_F(RecordFileTest, MappedReaderTruncatedFile) {
+  Write({ProcessRecord(0, "gcc"), ProcessRecord(1, "ld")});
+  ASSERT_TRUE(file_.resize(file_.size() - 1));
+
+  utils::MappedRecordReader<pb::Record> reader(file_.fileName());
+  ASSERT_TRUE(reader.Open());
+
+  pb::Record record;
+  EXPECT_TRUE(reader.ReadRecord(&record));
+  EXPECT_FALSE(reader.ReadRecord(&record));
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+TEST_F(RecordFileTest, OpenRecordReader) {
+  Write({ProcessRecord(0, "gcc")});
+
+  auto reader = utils::OpenRecordReader<pb::Record>(file_.fileName());
+  ASSERT_TRUE(reader != nullptr);
+
+  pb::Record record;
+  ASSERT_TRUE(reader->ReadRecord(&record));
+  EXPECT_EQ("gcc", record.process().filename());
+  EXPECT_TRUE(reader->AtEnd());
+
+  EXPECT_TRUE(utils::OpenRecordReader<pb::Record>(
+      file_.fileName() + ".missing") == nullptr);
+}
+
+TEST_F(RecordFileTest, SeekToWrittenOffset) {
+  QList<qint64> offsets;
+  {
+    utils::RecordFile<pb::Record> writer(file_.fileName());
+    ASSERT_TRUE(writer.Open(QFile::WriteOnly));
+    for (int i = 0; i < 3; ++i) {
+      offsets.append(writer.Offset());
+      writer.WriteRecord(ProcessRecord(i, "proc" + QString::number(i)));
+    }
+  }
+  EXPECT_EQ(0, offsets[0]);
+
+  utils::MappedRecordReader<pb::Record> reader(file_.fileName());
+  ASSERT_TRUE(reader.Open());
+
+  pb::Record record;
+  ASSERT_TRUE(reader.Seek(offsets[2]));
+  ASSERT_TRUE(reader.ReadRecord(&record));
+  EXPECT_EQ(2, record.process().id());
+  EXPECT_TRUE(reader.AtEnd());
+
+  ASSERT_TRUE(reader.Seek(offsets[1]));
+  ASSERT_TRUE(reader.ReadRecord(&record));
+  EXPECT_EQ(1, record.process().id());
+
+  EXPECT_FALSE(reader.Seek(reader.size() + 1));
+}
+
+TEST_F(RecordFileTest, ParseRawRecordsParallelKeepsOrder) {
+  QList<pb::Record> written;
+  for (int i = 0; i < 1000; ++i) {
+    written.append(ProcessRecord(i, "proc" + QString::number(i)));
+  }
+  Write(written);
+
+  auto parse = [this](int max_threads) {
+    QThreadPool* pool = QThreadPool::globalInstance();
+    const int old_max_threads = pool->maxThreadCount();
+    pool->setMaxThreadCount(max_threads);
+
+    QVector<pb::Record> records;
+    utils::MappedRecordReader<pb::Record> reader(file_.fileName());
+    QVector<QByteArray> raw;
+    EXPECT_TRUE(reader.Open());
+    EXPECT_TRUE(reader.ReadAllRaw(&raw));
+    EXPECT_TRUE(utils::ParseRawRecordsParallel(raw, &records));
+
+    pool->setMaxThreadCount(old_max_threads);
+    return records;
+  };
+
+  const QVector<pb::Record> one_thread = parse(1);
+  const QVector<pb::Record> many_threads = parse(8);
+  ASSERT_EQ(written.count(), one_thread.count());
+  ASSERT_EQ(written.count(), many_threads.count());
+  for (int i = 0; i < written.count(); ++i) {
+    EXPECT_EQ(written[i].SerializeAsString(),
+              one_thread[i].SerializeAsString());
+    EXPECT_EQ(written[i].SerializeAsString(),
+              many_threads[i].SerializeAsString());
+  }
+}
+
+TEST_F(RecordFileTest, ParseRawRecordsParallelFails) {
+  const QByteArray valid =
+      QByteArray::fromStdString(ProcessRecord(0, "gcc").SerializeAsString());
+  QVector<pb::Record> records;
+  EXPECT_FALSE(utils::ParseRawRecordsParallel(
+      QVector<QByteArray>{valid, QByteArray("\xff\xff\xff")}, &records));
+}
+
+TEST_F(RecordFileTest, BufferedWriterMatchesRecordFile) {
+  QList<pb::Record> records;
+  for (int i = 0; i < 100; ++i) {
+    records.append(ProcessRecord(i, QString(i, 'x')));
+  }
+  records.append(pb::Record());
+  Write(records);
+
+  QFile expected(file_.fileName());
+  ASSERT_TRUE(expected.open(QIODevice::ReadOnly));
+  const QByteArray expected_bytes = expected.readAll();
+
+  QTemporaryFile buffered_file;
+  ASSERT_TRUE(buffered_file.open());
+  buffered_file.close();
+
+  QList<qint64> offsets;
+  {
+    // A tiny buffer so that it's flushed often and has to grow for the larger
+    // records.
+    utils::BufferedRecordWriter<pb::Record> writer(buffered_file.fileName(),
+                                                   16);
+    ASSERT_TRUE(writer.Open());
+    for (const pb::Record& record : records) {
+      offsets.append(writer.Offset());
+      writer.WriteRecord(record);
+    }
+  }
+
+  ASSERT_TRUE(buffered_file.open());
+  EXPECT_EQ(expected_bytes, buffered_file.readAll());
+
+  utils::MappedRecordReader<pb::Record> reader(buffered_file.fileName());
+  ASSERT_TRUE(reader.Open());
+
+  pb::Record record;
+  ASSERT_TRUE(reader.Seek(offsets[50]));
+  ASSERT_TRUE(reader.ReadRecord(&record));
+  EXPECT_EQ(50, record.process().id());
+}
+
+TEST_F(RecordFileTest, BufferedWriterReportsWriteErrors) {
+  // Every write to /dev/full fails with ENOSPC.
+  utils::BufferedRecordWriter<pb::Record> writer("/dev/full", 16);
+  ASSERT_TRUE(writer.Open());
+  EXPECT_TRUE(writer.ok());
+
+  for (int i = 0; i < 10; ++i) {
+    writer.WriteRecord(ProcessRecord(i, "gcc"));
+  }
+  EXPECT_FALSE(writer.ok());
+  EXPECT_FALSE(writer.Close());
+}
+
+TEST_F(RecordFileTest, RecordsRange) {
+  Write({ProcessRecord(0, "gcc"), pb::Record(), ProcessRecord(1, "ld")});
+
+  auto reader = utils::OpenRecordReader<pb::Record>(file_.fileName());
+  ASSERT_TRUE(reader != nullptr);
+
+  QList<pb::Record> records;
+  auto range = reader->Records();
+  for (const pb::Record& record : range) {
+    records.append(record);
+  }
+  EXPECT_TRUE(range.ok());
+  ASSERT_EQ(3, records.count());
+  EXPECT_EQ("gcc", records[0].process().filename());
+
+  // The message is cleared between records.
+  EXPECT_FALSE(records[1].has_process());
+  EXPECT_EQ("ld", records[2].process().filename());
+}
+
+TEST_F(RecordFileTest, RecordsRangeTruncatedFile) {
+  Write({ProcessRecord(0, "gcc"), ProcessRecord(1, "ld")});
+  ASSERT_TRUE(file_.resize(file_.size() - 1));
+
+  auto reader = utils::OpenRecordReader<pb::Record>(file_.fileName());
+  ASSERT_TRUE(reader != nullptr);
+
+  int count = 0;
+  auto range = reader->Records();
+  for (const pb::Record& record : range) {
+    EXPECT_EQ(0, record.process().id());
+    ++count;
+  }
+  EXPECT_EQ(1, count);
+  EXPECT_FALSE(range.ok());
+}
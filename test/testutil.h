@@ -0,0 +1,93 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "tracer.pb.h"
+
+// Builders for the trace records used by the tests.
+namespace testutil {
+
+inline pb::Record Metadata(const QString& project_root) {
+  pb::Record record;
+  record.mutable_metadata()->set_project_root(project_root);
+  record.mutable_metadata()->set_project_name("project");
+  return record;
+}
+
+// A process that ran filename with no other arguments.
+inline pb::Record Process(int id, const QString& filename) {
+  pb::Record record;
+  pb::Process* process = record.mutable_process();
+  process->set_id(id);
+  process->set_filename(filename);
+  process->add_argv(filename);
+  return record;
+}
+
+inline pb::Record Process(int id, const QString& filename,
+                          int begin, int end) {
+  pb::Record record = Process(id, filename);
+  record.mutable_process()->set_begin_ordering(begin);
+  record.mutable_process()->set_end_ordering(end);
+  return record;
+}
+
+// Adds a file to the process in record.  sha1 is the file's contents before
+// it was read or after it was written, depending on access.
+inline pb::File* AddFile(pb::Record* record, const QString& filename,
+                         pb::File_Access access, const QByteArray& sha1,
+                         int open, int close) {
+  pb::File* file = record->mutable_process()->add_files();
+  file->set_filename(filename);
+  file->set_access(access);
+  if (access == pb::File_Access_READ) {
+    file->set_sha1_before(sha1);
+  } else {
+    file->set_sha1_after(sha1);
+  }
+  file->set_open_ordering(open);
+  file->set_close_ordering(close);
+  return file;
+}
+
+inline pb::File* AddFile(pb::Record* record, const QString& filename,
+                         pb::File_Access access, const QByteArray& sha1,
+                         int ordering) {
+  return AddFile(record, filename, access, sha1, ordering, ordering);
+}
+
+// A cc1 process that reads the same four system headers as every other
+// compile and writes its own assembly file, starting at first_ordering.
+inline pb::Record CompileRecord(int id, int first_ordering) {
+  pb::Record record = Process(id, "/usr/bin/cc1");
+
+  int ordering = first_ordering;
+  for (const QString& name : {"stdio.h", "stdlib.h", "string.h", "errno.h"}) {
+    AddFile(&record, "/usr/include/" + name, pb::File_Access_READ,
+            "sha1 of " + name.toUtf8(), ordering, ordering + 1);
+    ordering += 2;
+  }
+  AddFile(&record, "foo" + QString::number(id) + ".s",
+          pb::File_Access_CREATED, "output", ordering, ordering + 1);
+  return record;
+}
+
+}  // namespace testutil
+
+#endif  // TESTUTIL_H
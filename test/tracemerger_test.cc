@@ -0,0 +1,127 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryDir>
+
+#include "testutil.h"
+#include "tracemerger.h"
+#include "tracer.pb.h"
+#include "tracereader.h"
+#include "utils/recordfile.h"
+
+using testutil::AddFile;
+using testutil::Metadata;
+using testutil::Process;
+
+class TraceMergerTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_TRUE(dir_.isValid());
+  }
+
+  QString Filename(const QString& name) const {
+    return dir_.path() + "/" + name + ".trace";
+  }
+
+  TraceReader Merge(const QStringList& inputs) {
+    TraceMerger::Options opts;
+    for (const QString& input : inputs) {
+      opts.input_filenames.append(Filename(input));
+    }
+    opts.output_filename = Filename("merged");
+    EXPECT_TRUE(TraceMerger::Run(opts));
+
+    TraceReader reader;
+    reader.Read(utils::OpenRecordReader<pb::Record>(opts.output_filename));
+    return reader;
+  }
+
+  QTemporaryDir dir_;
+};
+
+TEST_F(TraceMergerTest, RenumbersProcesses) {
+  pb::Record a_child = Process(1, "/usr/bin/gcc", 1, 2);
+  pb::Record a_root = Process(0, "/usr/bin/gcc", 0, 3);
+  a_root.mutable_process()->add_child_process_id(1);
+  a_child.mutable_process()->set_parent_id(0);
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/a"), a_child, a_root}, Filename("a"));
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/a"), Process(0, "/usr/bin/gcc", 0, 1)}, Filename("b"));
+
+  TraceReader reader = Merge({"a", "b"});
+  EXPECT_EQ("/a", reader.metadata().project_root());
+  EXPECT_EQ(0, reader.process(1).parent_id());
+  EXPECT_EQ(QList<int>{1}, reader.process(0).child_process_id());
+  EXPECT_EQ(2, reader.process(2).id());
+  EXPECT_FALSE(reader.process(2).has_parent_id());
+
+  // Each input's orderings stay in the same order.
+  EXPECT_LT(reader.process(0).begin_ordering(),
+            reader.process(1).begin_ordering());
+  EXPECT_LT(reader.process(1).end_ordering(),
+            reader.process(0).end_ordering());
+  EXPECT_LT(reader.process(2).begin_ordering(),
+            reader.process(2).end_ordering());
+}
+
+TEST_F(TraceMergerTest, ReadsAreOrderedAfterWritesInOtherTraces) {
+  // a writes foo.o late in its trace, b reads it at the start of its trace.
+  pb::Record writer = Process(0, "/usr/bin/gcc", 0, 9);
+  AddFile(&writer, "foo.o", pb::File_Access_CREATED, "sha1", 7, 8);
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/a"), writer}, Filename("a"));
+
+  pb::Record reader_process = Process(0, "/usr/bin/gcc", 0, 3);
+  AddFile(&reader_process, "/b/foo.o", pb::File_Access_READ, "sha1", 1, 2);
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/b"), reader_process}, Filename("b"));
+
+  TraceReader reader = Merge({"a", "b"});
+  const QVector<FileEvent>& events = reader.events();
+  ASSERT_EQ(2, events.count());
+
+  // The write is first, and the read's filename is relative to the merged
+  // project root.
+  EXPECT_EQ(0, events[0].process_id);
+  EXPECT_EQ(1, events[1].process_id);
+  EXPECT_EQ("foo.o", reader.file(1, 0).filename());
+  EXPECT_LT(reader.file(0, 0).close_ordering(),
+            reader.file(1, 0).open_ordering());
+}
+
+TEST_F(TraceMergerTest, RebasesPathsInArguments) {
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/a"), Process(0, "/usr/bin/gcc", 0, 1)}, Filename("a"));
+
+  pb::Record gcc = Process(0, "/usr/bin/gcc", 0, 1);
+  gcc.mutable_process()->set_working_directory("/b/sub");
+  const QStringList args{"-I/b/include", "-o", "/b/out.o", "/b",
+                         "-Wl,-rpath,/b/lib", "-DDIR=/b/share",
+                         "/bx/keep.c", "/other/b/keep.c"};
+  for (const QString& arg : args) {
+    gcc.mutable_process()->add_argv(arg);
+  }
+  utils::RecordFile<pb::Record>::WriteAllTo(
+      {Metadata("/b"), gcc}, Filename("b"));
+
+  TraceReader reader = Merge({"a", "b"});
+  EXPECT_EQ("/a/sub", reader.process(1).working_directory());
+  EXPECT_EQ((QStringList{"/usr/bin/gcc", "-I/a/include", "-o", "/a/out.o", "/a",
+                         "-Wl,-rpath,/a/lib", "-DDIR=/a/share",
+                         "/bx/keep.c", "/other/b/keep.c"}),
+            reader.process(1).argv());
+}
@@ -19,7 +19,12 @@
 #include <QTemporaryDir>
 #include <QTemporaryFile>
 
+#include "fileset.h"
+#include "make_unique.h"
+#include "stringtable.h"
 #include "tracer.h"
+#include "tracereader.h"
+#include "utils/recordfile.h"
 
 class TracerTest : public ::testing::Test {
  protected:
@@ -210,3 +215,88 @@ TEST_F(TracerTest, OpenAtDirectory) {
   EXPECT_FALSE(d.has_sha1_before());
   EXPECT_FALSE(d.has_sha1_after());
 }
+
+TEST_F(TracerTest, WritesAnIndex) {
+  QTemporaryDir dir;
+  const QStringList inputs{"a", "b", "c", "d"};
+  for (const QString& name : inputs) {
+    QFile f(dir.path() + "/" + name);
+    WriteFile(&f, name);
+  }
+  const QString trace_filename = dir.path() + "/index.trace";
+
+  // Write the trace through the same writers as a real trace.  The second cat
+  // reads the same files as the first, so they're written as a shared file
+  // set before the first cat's process record.
+  {
+    auto file = make_unique<utils::BufferedRecordWriter<pb::Record>>(
+        trace_filename);
+    ASSERT_TRUE(file->Open());
+    pb::Record metadata;
+    metadata.mutable_metadata()->set_project_root("/foo");
+    file->WriteRecord(metadata);
+
+    tracer_.reset(new Tracer(
+        "/foo", make_unique<FileSetWriter>(
+                    make_unique<StringTableWriter>(std::move(file)))));
+    Run(Tracer::Subprocess(
+        {"/bin/sh", "-c", "cat a b c d > /dev/null; cat a b c d > out"},
+        dir.path()));
+    tracer_.reset();
+  }
+
+  QList<pb::Record> records =
+      utils::RecordFile<pb::Record>::ReadAllFrom(trace_filename);
+  int string_tables = 0;
+  int file_sets = 0;
+  QVector<int> written_ids;
+  for (const pb::Record& record : records) {
+    string_tables += record.has_string_table();
+    file_sets += record.has_file_set();
+    if (record.has_process()) {
+      written_ids.append(record.process().id());
+    }
+  }
+  EXPECT_GT(string_tables, 0);
+  EXPECT_GT(file_sets, 0);
+
+  IndexedTraceReader index;
+  ASSERT_TRUE(index.Open(trace_filename));
+  EXPECT_EQ("/foo", index.metadata().project_root());
+
+  // Every process can be read, skipping the records written before it.
+  const QVector<int>& ids = index.process_ids();
+  EXPECT_EQ(written_ids, ids);
+  EXPECT_GE(ids.count(), 3);
+  for (int id : ids) {
+    pb::Process process;
+    ASSERT_TRUE(index.ReadProcess(id, &process));
+    EXPECT_EQ(id, process.id());
+    EXPECT_EQ(0, process.file_set_size());
+  }
+
+  const QList<int> cats = index.ProcessesRunning("cat");
+  ASSERT_EQ(2, cats.count());
+  for (int id : cats) {
+    pb::Process process;
+    ASSERT_TRUE(index.ReadProcess(id, &process));
+    EXPECT_TRUE(process.filename().endsWith("/cat"));
+
+    // The inputs come back from the file set with their hashes.
+    QStringList read;
+    for (const pb::File& file : process.files()) {
+      if (file.filename().startsWith(dir.path()) &&
+          file.access() == pb::File_Access_READ) {
+        EXPECT_TRUE(file.has_sha1_before()) << file.filename().toStdString();
+        read.append(file.filename().mid(dir.path().length() + 1));
+      }
+    }
+    read.sort();
+    EXPECT_EQ(inputs, read);
+  }
+
+  const QList<int> writers = index.ProcessesWritingFile(dir.path() + "/out");
+  ASSERT_EQ(1, writers.count());
+  EXPECT_EQ(cats[1], writers[0]);
+  EXPECT_TRUE(index.ProcessesWritingFile(dir.path() + "/a").isEmpty());
+}
@@ -0,0 +1,180 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryFile>
+#include <QThreadPool>
+
+#include "testutil.h"
+#include "tracer.pb.h"
+#include "tracereader.h"
+#include "utils/recordfile.h"
+
+using testutil::AddFile;
+using testutil::Process;
+
+class TraceReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_TRUE(file_.open());
+    file_.close();
+  }
+
+  void Read(const QList<pb::Record>& records) {
+    utils::RecordFile<pb::Record>::WriteAllTo(records, file_.fileName());
+    reader_.Read(utils::OpenRecordReader<pb::Record>(file_.fileName()));
+  }
+
+  QTemporaryFile file_;
+  TraceReader reader_;
+};
+
+TEST_F(TraceReaderTest, ReadsProcessesAndFiles) {
+  pb::Record gcc = Process(1, "/usr/bin/gcc");
+  gcc.mutable_process()->set_parent_id(0);
+  gcc.mutable_process()->add_argv("foo.c");
+  AddFile(&gcc, "foo.c", pb::File_Access_READ, "sha1", 2);
+  AddFile(&gcc, "foo.h", pb::File_Access_READ, "sha1", 1);
+
+  pb::Record metadata;
+  metadata.mutable_metadata()->set_project_root("/src");
+  Read({metadata, gcc});
+
+  EXPECT_EQ("/src", reader_.metadata().project_root());
+
+  const TraceReader::Process process = reader_.process(1);
+  EXPECT_EQ(1, process.id());
+  EXPECT_EQ(0, process.parent_id());
+  EXPECT_EQ("/usr/bin/gcc", process.filename());
+  EXPECT_EQ((QStringList{"/usr/bin/gcc", "foo.c"}), process.argv());
+  ASSERT_EQ(2, process.file_count());
+  EXPECT_EQ("foo.c", process.file(0).filename());
+  EXPECT_EQ(QByteArray("sha1"), process.file(0).sha1_before());
+  EXPECT_FALSE(process.file(0).has_sha1_after());
+
+  // Events are ordered by close_ordering, not by their order in the process.
+  const QVector<FileEvent>& events = reader_.events();
+  ASSERT_EQ(2, events.count());
+  EXPECT_EQ(1, events[0].file_index);
+  EXPECT_EQ(0, events[1].file_index);
+}
+
+TEST_F(TraceReaderTest, Filters) {
+  reader_.IgnoreProcessFilenames({"make"});
+  reader_.IgnoreFileExtensions({"h"});
+
+  pb::Record make = Process(0, "/usr/bin/make");
+  AddFile(&make, "Makefile", pb::File_Access_READ, "sha1", 0);
+  pb::Record gcc = Process(1, "/usr/bin/gcc");
+  AddFile(&gcc, "foo.c", pb::File_Access_READ, "sha1", 1);
+  AddFile(&gcc, "foo.h", pb::File_Access_READ, "sha1", 2);
+  pb::Record no_argv = Process(2, "/bin/true");
+  no_argv.mutable_process()->clear_argv();
+  Read({make, gcc, no_argv});
+
+  // Filtered processes look empty.
+  EXPECT_EQ(0, reader_.process(0).file_count());
+  EXPECT_TRUE(reader_.process(0).filename().isEmpty());
+  EXPECT_EQ(0, reader_.process(2).argv_size());
+
+  // Ignored files are still in the process, but don't have events.
+  EXPECT_EQ(2, reader_.process(1).file_count());
+  const QVector<FileEvent>& events = reader_.events();
+  ASSERT_EQ(1, events.count());
+  EXPECT_EQ(1, events[0].process_id);
+  EXPECT_EQ(0, events[0].file_index);
+}
+
+TEST_F(TraceReaderTest, HashesRecords) {
+  auto sha1 = [this](const QList<pb::Record>& records) {
+    utils::RecordFile<pb::Record>::WriteAllTo(records, file_.fileName());
+    QByteArray ret;
+    TraceReader().Read(utils::OpenRecordReader<pb::Record>(file_.fileName()),
+                       &ret);
+    return ret;
+  };
+
+  pb::Record gcc = Process(1, "/usr/bin/gcc");
+  AddFile(&gcc, "foo.c", pb::File_Access_READ, "sha1", 1);
+  pb::Record ld = Process(2, "/usr/bin/ld");
+  AddFile(&ld, "foo.o", pb::File_Access_READ, "sha1", 2);
+
+  const QByteArray both = sha1({gcc, ld});
+  EXPECT_EQ(20, both.size());
+  EXPECT_EQ(both, sha1({gcc, ld}));
+  EXPECT_NE(both, sha1({gcc}));
+  EXPECT_NE(both, sha1({ld, gcc}));
+}
+
+TEST_F(TraceReaderTest, SameResultOnOneThread) {
+  QList<pb::Record> records;
+  for (int i = 0; i < 200; ++i) {
+    pb::Record process = Process(i, i % 2 ? "/usr/bin/gcc" : "/usr/bin/ld");
+    AddFile(&process, "in" + QString::number(i), pb::File_Access_READ, "sha1",
+            2 * i);
+    AddFile(&process, "in" + QString::number(i + 1), pb::File_Access_READ,
+            "sha1", 2 * i + 1);
+    records.append(process);
+  }
+  utils::RecordFile<pb::Record>::WriteAllTo(records, file_.fileName());
+
+  auto read = [this](int max_threads) {
+    QThreadPool* pool = QThreadPool::globalInstance();
+    const int old_max_threads = pool->maxThreadCount();
+    pool->setMaxThreadCount(max_threads);
+    TraceReader reader;
+    reader.Read(utils::OpenRecordReader<pb::Record>(file_.fileName()));
+    pool->setMaxThreadCount(old_max_threads);
+
+    QStringList ret;
+    for (const FileEvent& event : reader.events()) {
+      ret.append(QString("%1 %2 %3").arg(event.process_id)
+                     .arg(reader.file(event.process_id, event.file_index)
+                              .filename())
+                     .arg(reader.process(event.process_id).filename()));
+    }
+    return ret;
+  };
+
+  const QStringList one_thread = read(1);
+  EXPECT_EQ(400, one_thread.count());
+  EXPECT_EQ(one_thread, read(8));
+}
+
+TEST_F(TraceReaderTest, AddRecordHoldsEventsUntilTaken) {
+  pb::Record gcc = Process(1, "/usr/bin/gcc");
+  AddFile(&gcc, "foo.c", pb::File_Access_READ, "sha1", 3);
+  AddFile(&gcc, "foo.h", pb::File_Access_READ, "sha1", 1);
+  reader_.AddRecord(gcc);
+  EXPECT_EQ("/usr/bin/gcc", reader_.process(1).filename());
+  EXPECT_EQ(0, reader_.events().count());
+
+  // Only events before the ordering are taken.
+  EXPECT_EQ(0, reader_.TakeEvents(2));
+  ASSERT_EQ(1, reader_.events().count());
+  EXPECT_EQ(1, reader_.events()[0].file_index);
+
+  pb::Record ld = Process(2, "/usr/bin/ld");
+  AddFile(&ld, "foo.o", pb::File_Access_READ, "sha1", 2);
+  reader_.AddRecord(ld);
+
+  // Events from later processes are merged in order.
+  EXPECT_EQ(1, reader_.TakeEvents(10));
+  const QVector<FileEvent>& events = reader_.events();
+  ASSERT_EQ(3, events.count());
+  EXPECT_EQ(2, events[1].process_id);
+  EXPECT_EQ(1, events[2].process_id);
+  EXPECT_EQ(0, events[2].file_index);
+}